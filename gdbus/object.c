@@ -66,6 +66,7 @@ struct interface_data {
 	const GDBusMethodTable *methods;
 	const GDBusSignalTable *signals;
 	const GDBusPropertyTable *properties;
+	GDBusPropertiesFunction append_dict;
 	GSList *pending_prop;
 	void *user_data;
 	GDBusDestroyFunction destroy;
@@ -520,6 +521,15 @@ static void append_properties(struct interface_data *data,
 	DBusMessageIter dict;
 	const GDBusPropertyTable *p;
 
+	/*
+	 * Interfaces keeping their own property dictionary append it
+	 * in one go, so that the object manager can export them too.
+	 */
+	if (data->append_dict != NULL) {
+		data->append_dict(iter, data->user_data);
+		return;
+	}
+
 	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
 				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
 				DBUS_TYPE_STRING_AS_STRING
@@ -1365,6 +1375,47 @@ gboolean g_dbus_register_interface(DBusConnection *connection,
 	return TRUE;
 }
 
+gboolean g_dbus_register_interface_dict(DBusConnection *connection,
+					const char *path, const char *name,
+					const GDBusMethodTable *methods,
+					const GDBusSignalTable *signals,
+					GDBusPropertiesFunction properties,
+					void *user_data,
+					GDBusDestroyFunction destroy)
+{
+	struct generic_data *data;
+	struct interface_data *iface;
+
+	if (!g_dbus_register_interface(connection, path, name, methods,
+					signals, NULL, user_data, destroy))
+		return FALSE;
+
+	if (dbus_connection_get_object_path_data(connection, path,
+					(void *) &data) == FALSE || data == NULL)
+		return FALSE;
+
+	/*
+	 * The InterfacesAdded signal is only sent from the idle handler,
+	 * so setting the function here is early enough to be used by it.
+	 */
+	iface = find_interface(data->interfaces, name);
+	if (iface != NULL)
+		iface->append_dict = properties;
+
+	/* Only GetAll is served from the dictionary, Get and Set fail */
+	if (properties != NULL && !find_interface(data->interfaces,
+						DBUS_INTERFACE_PROPERTIES)) {
+		add_interface(data, DBUS_INTERFACE_PROPERTIES,
+				properties_methods, properties_signals, NULL,
+				data, NULL);
+
+		g_free(data->introspect);
+		data->introspect = NULL;
+	}
+
+	return TRUE;
+}
+
 gboolean g_dbus_unregister_interface(DBusConnection *connection,
 					const char *path, const char *name)
 {
@@ -48,6 +48,9 @@
 /* 5 minutes  */
 #define OFFER_TIME (5*60)
 
+/* Delay before changed leases are written to the lease file */
+#define LEASE_SAVE_DELAY 5
+
 struct _GDHCPServer {
 	int ref_count;
 	GDHCPType type;
@@ -61,8 +64,14 @@ struct _GDHCPServer {
 	int listener_sockfd;
 	guint listener_watch;
 	GIOChannel *listener_channel;
-	GList *lease_list;
+	GPtrArray *lease_heap;		/* ordered by expire time */
 	GHashTable *nip_lease_hash;
+	GHashTable *mac_lease_hash;
+	uint32_t *nip_bitmap;		/* addresses in use or reserved */
+	uint32_t first_free;		/* no free address below */
+	unsigned int conflicts;		/* addresses set after ARP check */
+	char *lease_file;
+	guint save_timeout;
 	GHashTable *option_hash; /* Options send to client */
 	GDHCPSaveLeaseFunc save_lease_func;
 	GDHCPLeaseAddedCb lease_added_cb;
@@ -74,6 +83,7 @@ struct dhcp_lease {
 	time_t expire;
 	uint32_t lease_nip;
 	uint8_t lease_mac[ETH_ALEN];
+	unsigned int heap_index;
 };
 
 static inline void debug(GDHCPServer *server, const char *format, ...)
@@ -92,28 +102,239 @@ static inline void debug(GDHCPServer *server, const char *format, ...)
 	va_end(ap);
 }
 
+static guint mac_hash(gconstpointer key)
+{
+	const uint8_t *mac = key;
+	guint hash = 5381;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		hash = hash * 33 + mac[i];
+
+	return hash;
+}
+
+static gboolean mac_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, ETH_ALEN) == 0;
+}
+
 static struct dhcp_lease *find_lease_by_mac(GDHCPServer *dhcp_server,
 						const uint8_t *mac)
 {
-	GList *list;
+	return g_hash_table_lookup(dhcp_server->mac_lease_hash, mac);
+}
+
+/*
+ * The leases are kept in a binary min-heap on their expire time, so
+ * the oldest lease is always at the top. Every lease remembers its
+ * position to allow removing or rescheduling it in O(log n).
+ */
+static void heap_swap(GPtrArray *heap, unsigned int i, unsigned int j)
+{
+	struct dhcp_lease *a = g_ptr_array_index(heap, i);
+	struct dhcp_lease *b = g_ptr_array_index(heap, j);
+
+	g_ptr_array_index(heap, i) = b;
+	g_ptr_array_index(heap, j) = a;
+
+	a->heap_index = j;
+	b->heap_index = i;
+}
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+static time_t heap_expire(GPtrArray *heap, unsigned int i)
+{
+	struct dhcp_lease *lease = g_ptr_array_index(heap, i);
+
+	return lease->expire;
+}
 
-		if (memcmp(lease->lease_mac, mac, ETH_ALEN) == 0)
-			return lease;
+static void heap_sift_up(GPtrArray *heap, unsigned int i)
+{
+	while (i > 0 && heap_expire(heap, (i - 1) / 2) >
+						heap_expire(heap, i)) {
+		heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
+}
 
-	return NULL;
+static void heap_sift_down(GPtrArray *heap, unsigned int i)
+{
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < heap->len) {
+		if (child + 1 < heap->len && heap_expire(heap, child + 1) <
+						heap_expire(heap, child))
+			child++;
+
+		if (heap_expire(heap, i) <= heap_expire(heap, child))
+			break;
+
+		heap_swap(heap, i, child);
+		i = child;
+	}
 }
 
-static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+static void heap_insert(GPtrArray *heap, struct dhcp_lease *lease)
+{
+	lease->heap_index = heap->len;
+	g_ptr_array_add(heap, lease);
+
+	heap_sift_up(heap, lease->heap_index);
+}
+
+static void heap_remove(GPtrArray *heap, struct dhcp_lease *lease)
+{
+	unsigned int i = lease->heap_index;
+	unsigned int last = heap->len - 1;
+
+	if (i != last)
+		heap_swap(heap, i, last);
+
+	g_ptr_array_remove_index(heap, last);
+
+	if (i == last)
+		return;
+
+	heap_sift_up(heap, i);
+	heap_sift_down(heap, i);
+}
+
+static struct dhcp_lease *heap_oldest(GPtrArray *heap)
 {
-	dhcp_server->lease_list =
-			g_list_remove(dhcp_server->lease_list, lease);
+	if (heap->len == 0)
+		return NULL;
 
+	return g_ptr_array_index(heap, 0);
+}
+
+/*
+ * One bit per address of the range, set while the address has a
+ * lease or must not be handed out at all.
+ */
+static void bitmap_set(GDHCPServer *dhcp_server, uint32_t nip)
+{
+	uint32_t i;
+
+	if (!dhcp_server->nip_bitmap || nip < dhcp_server->start_ip ||
+					nip > dhcp_server->end_ip)
+		return;
+
+	i = nip - dhcp_server->start_ip;
+	dhcp_server->nip_bitmap[i / 32] |= 1U << (i % 32);
+}
+
+static void bitmap_clear(GDHCPServer *dhcp_server, uint32_t nip)
+{
+	uint32_t i;
+
+	/* e.g. 192.168.55.0 and 192.168.55.255 stay reserved */
+	if ((nip & 0xff) == 0 || (nip & 0xff) == 0xff)
+		return;
+
+	if (!dhcp_server->nip_bitmap || nip < dhcp_server->start_ip ||
+					nip > dhcp_server->end_ip)
+		return;
+
+	i = nip - dhcp_server->start_ip;
+	dhcp_server->nip_bitmap[i / 32] &= ~(1U << (i % 32));
+
+	if (i < dhcp_server->first_free)
+		dhcp_server->first_free = i;
+}
+
+static uint32_t bitmap_find_free(GDHCPServer *dhcp_server)
+{
+	uint32_t size, i, word;
+
+	if (!dhcp_server->nip_bitmap)
+		return 0;
+
+	size = dhcp_server->end_ip - dhcp_server->start_ip + 1;
+
+	for (i = dhcp_server->first_free / 32; i * 32 < size; i++) {
+		word = ~dhcp_server->nip_bitmap[i];
+		if (word == 0)
+			continue;
+
+		i = i * 32 + g_bit_nth_lsf(word, -1);
+		if (i >= size)
+			break;
+
+		dhcp_server->first_free = i;
+
+		return dhcp_server->start_ip + i;
+	}
+
+	dhcp_server->first_free = size;
+
+	return 0;
+}
+
+static void build_bitmap(GDHCPServer *dhcp_server)
+{
+	uint32_t size, words, nip;
+	GHashTableIter iter;
+	gpointer key;
+
+	g_free(dhcp_server->nip_bitmap);
+	dhcp_server->nip_bitmap = NULL;
+	dhcp_server->first_free = 0;
+	dhcp_server->conflicts = 0;
+
+	if (dhcp_server->start_ip == 0 ||
+			dhcp_server->end_ip < dhcp_server->start_ip)
+		return;
+
+	size = dhcp_server->end_ip - dhcp_server->start_ip + 1;
+	words = (size + 31) / 32;
+
+	dhcp_server->nip_bitmap = g_new0(uint32_t, words);
+
+	/* The bits behind the end of the range are never free */
+	if (size % 32)
+		dhcp_server->nip_bitmap[words - 1] = ~0U << (size % 32);
+
+	for (nip = dhcp_server->start_ip & ~0xffU;
+			nip <= dhcp_server->end_ip; nip += 0x100) {
+		bitmap_set(dhcp_server, nip);
+		bitmap_set(dhcp_server, nip | 0xff);
+
+		if (nip + 0x100 < nip)
+			break;
+	}
+
+	g_hash_table_iter_init(&iter, dhcp_server->nip_lease_hash);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		bitmap_set(dhcp_server, GPOINTER_TO_UINT(key));
+}
+
+static void schedule_save_leases(GDHCPServer *dhcp_server);
+
+static void insert_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	g_hash_table_replace(dhcp_server->nip_lease_hash,
+				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	g_hash_table_replace(dhcp_server->mac_lease_hash,
+				lease->lease_mac, lease);
+	heap_insert(dhcp_server->lease_heap, lease);
+	bitmap_set(dhcp_server, lease->lease_nip);
+}
+
+static void detach_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
 	g_hash_table_remove(dhcp_server->nip_lease_hash,
 				GINT_TO_POINTER((int) lease->lease_nip));
+	g_hash_table_remove(dhcp_server->mac_lease_hash, lease->lease_mac);
+	heap_remove(dhcp_server->lease_heap, lease);
+	bitmap_clear(dhcp_server, lease->lease_nip);
+
+	schedule_save_leases(dhcp_server);
+}
+
+static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	detach_lease(dhcp_server, lease);
 	g_free(lease);
 }
 
@@ -145,29 +366,18 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	debug(dhcp_server, "lease_mac %p lease_nip %p", lease_mac, lease_nip);
 
 	if (lease_nip) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_nip);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) ntohl(yiaddr)));
-
-		if (!lease_mac)
-			*lease = lease_nip;
-		else if (lease_nip != lease_mac) {
+		detach_lease(dhcp_server, lease_nip);
+
+		if (lease_mac && lease_nip != lease_mac)
 			remove_lease(dhcp_server, lease_mac);
-			*lease = lease_nip;
-		} else
-			*lease = lease_nip;
+
+		*lease = lease_nip;
 
 		return 0;
 	}
 
 	if (lease_mac) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_mac);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease_mac->lease_nip));
+		detach_lease(dhcp_server, lease_mac);
 		*lease = lease_mac;
 
 		return 0;
@@ -180,14 +390,6 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	return 0;
 }
 
-static gint compare_expire(gconstpointer a, gconstpointer b)
-{
-	const struct dhcp_lease *lease1 = a;
-	const struct dhcp_lease *lease2 = b;
-
-	return lease2->expire - lease1->expire;
-}
-
 static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 					const uint8_t *chaddr, uint32_t yiaddr)
 {
@@ -206,13 +408,10 @@ static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 	if (expire == 0)
 		lease->expire = time(NULL) + dhcp_server->lease_seconds;
 	else
-		lease->expire = expire;
+		lease->expire = time(NULL) + expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
-
-	g_hash_table_insert(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	insert_lease(dhcp_server, lease);
+	schedule_save_leases(dhcp_server);
 
 	return lease;
 }
@@ -244,31 +443,29 @@ static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 {
 	uint32_t ip_addr;
 	struct dhcp_lease *lease;
-	GList *list;
-	ip_addr = dhcp_server->start_ip;
-	for (; ip_addr <= dhcp_server->end_ip; ip_addr++) {
-		/* e.g. 192.168.55.0 */
-		if ((ip_addr & 0xff) == 0)
-			continue;
-
-		/* e.g. 192.168.55.255 */
-		if ((ip_addr & 0xff) == 0xff)
-			continue;
-
-		lease = find_lease_by_nip(dhcp_server, ip_addr);
-		if (lease)
-			continue;
+	bool retried = false;
 
+again:
+	while ((ip_addr = bitmap_find_free(dhcp_server)) != 0) {
 		if (arp_check(htonl(ip_addr), safe_mac))
 			return ip_addr;
+
+		/* Somebody else uses it, skip it until the pool runs out */
+		bitmap_set(dhcp_server, ip_addr);
+		dhcp_server->conflicts++;
 	}
 
-	/* The last lease is the oldest one */
-	list = g_list_last(dhcp_server->lease_list);
-	if (!list)
-		return 0;
+	/*
+	 * Only a lease clears its bit again, so the conflicting addresses
+	 * are given another chance before an old lease is taken over.
+	 */
+	if (dhcp_server->conflicts > 0 && !retried) {
+		build_bitmap(dhcp_server);
+		retried = true;
+		goto again;
+	}
 
-	lease = list->data;
+	lease = heap_oldest(dhcp_server->lease_heap);
 	if (!lease)
 		return 0;
 
@@ -284,31 +481,158 @@ static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 static void lease_set_expire(GDHCPServer *dhcp_server,
 			struct dhcp_lease *lease, uint32_t expire)
 {
-	dhcp_server->lease_list = g_list_remove(dhcp_server->lease_list, lease);
-
 	lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
+	heap_sift_up(dhcp_server->lease_heap, lease->heap_index);
+	heap_sift_down(dhcp_server->lease_heap, lease->heap_index);
+
+	schedule_save_leases(dhcp_server);
 }
 
-static void destroy_lease_table(GDHCPServer *dhcp_server)
+/*
+ * The lease file holds one lease per line:
+ *
+ *	<MAC address> <IP address> <expire time in seconds since epoch>
+ */
+static void save_lease_file(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	struct dhcp_lease *lease;
+	struct in_addr addr;
+	GString *str;
+	GError *error = NULL;
+	time_t now;
+	unsigned int i;
 
-	g_hash_table_destroy(dhcp_server->nip_lease_hash);
+	if (!dhcp_server->lease_file)
+		return;
 
-	dhcp_server->nip_lease_hash = NULL;
+	str = g_string_sized_new(dhcp_server->lease_heap->len * 48);
+	now = time(NULL);
+
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		lease = g_ptr_array_index(dhcp_server->lease_heap, i);
+
+		if (lease->expire <= now)
+			continue;
+
+		addr.s_addr = htonl(lease->lease_nip);
+
+		g_string_append_printf(str,
+			"%02x:%02x:%02x:%02x:%02x:%02x %s %lu\n",
+			lease->lease_mac[0], lease->lease_mac[1],
+			lease->lease_mac[2], lease->lease_mac[3],
+			lease->lease_mac[4], lease->lease_mac[5],
+			inet_ntoa(addr), (unsigned long) lease->expire);
+	}
+
+	if (!g_file_set_contents(dhcp_server->lease_file, str->str,
+						str->len, &error)) {
+		debug(dhcp_server, "Failed to store leases: %s",
+							error->message);
+		g_error_free(error);
+	}
+
+	g_string_free(str, TRUE);
+}
+
+static gboolean save_leases_timeout(gpointer user_data)
+{
+	GDHCPServer *dhcp_server = user_data;
+
+	dhcp_server->save_timeout = 0;
+
+	save_lease_file(dhcp_server);
+
+	return FALSE;
+}
+
+static void schedule_save_leases(GDHCPServer *dhcp_server)
+{
+	if (!dhcp_server->lease_file || dhcp_server->save_timeout > 0)
+		return;
+
+	dhcp_server->save_timeout = g_timeout_add_seconds(LEASE_SAVE_DELAY,
+					save_leases_timeout, dhcp_server);
+}
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+static void load_lease_file(GDHCPServer *dhcp_server)
+{
+	struct dhcp_lease *lease;
+	struct in_addr addr;
+	unsigned int mac[ETH_ALEN];
+	unsigned long expire;
+	char ip[16], **lines;
+	gchar *contents;
+	time_t now;
+	int i, j;
+
+	if (!dhcp_server->lease_file)
+		return;
+
+	if (!g_file_get_contents(dhcp_server->lease_file, &contents,
+								NULL, NULL))
+		return;
+
+	lines = g_strsplit(contents, "\n", 0);
+	g_free(contents);
+
+	now = time(NULL);
+
+	for (i = 0; lines[i]; i++) {
+		if (sscanf(lines[i], "%x:%x:%x:%x:%x:%x %15s %lu",
+				&mac[0], &mac[1], &mac[2], &mac[3],
+				&mac[4], &mac[5], ip, &expire) != 8)
+			continue;
+
+		if (inet_aton(ip, &addr) == 0 || (time_t) expire <= now)
+			continue;
+
+		/* The range might have changed since the leases were saved */
+		if (ntohl(addr.s_addr) < dhcp_server->start_ip ||
+				ntohl(addr.s_addr) > dhcp_server->end_ip)
+			continue;
+
+		if (find_lease_by_nip(dhcp_server, ntohl(addr.s_addr)))
+			continue;
+
+		lease = g_try_new0(struct dhcp_lease, 1);
+		if (!lease)
+			break;
+
+		for (j = 0; j < ETH_ALEN; j++)
+			lease->lease_mac[j] = mac[j];
 
-		g_free(lease);
+		if (find_lease_by_mac(dhcp_server, lease->lease_mac)) {
+			g_free(lease);
+			continue;
+		}
+
+		lease->lease_nip = ntohl(addr.s_addr);
+		lease->expire = expire;
+
+		insert_lease(dhcp_server, lease);
 	}
 
-	g_list_free(dhcp_server->lease_list);
+	g_strfreev(lines);
 
-	dhcp_server->lease_list = NULL;
+	debug(dhcp_server, "Loaded %u leases", dhcp_server->lease_heap->len);
+}
+
+static void destroy_lease_table(GDHCPServer *dhcp_server)
+{
+	g_hash_table_destroy(dhcp_server->nip_lease_hash);
+	g_hash_table_destroy(dhcp_server->mac_lease_hash);
+
+	dhcp_server->nip_lease_hash = NULL;
+	dhcp_server->mac_lease_hash = NULL;
+
+	g_ptr_array_foreach(dhcp_server->lease_heap, (GFunc) g_free, NULL);
+	g_ptr_array_free(dhcp_server->lease_heap, TRUE);
+
+	dhcp_server->lease_heap = NULL;
+
+	g_free(dhcp_server->nip_bitmap);
+	dhcp_server->nip_bitmap = NULL;
 }
 static uint32_t get_interface_address(int index)
 {
@@ -382,6 +706,9 @@ GDHCPServer *g_dhcp_server_new(GDHCPType type,
 
 	dhcp_server->nip_lease_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
+	dhcp_server->mac_lease_hash = g_hash_table_new_full(mac_hash,
+						mac_equal, NULL, NULL);
+	dhcp_server->lease_heap = g_ptr_array_new();
 	dhcp_server->option_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
 
@@ -578,13 +905,21 @@ static void send_offer(GDHCPServer *dhcp_server,
 
 static void save_lease(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	struct dhcp_lease *lease;
+	unsigned int i;
+
+	if (dhcp_server->save_timeout > 0) {
+		g_source_remove(dhcp_server->save_timeout);
+		dhcp_server->save_timeout = 0;
+
+		save_lease_file(dhcp_server);
+	}
 
 	if (!dhcp_server->save_lease_func)
 		return;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		lease = g_ptr_array_index(dhcp_server->lease_heap, i);
 		dhcp_server->save_lease_func(lease->lease_mac,
 					lease->lease_nip, lease->expire);
 	}
@@ -747,7 +1082,7 @@ static gboolean listener_event(GIOChannel *channel, GIOCondition condition,
 	return TRUE;
 }
 
-/* Caller need to load leases before call it */
+/* Leases of the lease file, if any, are loaded when starting */
 int g_dhcp_server_start(GDHCPServer *dhcp_server)
 {
 	GIOChannel *listener_channel;
@@ -756,6 +1091,9 @@ int g_dhcp_server_start(GDHCPServer *dhcp_server)
 	if (dhcp_server->started)
 		return 0;
 
+	if (dhcp_server->lease_heap->len == 0)
+		load_lease_file(dhcp_server);
+
 	listener_sockfd = dhcp_l3_socket(SERVER_PORT,
 					dhcp_server->interface, AF_INET);
 	if (listener_sockfd < 0)
@@ -819,6 +1157,21 @@ void g_dhcp_server_set_save_lease(GDHCPServer *dhcp_server,
 	dhcp_server->save_lease_func = func;
 }
 
+int g_dhcp_server_set_lease_file(GDHCPServer *dhcp_server,
+							const char *path)
+{
+	if (!dhcp_server)
+		return -EINVAL;
+
+	if (dhcp_server->started)
+		return -EBUSY;
+
+	g_free(dhcp_server->lease_file);
+	dhcp_server->lease_file = g_strdup(path);
+
+	return 0;
+}
+
 void g_dhcp_server_set_lease_added_cb(GDHCPServer *dhcp_server,
 							GDHCPLeaseAddedCb cb)
 {
@@ -867,6 +1220,7 @@ void g_dhcp_server_unref(GDHCPServer *dhcp_server)
 
 	destroy_lease_table(dhcp_server);
 
+	g_free(dhcp_server->lease_file);
 	g_free(dhcp_server->interface);
 
 	g_free(dhcp_server);
@@ -887,6 +1241,8 @@ int g_dhcp_server_set_ip_range(GDHCPServer *dhcp_server,
 
 	dhcp_server->end_ip = ntohl(_host_addr.s_addr);
 
+	build_bitmap(dhcp_server);
+
 	return 0;
 }
 
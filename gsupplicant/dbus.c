@@ -65,6 +65,7 @@ struct property_call_data {
 	gpointer caller;
 	DBusPendingCall *pending_call;
 	supplicant_dbus_property_function function;
+	supplicant_dbus_result_function result;
 	void *user_data;
 };
 
@@ -172,29 +173,41 @@ static void property_get_all_reply(DBusPendingCall *call, void *user_data)
 	struct property_call_data *property_call = user_data;
 	DBusMessage *reply;
 	DBusMessageIter iter;
+	const char *error = NULL;
+
+	/* The call is done, the callbacks must not be able to cancel it */
+	property_calls = g_slist_remove(property_calls, property_call);
 
 	reply = dbus_pending_call_steal_reply(call);
 
-	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		error = dbus_message_get_error_name(reply);
 		goto done;
+	}
 
-	if (!dbus_message_iter_init(reply, &iter))
+	if (!dbus_message_iter_init(reply, &iter)) {
+		error = DBUS_ERROR_INVALID_ARGS;
 		goto done;
+	}
 
 	supplicant_dbus_property_foreach(&iter, property_call->function,
 						property_call->user_data);
 
-	if (property_call->function)
+	if (!property_call->result && property_call->function)
 		property_call->function(NULL, NULL, property_call->user_data);
 
 done:
+	if (property_call->result)
+		property_call->result(error, NULL, property_call->user_data);
+
 	dbus_message_unref(reply);
 
 	dbus_pending_call_unref(call);
 }
 
-int supplicant_dbus_property_get_all(const char *path, const char *interface,
+static int property_get_all(const char *path, const char *interface,
 				supplicant_dbus_property_function function,
+				supplicant_dbus_result_function result,
 				void *user_data, gpointer caller)
 {
 	struct property_call_data *property_call = NULL;
@@ -238,6 +251,7 @@ int supplicant_dbus_property_get_all(const char *path, const char *interface,
 	property_call->caller = caller;
 	property_call->pending_call = call;
 	property_call->function = function;
+	property_call->result = result;
 	property_call->user_data = user_data;
 
 	property_calls = g_slist_prepend(property_calls, property_call);
@@ -250,6 +264,28 @@ int supplicant_dbus_property_get_all(const char *path, const char *interface,
 	return 0;
 }
 
+int supplicant_dbus_property_get_all(const char *path, const char *interface,
+				supplicant_dbus_property_function function,
+				void *user_data, gpointer caller)
+{
+	return property_get_all(path, interface, function, NULL,
+							user_data, caller);
+}
+
+/*
+ * Instead of calling function with a NULL key once all properties are
+ * known, result is called when the call is finished, also if it failed.
+ */
+int supplicant_dbus_property_get_all_result(const char *path,
+				const char *interface,
+				supplicant_dbus_property_function function,
+				supplicant_dbus_result_function result,
+				void *user_data, gpointer caller)
+{
+	return property_get_all(path, interface, function, result,
+							user_data, caller);
+}
+
 static void property_get_reply(DBusPendingCall *call, void *user_data)
 {
 	struct property_call_data *property_call = user_data;
@@ -56,6 +56,12 @@ int supplicant_dbus_property_get_all(const char *path, const char *interface,
 				supplicant_dbus_property_function function,
 				void *user_data, gpointer caller);
 
+int supplicant_dbus_property_get_all_result(const char *path,
+				const char *interface,
+				supplicant_dbus_property_function function,
+				supplicant_dbus_result_function result,
+				void *user_data, gpointer caller);
+
 int supplicant_dbus_property_get(const char *path, const char *interface,
 				const char *method,
 				supplicant_dbus_property_function function,
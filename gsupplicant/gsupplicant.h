@@ -268,6 +268,11 @@ int g_supplicant_interface_disconnect(GSupplicantInterface *interface,
 					GSupplicantInterfaceCallback callback,
 							void *user_data);
 
+int g_supplicant_interface_roam(GSupplicantInterface *interface,
+					const unsigned char *bssid,
+					GSupplicantInterfaceCallback callback,
+							void *user_data);
+
 int g_supplicant_interface_set_apscan(GSupplicantInterface *interface,
 							unsigned int ap_scan);
 
@@ -307,6 +312,11 @@ struct _GSupplicantGroup;
 typedef struct _GSupplicantNetwork GSupplicantNetwork;
 typedef struct _GSupplicantGroup GSupplicantGroup;
 
+typedef void (*GSupplicantBSSFunction) (const unsigned char *bssid,
+					dbus_int16_t signal,
+					dbus_uint16_t frequency,
+					void *user_data);
+
 GSupplicantInterface *g_supplicant_network_get_interface(GSupplicantNetwork *network);
 const char *g_supplicant_network_get_name(GSupplicantNetwork *network);
 const char *g_supplicant_network_get_identifier(GSupplicantNetwork *network);
@@ -322,6 +332,9 @@ dbus_bool_t g_supplicant_network_get_wps(GSupplicantNetwork *network);
 dbus_bool_t g_supplicant_network_is_wps_active(GSupplicantNetwork *network);
 dbus_bool_t g_supplicant_network_is_wps_pbc(GSupplicantNetwork *network);
 dbus_bool_t g_supplicant_network_is_wps_advertizing(GSupplicantNetwork *network);
+void g_supplicant_network_foreach_bss(GSupplicantNetwork *network,
+					GSupplicantBSSFunction function,
+					void *user_data);
 
 GSupplicantInterface *g_supplicant_peer_get_interface(GSupplicantPeer *peer);
 const char *g_supplicant_peer_get_path(GSupplicantPeer *peer);
@@ -46,6 +46,17 @@
 
 #define BSS_UNKNOWN_STRENGTH    -90
 
+/*
+ * New BSSs are collected and added to their networks in one go, at the
+ * latest after this many milliseconds when no ScanDone signal arrives.
+ */
+#define BSS_BATCH_TIMEOUT	500
+
+/* Network changes collected while adding a batch of BSSs */
+#define BSS_BATCH_NETWORK_ADDED		(1 << 0)
+#define BSS_BATCH_NETWORK_SIGNAL	(1 << 1)
+#define BSS_BATCH_NETWORK_WPS		(1 << 2)
+
 static DBusConnection *connection;
 
 static const GSupplicantCallbacks *callbacks_pointer;
@@ -186,25 +197,35 @@ struct _GSupplicantInterface {
 	GHashTable *network_table;
 	GHashTable *peer_table;
 	GHashTable *group_table;
-	GHashTable *bss_mapping;
+	GHashTable *bss_mapping;	/* path to bss */
+	GHashTable *bss_pending;
+	GSList *bss_batch;
+	unsigned int bss_fetching;
+	guint bss_batch_timeout;
+	size_t bss_memory;	/* networks and BSSs */
 	void *data;
 	const char *pending_peer_path;
 	GSupplicantNetwork *current_network;
 	struct added_network_information network_info;
 };
 
+/*
+ * Fields are ordered by size to keep the entry small, as dense
+ * environments easily report several hundred BSSs per interface.
+ */
 struct g_supplicant_bss {
 	GSupplicantInterface *interface;
+	GSupplicantNetwork *network;
 	char *path;
-	unsigned char bssid[6];
-	unsigned char ssid[32];
+	unsigned int heap_index;
 	unsigned int ssid_len;
+	unsigned char ssid[32];
+	unsigned char bssid[6];
 	dbus_uint16_t frequency;
-	dbus_uint32_t maxrate;
 	dbus_int16_t signal;
+	dbus_uint32_t maxrate;
 	GSupplicantMode mode;
 	GSupplicantSecurity security;
-	dbus_bool_t rsn_selected;
 	unsigned int wpa_keymgmt;
 	unsigned int wpa_pairwise;
 	unsigned int wpa_group;
@@ -212,10 +233,11 @@ struct g_supplicant_bss {
 	unsigned int rsn_pairwise;
 	unsigned int rsn_group;
 	unsigned int keymgmt;
-	dbus_bool_t privacy;
-	dbus_bool_t psk;
-	dbus_bool_t ieee8021x;
 	unsigned int wps_capabilities;
+	bool rsn_selected;
+	bool privacy;
+	bool psk;
+	bool ieee8021x;
 };
 
 struct _GSupplicantNetwork {
@@ -232,7 +254,7 @@ struct _GSupplicantNetwork {
 	GSupplicantSecurity security;
 	dbus_bool_t wps;
 	unsigned int wps_capabilities;
-	GHashTable *bss_table;
+	GPtrArray *bss_heap;		/* ordered by signal, strongest first */
 	GHashTable *config_table;
 };
 
@@ -703,8 +725,14 @@ static void remove_interface(gpointer data)
 {
 	GSupplicantInterface *interface = data;
 
-	g_hash_table_destroy(interface->bss_mapping);
+	if (interface->bss_batch_timeout)
+		g_source_remove(interface->bss_batch_timeout);
+
+	g_slist_free(interface->bss_batch);
+	g_hash_table_destroy(interface->bss_pending);
+
 	g_hash_table_destroy(interface->network_table);
+	g_hash_table_destroy(interface->bss_mapping);
 	g_hash_table_destroy(interface->peer_table);
 	g_hash_table_destroy(interface->group_table);
 
@@ -735,11 +763,50 @@ static void remove_interface(gpointer data)
 	g_free(interface);
 }
 
+static void remove_bss(gpointer data)
+{
+	struct g_supplicant_bss *bss = data;
+
+	supplicant_dbus_property_call_cancel_all(bss);
+
+	g_free(bss->path);
+	g_free(bss);
+}
+
+static size_t network_memory(GSupplicantNetwork *network)
+{
+	return sizeof(*network) + strlen(network->path) +
+		strlen(network->group) + strlen(network->name) + 3;
+}
+
+static size_t bss_memory(struct g_supplicant_bss *bss)
+{
+	/* The BSS and its slot in the heap of the network */
+	return sizeof(*bss) + strlen(bss->path) + 1 + sizeof(gpointer);
+}
+
 static void remove_network(gpointer data)
 {
 	GSupplicantNetwork *network = data;
+	GSupplicantInterface *interface = network->interface;
+	unsigned int i;
+
+	interface->bss_memory -= network_memory(network);
+
+	for (i = 0; i < network->bss_heap->len; i++) {
+		struct g_supplicant_bss *bss;
+
+		bss = g_ptr_array_index(network->bss_heap, i);
+		interface->bss_memory -= bss_memory(bss);
 
-	g_hash_table_destroy(network->bss_table);
+		g_hash_table_remove(interface->bss_mapping, bss->path);
+		if (bss_mapping)
+			g_hash_table_remove(bss_mapping, bss->path);
+
+		remove_bss(bss);
+	}
+
+	g_ptr_array_free(network->bss_heap, TRUE);
 
 	callback_network_removed(network);
 
@@ -751,16 +818,6 @@ static void remove_network(gpointer data)
 	g_free(network);
 }
 
-static void remove_bss(gpointer data)
-{
-	struct g_supplicant_bss *bss = data;
-
-	supplicant_dbus_property_call_cancel_all(bss);
-
-	g_free(bss->path);
-	g_free(bss);
-}
-
 static void remove_peer(gpointer data)
 {
 	GSupplicantPeer *peer = data;
@@ -1164,8 +1221,11 @@ const char *g_supplicant_network_get_identifier(GSupplicantNetwork *network)
 
 const unsigned char *g_supplicant_network_get_bssid (GSupplicantNetwork *network)
 {
+	static const unsigned char no_bssid[6];
+
+	/* A full address, callers copy 6 bytes */
 	if (!network || !network->best_bss)
-		return (unsigned char *)"";
+		return no_bssid;
 
 	return network->best_bss->bssid;
 }
@@ -1222,6 +1282,23 @@ dbus_uint16_t g_supplicant_network_get_frequency(GSupplicantNetwork *network)
 	return network->frequency;
 }
 
+void g_supplicant_network_foreach_bss(GSupplicantNetwork *network,
+					GSupplicantBSSFunction function,
+					void *user_data)
+{
+	unsigned int i;
+
+	if (!network || !function)
+		return;
+
+	for (i = 0; i < network->bss_heap->len; i++) {
+		struct g_supplicant_bss *bss;
+
+		bss = g_ptr_array_index(network->bss_heap, i);
+		function(bss->bssid, bss->signal, bss->frequency, user_data);
+	}
+}
+
 dbus_bool_t g_supplicant_network_get_wps(GSupplicantNetwork *network)
 {
 	if (!network)
@@ -1580,10 +1657,136 @@ static char *create_group(struct g_supplicant_bss *bss)
 	return g_string_free(str, FALSE);
 }
 
-static int add_or_replace_bss_to_network(struct g_supplicant_bss *bss)
+/*
+ * The BSSs of a network are kept in a binary max-heap on their signal,
+ * so the strongest one is always found at the top.
+ */
+static void bss_heap_swap(GPtrArray *heap, unsigned int i, unsigned int j)
+{
+	struct g_supplicant_bss *a = g_ptr_array_index(heap, i);
+	struct g_supplicant_bss *b = g_ptr_array_index(heap, j);
+
+	g_ptr_array_index(heap, i) = b;
+	g_ptr_array_index(heap, j) = a;
+
+	a->heap_index = j;
+	b->heap_index = i;
+}
+
+static dbus_int16_t bss_heap_signal(GPtrArray *heap, unsigned int i)
+{
+	struct g_supplicant_bss *bss = g_ptr_array_index(heap, i);
+
+	return bss->signal;
+}
+
+static void bss_heap_sift_up(GPtrArray *heap, unsigned int i)
+{
+	while (i > 0 && bss_heap_signal(heap, (i - 1) / 2) <
+						bss_heap_signal(heap, i)) {
+		bss_heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void bss_heap_sift_down(GPtrArray *heap, unsigned int i)
+{
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < heap->len) {
+		if (child + 1 < heap->len &&
+				bss_heap_signal(heap, child + 1) >
+					bss_heap_signal(heap, child))
+			child++;
+
+		if (bss_heap_signal(heap, i) >= bss_heap_signal(heap, child))
+			break;
+
+		bss_heap_swap(heap, i, child);
+		i = child;
+	}
+}
+
+static void bss_heap_insert(GPtrArray *heap, struct g_supplicant_bss *bss)
+{
+	bss->heap_index = heap->len;
+	g_ptr_array_add(heap, bss);
+
+	bss_heap_sift_up(heap, bss->heap_index);
+}
+
+static void bss_heap_remove(GPtrArray *heap, struct g_supplicant_bss *bss)
+{
+	unsigned int i = bss->heap_index;
+	unsigned int last = heap->len - 1;
+
+	if (i != last)
+		bss_heap_swap(heap, i, last);
+
+	g_ptr_array_remove_index(heap, last);
+
+	if (i == last)
+		return;
+
+	bss_heap_sift_up(heap, i);
+	bss_heap_sift_down(heap, i);
+}
+
+static void bss_heap_update(GPtrArray *heap, struct g_supplicant_bss *bss)
+{
+	bss_heap_sift_up(heap, bss->heap_index);
+	bss_heap_sift_down(heap, bss->heap_index);
+}
+
+static struct g_supplicant_bss *bss_heap_strongest(GPtrArray *heap)
+{
+	if (heap->len == 0)
+		return NULL;
+
+	return g_ptr_array_index(heap, 0);
+}
+
+/*
+ * Unlinks the BSS from its network and the path mappings, the caller
+ * takes over the BSS.
+ */
+static void detach_bss(struct g_supplicant_bss *bss)
+{
+	GSupplicantNetwork *network = bss->network;
+
+	if (network->best_bss == bss) {
+		network->best_bss = NULL;
+		network->signal = BSS_UNKNOWN_STRENGTH;
+	}
+
+	g_hash_table_remove(bss_mapping, bss->path);
+	g_hash_table_remove(bss->interface->bss_mapping, bss->path);
+
+	bss_heap_remove(network->bss_heap, bss);
+	bss->network = NULL;
+
+	bss->interface->bss_memory -= bss_memory(bss);
+}
+
+static void batch_network_changed(GHashTable *changes,
+				GSupplicantNetwork *network, unsigned int flag)
+{
+	unsigned int flags;
+
+	flags = GPOINTER_TO_UINT(g_hash_table_lookup(changes, network));
+	g_hash_table_replace(changes, network, GUINT_TO_POINTER(flags | flag));
+}
+
+/*
+ * With changes set, the network callbacks are not called but the
+ * changes are recorded per network for the caller to report them.
+ */
+static int add_or_replace_bss_to_network(struct g_supplicant_bss *bss,
+							GHashTable *changes)
 {
 	GSupplicantInterface *interface = bss->interface;
 	GSupplicantNetwork *network;
+	struct g_supplicant_bss *old_bss;
 	char *group;
 	bool is_new_network;
 
@@ -1630,16 +1833,20 @@ static int add_or_replace_bss_to_network(struct g_supplicant_bss *bss)
 
 	SUPPLICANT_DBG("New network %s created", network->name);
 
-	network->bss_table = g_hash_table_new_full(g_str_hash, g_str_equal,
-							NULL, remove_bss);
+	network->bss_heap = g_ptr_array_new();
 
 	network->config_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 							g_free, g_free);
 
 	g_hash_table_replace(interface->network_table,
 						network->group, network);
+	interface->bss_memory += network_memory(network);
 
-	callback_network_added(network);
+	if (changes)
+		batch_network_changed(changes, network,
+					BSS_BATCH_NETWORK_ADDED);
+	else
+		callback_network_added(network);
 
 done:
 	/* We update network's WPS properties if only bss provides WPS. */
@@ -1647,7 +1854,10 @@ done:
 		network->wps = TRUE;
 		network->wps_capabilities = bss->wps_capabilities;
 
-		if (!is_new_network)
+		if (changes)
+			batch_network_changed(changes, network,
+						BSS_BATCH_NETWORK_WPS);
+		else if (!is_new_network)
 			callback_network_changed(network, "WPSCapabilities");
 	}
 
@@ -1659,12 +1869,25 @@ done:
 				bss->signal > network->signal) {
 		network->signal = bss->signal;
 		network->best_bss = bss;
-		callback_network_changed(network, "Signal");
+
+		if (changes)
+			batch_network_changed(changes, network,
+						BSS_BATCH_NETWORK_SIGNAL);
+		else
+			callback_network_changed(network, "Signal");
 	}
 
-	g_hash_table_replace(interface->bss_mapping, bss->path, network);
-	g_hash_table_replace(network->bss_table, bss->path, bss);
+	old_bss = g_hash_table_lookup(interface->bss_mapping, bss->path);
+	if (old_bss && old_bss != bss) {
+		detach_bss(old_bss);
+		remove_bss(old_bss);
+	}
+
+	bss->network = network;
+	bss_heap_insert(network->bss_heap, bss);
+	interface->bss_memory += bss_memory(bss);
 
+	g_hash_table_replace(interface->bss_mapping, bss->path, bss);
 	g_hash_table_replace(bss_mapping, bss->path, interface);
 
 	return 0;
@@ -2017,7 +2240,6 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 							void *user_data)
 {
 	GSupplicantInterface *interface = user_data;
-	GSupplicantNetwork *network;
 	struct g_supplicant_bss *bss;
 	const char *path = NULL;
 
@@ -2032,12 +2254,11 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 
 	SUPPLICANT_DBG("%s", path);
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (network) {
-		bss = g_hash_table_lookup(network->bss_table, path);
-		if (bss)
-			return NULL;
-	}
+	if (g_hash_table_lookup(interface->bss_mapping, path))
+		return NULL;
+
+	if (g_hash_table_lookup(interface->bss_pending, path))
+		return NULL;
 
 	bss = g_try_new0(struct g_supplicant_bss, 1);
 	if (!bss)
@@ -2050,27 +2271,155 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 	return bss;
 }
 
+static gboolean bss_batch_timeout(gpointer user_data);
+
+static void bss_batch_add(GSupplicantInterface *interface,
+					struct g_supplicant_bss *bss)
+{
+	bss_compute_security(bss);
+
+	interface->bss_batch = g_slist_prepend(interface->bss_batch, bss);
+
+	if (!interface->bss_batch_timeout)
+		interface->bss_batch_timeout = g_timeout_add(BSS_BATCH_TIMEOUT,
+						bss_batch_timeout, interface);
+}
+
+static void bss_batch_flush(GSupplicantInterface *interface)
+{
+	GHashTable *changes;
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *list;
+
+	if (interface->bss_batch_timeout) {
+		g_source_remove(interface->bss_batch_timeout);
+		interface->bss_batch_timeout = 0;
+	}
+
+	if (!interface->bss_batch)
+		return;
+
+	SUPPLICANT_DBG("%d BSSs", g_slist_length(interface->bss_batch));
+
+	changes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	interface->bss_batch = g_slist_reverse(interface->bss_batch);
+
+	for (list = interface->bss_batch; list; list = list->next) {
+		struct g_supplicant_bss *bss = list->data;
+
+		g_hash_table_steal(interface->bss_pending, bss->path);
+
+		if (add_or_replace_bss_to_network(bss, changes) < 0) {
+			SUPPLICANT_DBG("add_or_replace_bss_to_network failed");
+			remove_bss(bss);
+		}
+	}
+
+	g_slist_free(interface->bss_batch);
+	interface->bss_batch = NULL;
+
+	/* Every network is reported once, with all its new BSSs merged */
+	g_hash_table_iter_init(&iter, changes);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		GSupplicantNetwork *network = key;
+		unsigned int flags = GPOINTER_TO_UINT(value);
+
+		if (flags & BSS_BATCH_NETWORK_ADDED) {
+			callback_network_added(network);
+			continue;
+		}
+
+		if (flags & BSS_BATCH_NETWORK_WPS)
+			callback_network_changed(network, "WPSCapabilities");
+
+		if (flags & BSS_BATCH_NETWORK_SIGNAL)
+			callback_network_changed(network, "Signal");
+	}
+
+	g_hash_table_destroy(changes);
+}
+
+static gboolean bss_batch_timeout(gpointer user_data)
+{
+	GSupplicantInterface *interface = user_data;
+
+	interface->bss_batch_timeout = 0;
+
+	bss_batch_flush(interface);
+
+	return FALSE;
+}
+
 static void interface_bss_added_with_keys(DBusMessageIter *iter,
 						void *user_data)
 {
+	GSupplicantInterface *interface = user_data;
 	struct g_supplicant_bss *bss;
 
 	SUPPLICANT_DBG("");
 
-	bss = interface_bss_added(iter, user_data);
+	bss = interface_bss_added(iter, interface);
 	if (!bss)
 		return;
 
 	dbus_message_iter_next(iter);
 
-	if (dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_INVALID)
+	if (dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_INVALID) {
+		remove_bss(bss);
 		return;
+	}
 
 	supplicant_dbus_property_foreach(iter, bss_property, bss);
 
-	bss_compute_security(bss);
-	if (add_or_replace_bss_to_network(bss) < 0)
-		SUPPLICANT_DBG("add_or_replace_bss_to_network failed");
+	g_hash_table_replace(interface->bss_pending, bss->path, bss);
+	bss_batch_add(interface, bss);
+}
+
+static void bss_fetch_result(const char *error, DBusMessageIter *iter,
+							void *user_data)
+{
+	struct g_supplicant_bss *bss = user_data;
+	GSupplicantInterface *interface = bss->interface;
+
+	interface->bss_fetching--;
+
+	if (error) {
+		SUPPLICANT_DBG("%s: %s", bss->path, error);
+		g_hash_table_remove(interface->bss_pending, bss->path);
+	} else
+		bss_batch_add(interface, bss);
+
+	/* No need to wait once the last BSS of the list is known */
+	if (interface->bss_fetching == 0)
+		bss_batch_flush(interface);
+}
+
+/*
+ * wpa_supplicant has no call returning the properties of several BSSs,
+ * so they are requested all at once and only added to their networks
+ * after the replies have arrived.
+ */
+static void interface_bss_fetch(DBusMessageIter *iter, void *user_data)
+{
+	GSupplicantInterface *interface = user_data;
+	struct g_supplicant_bss *bss;
+
+	bss = interface_bss_added(iter, interface);
+	if (!bss)
+		return;
+
+	if (supplicant_dbus_property_get_all_result(bss->path,
+					SUPPLICANT_INTERFACE ".BSS",
+					bss_property, bss_fetch_result,
+					bss, bss) < 0) {
+		remove_bss(bss);
+		return;
+	}
+
+	g_hash_table_replace(interface->bss_pending, bss->path, bss);
+	interface->bss_fetching++;
 }
 
 static void interface_bss_added_without_keys(DBusMessageIter *iter,
@@ -2089,29 +2438,22 @@ static void interface_bss_added_without_keys(DBusMessageIter *iter,
 					bss_property, bss, bss);
 
 	bss_compute_security(bss);
-	if (add_or_replace_bss_to_network(bss) < 0)
+	if (add_or_replace_bss_to_network(bss, NULL) < 0)
 			SUPPLICANT_DBG("add_or_replace_bss_to_network failed");
 }
 
-static void update_signal(gpointer key, gpointer value,
-						gpointer user_data)
+static void update_network_signal(GSupplicantNetwork *network)
 {
-	struct g_supplicant_bss *bss = value;
-	GSupplicantNetwork *network = user_data;
+	struct g_supplicant_bss *bss;
 
-	if (bss->signal > network->signal) {
+	if (network->bss_heap->len <= 1 && network->best_bss)
+		return;
+
+	bss = bss_heap_strongest(network->bss_heap);
+	if (bss && bss->signal > network->signal) {
 		network->signal = bss->signal;
 		network->best_bss = bss;
 	}
-}
-
-static void update_network_signal(GSupplicantNetwork *network)
-{
-	if (g_hash_table_size(network->bss_table) <= 1 && network->best_bss)
-		return;
-
-	g_hash_table_foreach(network->bss_table,
-				update_signal, network);
 
 	SUPPLICANT_DBG("New network signal %d", network->signal);
 }
@@ -2129,16 +2471,15 @@ static void interface_current_bss(GSupplicantInterface *interface,
 		return;
 	}
 
-	interface_bss_added_without_keys(iter, interface);
+	bss_batch_flush(interface);
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (!network)
-		return;
+	interface_bss_added_without_keys(iter, interface);
 
-	bss = g_hash_table_lookup(network->bss_table, path);
+	bss = g_hash_table_lookup(interface->bss_mapping, path);
 	if (!bss)
 		return;
 
+	network = bss->network;
 	interface->current_network = network;
 
 	if (bss != network->best_bss) {
@@ -2196,24 +2537,26 @@ static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 	if (!path)
 		return;
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (!network)
-		return;
+	bss_batch_flush(interface);
 
-	bss = g_hash_table_lookup(network->bss_table, path);
-	if (network->best_bss == bss) {
-		network->best_bss = NULL;
-		network->signal = BSS_UNKNOWN_STRENGTH;
+	/* Anything still pending is waiting for its properties */
+	if (g_hash_table_remove(interface->bss_pending, path)) {
+		interface->bss_fetching--;
+		return;
 	}
 
-	g_hash_table_remove(bss_mapping, path);
+	bss = g_hash_table_lookup(interface->bss_mapping, path);
+	if (!bss)
+		return;
+
+	network = bss->network;
 
-	g_hash_table_remove(interface->bss_mapping, path);
-	g_hash_table_remove(network->bss_table, path);
+	detach_bss(bss);
+	remove_bss(bss);
 
 	update_network_signal(network);
 
-	if (g_hash_table_size(network->bss_table) == 0)
+	if (network->bss_heap->len == 0)
 		g_hash_table_remove(interface->network_table, network->group);
 }
 
@@ -2371,9 +2714,8 @@ static void interface_property(const char *key, DBusMessageIter *iter,
 	} else if (g_strcmp0(key, "CurrentNetwork") == 0) {
 		interface_network_added(iter, interface);
 	} else if (g_strcmp0(key, "BSSs") == 0) {
-		supplicant_dbus_array_foreach(iter,
-					interface_bss_added_without_keys,
-					interface);
+		supplicant_dbus_array_foreach(iter, interface_bss_fetch,
+								interface);
 	} else if (g_strcmp0(key, "Blobs") == 0) {
 		/* Nothing */
 	} else if (g_strcmp0(key, "Networks") == 0) {
@@ -2397,10 +2739,15 @@ static void interface_property(const char *key, DBusMessageIter *iter,
 	}
 }
 
+struct scan_network_data {
+	GSupplicantInterface *interface;
+	GHashTable *networks;
+};
+
 static void scan_network_update(DBusMessageIter *iter, void *user_data)
 {
-	GSupplicantInterface *interface = user_data;
-	GSupplicantNetwork *network;
+	struct scan_network_data *data = user_data;
+	struct g_supplicant_bss *bss;
 	char *path;
 
 	if (!iter)
@@ -2414,20 +2761,36 @@ static void scan_network_update(DBusMessageIter *iter, void *user_data)
 	if (g_strcmp0(path, "/") == 0)
 		return;
 
-	/* Update the network details based on scan BSS data */
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (network)
-		callback_network_added(network);
+	/* Networks with several BSSs are only updated once */
+	bss = g_hash_table_lookup(data->interface->bss_mapping, path);
+	if (bss)
+		g_hash_table_replace(data->networks, bss->network,
+							bss->network);
 }
 
 static void scan_bss_data(const char *key, DBusMessageIter *iter,
 				void *user_data)
 {
 	GSupplicantInterface *interface = user_data;
+	struct scan_network_data data;
+	GHashTableIter hash;
+	gpointer network;
+
+	if (iter) {
+		data.interface = interface;
+		data.networks = g_hash_table_new(g_direct_hash,
+							g_direct_equal);
 
-	if (iter)
 		supplicant_dbus_array_foreach(iter, scan_network_update,
-						interface);
+						&data);
+
+		/* Update the network details based on scan BSS data */
+		g_hash_table_iter_init(&hash, data.networks);
+		while (g_hash_table_iter_next(&hash, &network, NULL))
+			callback_network_added(network);
+
+		g_hash_table_destroy(data.networks);
+	}
 
 	if (interface->scan_callback)
 		interface->scan_callback(0, interface, interface->scan_data);
@@ -2454,6 +2817,8 @@ static GSupplicantInterface *interface_alloc(const char *path)
 					g_str_equal, NULL, remove_group);
 	interface->bss_mapping = g_hash_table_new_full(g_str_hash, g_str_equal,
 								NULL, NULL);
+	interface->bss_pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, remove_bss);
 
 	g_hash_table_replace(interface_table, interface->path, interface);
 
@@ -2651,6 +3016,15 @@ static void signal_interface_changed(const char *path, DBusMessageIter *iter)
 	supplicant_dbus_property_foreach(iter, interface_property, interface);
 }
 
+static void debug_memory_usage(GSupplicantInterface *interface)
+{
+	SUPPLICANT_DBG("%s %u networks %u BSSs using %zu bytes",
+			interface->ifname,
+			g_hash_table_size(interface->network_table),
+			g_hash_table_size(interface->bss_mapping),
+			interface->bss_memory);
+}
+
 static void signal_scan_done(const char *path, DBusMessageIter *iter)
 {
 	GSupplicantInterface *interface;
@@ -2664,6 +3038,10 @@ static void signal_scan_done(const char *path, DBusMessageIter *iter)
 
 	dbus_message_iter_get_basic(iter, &success);
 
+	/* All BSSs found by the scan have been signaled by now */
+	bss_batch_flush(interface);
+	debug_memory_usage(interface);
+
 	if (interface->scanning) {
 		callback_scan_finished(interface);
 		interface->scanning = FALSE;
@@ -2740,6 +3118,22 @@ static void signal_network_removed(const char *path, DBusMessageIter *iter)
 	interface_network_removed(iter, interface);
 }
 
+static GSupplicantInterface *find_pending_bss_interface(const char *path)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, interface_table);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		GSupplicantInterface *interface = value;
+
+		if (g_hash_table_lookup(interface->bss_pending, path))
+			return interface;
+	}
+
+	return NULL;
+}
+
 static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 {
 	GSupplicantInterface *interface;
@@ -2751,18 +3145,23 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 	SUPPLICANT_DBG("");
 
 	interface = g_hash_table_lookup(bss_mapping, path);
-	if (!interface)
-		return;
+	if (!interface) {
+		/* The BSS may still wait in a batch to be added */
+		interface = find_pending_bss_interface(path);
+		if (!interface)
+			return;
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (!network)
-		return;
+		bss_batch_flush(interface);
+	}
 
-	bss = g_hash_table_lookup(network->bss_table, path);
+	bss = g_hash_table_lookup(interface->bss_mapping, path);
 	if (!bss)
 		return;
 
+	network = bss->network;
+
 	supplicant_dbus_property_foreach(iter, bss_property, bss);
+	bss_heap_update(network->bss_heap, bss);
 
 	old_security = network->security;
 	bss_compute_security(bss);
@@ -2789,24 +3188,18 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 
 		memcpy(new_bss, bss, sizeof(struct g_supplicant_bss));
 		new_bss->path = g_strdup(bss->path);
+		new_bss->network = NULL;
 
-		if (network->best_bss == bss) {
-			network->best_bss = NULL;
-			network->signal = BSS_UNKNOWN_STRENGTH;
-		}
-
-		g_hash_table_remove(bss_mapping, path);
-
-		g_hash_table_remove(interface->bss_mapping, path);
-		g_hash_table_remove(network->bss_table, path);
+		detach_bss(bss);
+		remove_bss(bss);
 
 		update_network_signal(network);
 
-		if (g_hash_table_size(network->bss_table) == 0)
+		if (network->bss_heap->len == 0)
 			g_hash_table_remove(interface->network_table,
 					    network->group);
 
-		if (add_or_replace_bss_to_network(new_bss) < 0) {
+		if (add_or_replace_bss_to_network(new_bss, NULL) < 0) {
 			/*
 			 * Prevent a memory leak on failure in
 			 * add_or_replace_bss_to_network
@@ -5227,6 +5620,84 @@ int g_supplicant_interface_disconnect(GSupplicantInterface *interface,
 	return ret;
 }
 
+struct interface_roam_data {
+	GSupplicantInterface *interface;
+	char *bssid;
+	GSupplicantInterfaceCallback callback;
+	void *user_data;
+};
+
+static void interface_roam_params(DBusMessageIter *iter, void *user_data)
+{
+	struct interface_roam_data *data = user_data;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &data->bssid);
+}
+
+static void interface_roam_result(const char *error,
+				DBusMessageIter *iter, void *user_data)
+{
+	struct interface_roam_data *data = user_data;
+	int result = 0;
+
+	SUPPLICANT_DBG("");
+
+	if (error) {
+		SUPPLICANT_DBG("error: %s", error);
+		result = -EIO;
+
+		if (g_strcmp0("org.freedesktop.DBus.Error.UnknownMethod",
+						error) == 0)
+			result = -EOPNOTSUPP;
+	}
+
+	if (data->callback)
+		data->callback(result, data->interface, data->user_data);
+
+	g_free(data->bssid);
+	dbus_free(data);
+}
+
+int g_supplicant_interface_roam(GSupplicantInterface *interface,
+					const unsigned char *bssid,
+					GSupplicantInterfaceCallback callback,
+							void *user_data)
+{
+	struct interface_roam_data *data;
+	int ret;
+
+	if (!interface || !bssid)
+		return -EINVAL;
+
+	if (!system_available)
+		return -EFAULT;
+
+	data = dbus_malloc0(sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	data->interface = interface;
+	data->bssid = g_strdup_printf("%02x:%02x:%02x:%02x:%02x:%02x",
+					bssid[0], bssid[1], bssid[2],
+					bssid[3], bssid[4], bssid[5]);
+	data->callback = callback;
+	data->user_data = user_data;
+
+	SUPPLICANT_DBG("bssid %s", data->bssid);
+
+	ret = supplicant_dbus_method_call(interface->path,
+			SUPPLICANT_INTERFACE ".Interface", "Roam",
+			interface_roam_params, interface_roam_result, data,
+			interface);
+
+	if (ret < 0) {
+		g_free(data->bssid);
+		dbus_free(data);
+	}
+
+	return ret;
+}
+
 static void interface_p2p_find_result(const char *error,
 					DBusMessageIter *iter, void *user_data)
 {
@@ -30,6 +30,7 @@ extern "C" {
 
 gchar **connman_storage_get_services();
 GKeyFile *connman_storage_load_service(const char *service_id);
+GKeyFile *connman_storage_get_service_index(void);
 
 #ifdef __cplusplus
 }
@@ -63,10 +63,25 @@
 #define INACTIVE_TIMEOUT  12	/* in seconds */
 #define FAVORITE_MAXIMUM_RETRIES 2
 
-#define BGSCAN_DEFAULT "simple:30:-45:300"
 #define AUTOSCAN_EXPONENTIAL "exponential:30000:30000"
 #define AUTOSCAN_SINGLE "single:3"
 
+/*
+ * Autoscans only visit the channels of known networks, with a full
+ * scan every few rounds or when no channel is known. While connected,
+ * only such partial scans are done, and more often when the signal gets
+ * weaker. Networks appearing or vanishing in bursts mean that we are
+ * moving, which restarts the interval backoff.
+ */
+#define AUTOSCAN_PARTIAL_SCANS 3
+#define AUTOSCAN_MAX_FREQS 8
+#define AUTOSCAN_MOTION_CHANGES 3
+#define AUTOSCAN_CONNECTED_INTERVAL 60	/* in seconds */
+#define AUTOSCAN_CONNECTED_MIN 10	/* in seconds */
+#define AUTOSCAN_CONNECTED_MAX 300	/* in seconds */
+#define AUTOSCAN_WEAK_STRENGTH 45	/* -75 dBm */
+#define AUTOSCAN_STRENGTH_DROP 5
+
 #define P2P_FIND_TIMEOUT 30
 #define P2P_CONNECTION_TIMEOUT 100
 #define P2P_LISTEN_PERIOD 500
@@ -75,6 +90,29 @@
 #define ASSOC_STATUS_NO_CLIENT 17
 #define LOAD_SHAPING_MAX_RETRIES 3
 
+/*
+ * Networks missing from scan results are kept for a grace period, so
+ * networks at the edge of range do not remove and recreate their
+ * services on every scan.
+ */
+#define NETWORK_GRACE_PERIOD 30	/* in seconds */
+#define NETWORK_GRACE_SCANS 2
+#define NETWORK_MAX_AGE 180	/* in seconds */
+
+/*
+ * The BSSs of the connected network are ranked on their recent signal,
+ * to roam before the signal is lost and to search only their channels
+ * when the connection dropped.
+ */
+#define ROAM_HISTORY 4
+#define ROAM_CANDIDATE_MAX_AGE 60	/* in seconds */
+#define ROAM_TRIGGER_SIGNAL -70	/* in dBm */
+#define ROAM_SIGNAL_DELTA 8	/* in dB */
+#define ROAM_HOLDOFF 30	/* in seconds */
+
+/* Returned by g_supplicant_network_get_bssid() without a best BSS */
+static const unsigned char no_bssid[6];
+
 static struct connman_technology *wifi_technology = NULL;
 static struct connman_technology *p2p_technology = NULL;
 
@@ -114,6 +152,33 @@ struct autoscan_params {
 	int limit;
 	int interval;
 	unsigned int timeout;
+	unsigned int partial_scans;
+	uint8_t strength;
+};
+
+struct wifi_network {
+	gint64 last_seen;
+	unsigned int missed_scans;
+	bool gone;
+};
+
+struct roam_candidate {
+	unsigned char bssid[6];
+	uint16_t frequency;
+	int16_t signal[ROAM_HISTORY];
+	unsigned int samples;
+	gint64 last_seen;
+};
+
+struct reconnect_stats {
+	gint64 started;
+	bool roaming;
+	bool hinted;
+	unsigned int count;
+	unsigned int roams;
+	guint64 total;		/* in ms */
+	unsigned int last;	/* in ms */
+	unsigned int max;	/* in ms */
 };
 
 struct wifi_tethering_info {
@@ -150,6 +215,14 @@ struct wifi_data {
 	 * autoscan "emulation".
 	 */
 	struct autoscan_params *autoscan;
+	unsigned int network_age_timeout;
+	unsigned int network_changes;
+	uint16_t scan_freqs[AUTOSCAN_MAX_FREQS];
+	unsigned int num_scan_freqs;
+	GSList *roam_candidates;
+	char *roam_identifier;
+	gint64 last_roam;
+	struct reconnect_stats reconnect;
 	enum wifi_scanning_type scanning_type;
 	GSupplicantScanParams *scan_params;
 	unsigned int p2p_find_timeout;
@@ -802,6 +875,11 @@ static void remove_networks(struct connman_device *device,
 {
 	GSList *list;
 
+	if (wifi->network_age_timeout) {
+		g_source_remove(wifi->network_age_timeout);
+		wifi->network_age_timeout = 0;
+	}
+
 	for (list = wifi->networks; list; list = list->next) {
 		struct connman_network *network = list->data;
 
@@ -925,6 +1003,8 @@ static void wifi_remove(struct connman_device *device)
 	if (wifi->scan_params)
 		g_supplicant_free_scan_params(wifi->scan_params);
 
+	g_slist_free_full(wifi->roam_candidates, g_free);
+	g_free(wifi->roam_identifier);
 	g_free(wifi->autoscan);
 	g_free(wifi->identifier);
 	g_free(wifi);
@@ -1055,28 +1135,21 @@ static int get_hidden_connections(GSupplicantScanParams *scan_data)
 	bool value;
 	int num_ssids = 0, add_param_failed = 0;
 
+	keyfile = connman_storage_get_service_index();
 	services = connman_storage_get_services();
 	for (i = 0; services && services[i]; i++) {
 		if (strncmp(services[i], "wifi_", 5) != 0)
 			continue;
 
-		keyfile = connman_storage_load_service(services[i]);
-		if (!keyfile)
-			continue;
-
 		value = g_key_file_get_boolean(keyfile,
 					services[i], "Hidden", NULL);
-		if (!value) {
-			g_key_file_free(keyfile);
+		if (!value)
 			continue;
-		}
 
 		value = g_key_file_get_boolean(keyfile,
 					services[i], "Favorite", NULL);
-		if (!value) {
-			g_key_file_free(keyfile);
+		if (!value)
 			continue;
-		}
 
 		ssid = g_key_file_get_string(keyfile,
 					services[i], "SSID", NULL);
@@ -1092,7 +1165,6 @@ static int get_hidden_connections(GSupplicantScanParams *scan_data)
 
 		g_free(ssid);
 		g_free(name);
-		g_key_file_free(keyfile);
 	}
 
 	/*
@@ -1204,32 +1276,48 @@ err:
 	return 0;
 }
 
+/*
+ * Scans all channels without scan_params, the scan_params are
+ * freed on failure.
+ */
 static int throw_wifi_scan(struct connman_device *device,
+			GSupplicantScanParams *scan_params,
 			GSupplicantInterfaceCallback callback)
 {
 	struct wifi_data *wifi = connman_device_get_data(device);
 	int ret;
 
 	if (!wifi)
-		return -ENODEV;
+		ret = -ENODEV;
+	else if (wifi->tethering)
+		ret = -EBUSY;
+	else if (connman_device_get_scanning(device,
+						CONNMAN_SERVICE_TYPE_WIFI))
+		ret = -EALREADY;
+	else
+		ret = 0;
 
-	DBG("device %p %p", device, wifi->interface);
+	if (ret < 0) {
+		if (scan_params)
+			g_supplicant_free_scan_params(scan_params);
+		return ret;
+	}
 
-	if (wifi->tethering)
-		return -EBUSY;
-
-	if (connman_device_get_scanning(device, CONNMAN_SERVICE_TYPE_WIFI))
-		return -EALREADY;
+	DBG("device %p %p freqs %d", device, wifi->interface,
+				scan_params ? scan_params->num_freqs : 0);
 
 	connman_device_ref(device);
 
-	ret = g_supplicant_interface_scan(wifi->interface, NULL,
+	ret = g_supplicant_interface_scan(wifi->interface, scan_params,
 						callback, device);
 	if (ret == 0) {
 		connman_device_set_scanning(device,
 				CONNMAN_SERVICE_TYPE_WIFI, true);
-	} else
+	} else {
+		if (scan_params)
+			g_supplicant_free_scan_params(scan_params);
 		connman_device_unref(device);
+	}
 
 	return ret;
 }
@@ -1247,6 +1335,123 @@ static void hidden_free(struct hidden_params *hidden)
 	g_free(hidden);
 }
 
+static bool keep_network(struct wifi_network *data, gint64 now)
+{
+	gint64 age = (now - data->last_seen) / G_USEC_PER_SEC;
+
+	if (age < NETWORK_GRACE_PERIOD)
+		return true;
+
+	if (data->gone)
+		return false;
+
+	return data->missed_scans < NETWORK_GRACE_SCANS &&
+						age < NETWORK_MAX_AGE;
+}
+
+static void schedule_network_age_out(struct wifi_data *wifi);
+
+static bool network_scanned(struct wifi_data *wifi,
+				struct connman_network *network)
+{
+	uint16_t freq;
+	unsigned int i;
+
+	if (wifi->num_scan_freqs == 0)
+		return true;
+
+	freq = connman_network_get_frequency(network);
+
+	for (i = 0; i < wifi->num_scan_freqs; i++) {
+		if (wifi->scan_freqs[i] == freq)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Applies the result of a scan, or the networks dropped by
+ * wpa_supplicant, in one pass. Networks seen recently stay available
+ * and the expired ones are removed together.
+ */
+static void age_out_networks(struct wifi_data *wifi, bool scan_done)
+{
+	gint64 now = g_get_monotonic_time();
+	GSList *list, *next;
+	bool pending = false;
+
+	for (list = wifi->networks; list; list = next) {
+		struct connman_network *network = list->data;
+		struct wifi_network *data = connman_network_get_data(network);
+
+		next = list->next;
+
+		if (!data)
+			continue;
+
+		if (connman_network_get_connected(network) ||
+				connman_network_get_connecting(network))
+			continue;
+
+		if (scan_done) {
+			if (connman_network_get_available(network))
+				continue;
+
+			if (!network_scanned(wifi, network)) {
+				connman_network_set_available(network, true);
+				continue;
+			}
+
+			data->missed_scans++;
+		} else if (!data->gone)
+			continue;
+
+		if (keep_network(data, now)) {
+			connman_network_set_available(network, true);
+
+			if (data->gone)
+				pending = true;
+
+			continue;
+		}
+
+		DBG("network %p aged out", network);
+
+		wifi->networks = g_slist_delete_link(wifi->networks, list);
+		wifi->network_changes++;
+
+		connman_device_remove_network(wifi->device, network);
+		connman_network_unref(network);
+	}
+
+	if (pending)
+		schedule_network_age_out(wifi);
+}
+
+static gboolean network_age_timeout(gpointer user_data)
+{
+	struct wifi_data *wifi = user_data;
+
+	wifi->network_age_timeout = 0;
+
+	/* A running scan ages out the networks when it is done */
+	if (!connman_device_get_scanning(wifi->device,
+					CONNMAN_SERVICE_TYPE_WIFI))
+		age_out_networks(wifi, false);
+
+	return FALSE;
+}
+
+static void schedule_network_age_out(struct wifi_data *wifi)
+{
+	if (wifi->network_age_timeout)
+		return;
+
+	wifi->network_age_timeout = g_timeout_add_seconds(NETWORK_GRACE_PERIOD,
+						network_age_timeout, wifi);
+}
+
 static void scan_callback(int result, GSupplicantInterface *interface,
 						void *user_data)
 {
@@ -1295,6 +1500,11 @@ static void scan_callback(int result, GSupplicantInterface *interface,
 	scanning = connman_device_get_scanning(device, CONNMAN_SERVICE_TYPE_WIFI);
 
 	if (scanning) {
+		if (wifi) {
+			age_out_networks(wifi, true);
+			wifi->num_scan_freqs = 0;
+		}
+
 		connman_device_set_scanning(device,
 				CONNMAN_SERVICE_TYPE_WIFI, false);
 	}
@@ -1349,6 +1559,150 @@ out:
 	scan_callback(result, interface, user_data);
 }
 
+static GSupplicantScanParams *scan_params_new(const uint16_t *freqs,
+						unsigned int num_freqs)
+{
+	GSupplicantScanParams *scan_params;
+
+	scan_params = g_try_malloc0(sizeof(GSupplicantScanParams));
+	if (!scan_params)
+		return NULL;
+
+	scan_params->freqs = g_memdup(freqs, sizeof(uint16_t) * num_freqs);
+	if (!scan_params->freqs) {
+		g_free(scan_params);
+		return NULL;
+	}
+
+	scan_params->num_freqs = num_freqs;
+
+	return scan_params;
+}
+
+/*
+ * Returns the channels of the connected network and of the favorite
+ * networks seen lately, or NULL if a full scan is not worse.
+ */
+static GSupplicantScanParams *get_known_frequencies(struct wifi_data *wifi)
+{
+	uint16_t freqs[AUTOSCAN_MAX_FREQS];
+	unsigned int num_freqs = 0, i;
+	GSList *list;
+
+	for (list = wifi->networks; list; list = list->next) {
+		struct connman_network *network = list->data;
+		struct connman_service *service;
+		uint16_t freq;
+
+		freq = connman_network_get_frequency(network);
+		if (freq == 0)
+			continue;
+
+		if (network != wifi->network) {
+			service = connman_service_lookup_from_network(network);
+			if (!service || !connman_service_get_favorite(service))
+				continue;
+		}
+
+		for (i = 0; i < num_freqs; i++) {
+			if (freqs[i] == freq)
+				break;
+		}
+
+		if (i < num_freqs)
+			continue;
+
+		if (num_freqs == AUTOSCAN_MAX_FREQS)
+			return NULL;
+
+		freqs[num_freqs++] = freq;
+	}
+
+	if (num_freqs == 0)
+		return NULL;
+
+	return scan_params_new(freqs, num_freqs);
+}
+
+static int throw_partial_scan(struct connman_device *device,
+				GSupplicantScanParams *scan_params)
+{
+	struct wifi_data *wifi = connman_device_get_data(device);
+	uint16_t freqs[AUTOSCAN_MAX_FREQS];
+	unsigned int num_freqs;
+	int ret;
+
+	num_freqs = scan_params->num_freqs;
+	memcpy(freqs, scan_params->freqs, sizeof(uint16_t) * num_freqs);
+
+	ret = throw_wifi_scan(device, scan_params, scan_callback);
+	if (ret < 0)
+		return ret;
+
+	/* Networks on other channels cannot be missed by this scan */
+	memcpy(wifi->scan_freqs, freqs, sizeof(uint16_t) * num_freqs);
+	wifi->num_scan_freqs = num_freqs;
+
+	return 0;
+}
+
+static void throw_autoscan(struct connman_device *device)
+{
+	struct wifi_data *wifi = connman_device_get_data(device);
+	struct autoscan_params *autoscan = wifi->autoscan;
+	GSupplicantScanParams *scan_params = NULL;
+
+	if (wifi->connected ||
+			autoscan->partial_scans < AUTOSCAN_PARTIAL_SCANS)
+		scan_params = get_known_frequencies(wifi);
+
+	if (!scan_params) {
+		/* A full scan would keep the connection off channel too long */
+		if (wifi->connected)
+			return;
+
+		autoscan->partial_scans = 0;
+		throw_wifi_scan(device, NULL, scan_callback_hidden);
+		return;
+	}
+
+	autoscan->partial_scans++;
+
+	throw_partial_scan(device, scan_params);
+}
+
+static int connected_autoscan_interval(struct wifi_data *wifi,
+					struct autoscan_params *autoscan)
+{
+	uint8_t strength = connman_network_get_strength(wifi->network);
+	int interval;
+
+	if (autoscan->interval <= 0) {
+		autoscan->strength = strength;
+		return AUTOSCAN_CONNECTED_INTERVAL;
+	}
+
+	if (wifi->network_changes >= AUTOSCAN_MOTION_CHANGES ||
+				strength < AUTOSCAN_WEAK_STRENGTH)
+		interval = AUTOSCAN_CONNECTED_MIN;
+	else if (strength + AUTOSCAN_STRENGTH_DROP <= autoscan->strength)
+		interval = autoscan->interval / 2;
+	else
+		interval = autoscan->interval * 2;
+
+	if (interval < AUTOSCAN_CONNECTED_MIN)
+		interval = AUTOSCAN_CONNECTED_MIN;
+	else if (interval > AUTOSCAN_CONNECTED_MAX)
+		interval = AUTOSCAN_CONNECTED_MAX;
+
+	DBG("strength %u previous %u changes %u", strength,
+			autoscan->strength, wifi->network_changes);
+
+	autoscan->strength = strength;
+
+	return interval;
+}
+
 static gboolean autoscan_timeout(gpointer data)
 {
 	struct connman_device *device = data;
@@ -1361,6 +1715,17 @@ static gboolean autoscan_timeout(gpointer data)
 
 	autoscan = wifi->autoscan;
 
+	if (wifi->connected && wifi->network) {
+		interval = connected_autoscan_interval(wifi, autoscan);
+
+		if (autoscan->interval > 0)
+			throw_autoscan(device);
+
+		wifi->network_changes = 0;
+
+		goto set_interval;
+	}
+
 	if (autoscan->interval <= 0) {
 		interval = autoscan->base;
 		goto set_interval;
@@ -1370,7 +1735,13 @@ static gboolean autoscan_timeout(gpointer data)
 	if (interval > autoscan->limit)
 		interval = autoscan->limit;
 
-	throw_wifi_scan(wifi->device, scan_callback_hidden);
+	if (connman_setting_get_bool("BackgroundScanning") &&
+			wifi->network_changes >= AUTOSCAN_MOTION_CHANGES)
+		interval = autoscan->base;
+
+	wifi->network_changes = 0;
+
+	throw_autoscan(device);
 
 	/*
 	 * In case BackgroundScanning is disabled, interval will reach the
@@ -1411,7 +1782,12 @@ static void start_autoscan(struct connman_device *device)
 	if (wifi->p2p_device)
 		return;
 
-	if (wifi->connected)
+	/*
+	 * Partial scans while connected are background scanning, they
+	 * replace the bgscan module of wpa_supplicant.
+	 */
+	if (wifi->connected &&
+			!connman_setting_get_bool("BackgroundScanning"))
 		return;
 
 	autoscan = wifi->autoscan;
@@ -1663,20 +2039,16 @@ static int get_latest_connections(int max_ssids,
 	if (!latest_list)
 		return -ENOMEM;
 
+	keyfile = connman_storage_get_service_index();
 	services = connman_storage_get_services();
 	for (i = 0; services && services[i]; i++) {
 		if (strncmp(services[i], "wifi_", 5) != 0)
 			continue;
 
-		keyfile = connman_storage_load_service(services[i]);
-		if (!keyfile)
-			continue;
-
 		str = g_key_file_get_string(keyfile,
 					services[i], "Favorite", NULL);
 		if (!str || g_strcmp0(str, "true")) {
 			g_free(str);
-			g_key_file_free(keyfile);
 			continue;
 		}
 		g_free(str);
@@ -1685,17 +2057,14 @@ static int get_latest_connections(int max_ssids,
 					services[i], "AutoConnect", NULL);
 		if (!str || g_strcmp0(str, "true")) {
 			g_free(str);
-			g_key_file_free(keyfile);
 			continue;
 		}
 		g_free(str);
 
 		str = g_key_file_get_string(keyfile,
 					services[i], "Modified", NULL);
-		if (!str) {
-			g_key_file_free(keyfile);
+		if (!str)
 			continue;
-		}
 		g_time_val_from_iso8601(str, &modified);
 		g_free(str);
 
@@ -1708,7 +2077,7 @@ static int get_latest_connections(int max_ssids,
 			entry = g_try_new(struct last_connected, 1);
 			if (!entry) {
 				g_sequence_free(latest_list);
-				g_key_file_free(keyfile);
+				g_strfreev(services);
 				g_free(ssid);
 				return -ENOMEM;
 			}
@@ -1722,8 +2091,6 @@ static int get_latest_connections(int max_ssids,
 			num_ssids++;
 		} else
 			g_free(ssid);
-
-		g_key_file_free(keyfile);
 	}
 
 	g_strfreev(services);
@@ -1771,7 +2138,7 @@ static int wifi_scan_simple(struct connman_device *device)
 	if (wifi)
 		wifi_update_scanner_type(wifi, WIFI_SCANNING_PASSIVE);
 
-	return throw_wifi_scan(device, scan_callback_hidden);
+	return throw_wifi_scan(device, NULL, scan_callback_hidden);
 }
 
 static gboolean p2p_find_stop(gpointer data)
@@ -2100,6 +2467,9 @@ static void network_remove(struct connman_network *network)
 
 	DBG("network %p", network);
 
+	g_free(connman_network_get_data(network));
+	connman_network_set_data(network, NULL);
+
 	wifi = connman_device_get_data(device);
 	if (!wifi)
 		return;
@@ -2146,6 +2516,263 @@ static GSupplicantSecurity network_security(const char *security)
 	return G_SUPPLICANT_SECURITY_UNKNOWN;
 }
 
+static int candidate_signal(const struct roam_candidate *candidate)
+{
+	unsigned int i, samples;
+	int sum = 0;
+
+	/* Every candidate has at least one sample */
+	samples = MIN(candidate->samples, ROAM_HISTORY);
+
+	for (i = 0; i < samples; i++)
+		sum += candidate->signal[i];
+
+	return sum / (int) samples;
+}
+
+static gint compare_candidate(gconstpointer a, gconstpointer b)
+{
+	return candidate_signal(b) - candidate_signal(a);
+}
+
+static void update_candidate(const unsigned char *bssid,
+				dbus_int16_t signal, dbus_uint16_t frequency,
+				void *user_data)
+{
+	struct wifi_data *wifi = user_data;
+	struct roam_candidate *candidate = NULL;
+	GSList *list;
+
+	for (list = wifi->roam_candidates; list; list = list->next) {
+		candidate = list->data;
+
+		if (memcmp(candidate->bssid, bssid, 6) == 0)
+			break;
+	}
+
+	if (!list) {
+		candidate = g_try_new0(struct roam_candidate, 1);
+		if (!candidate)
+			return;
+
+		memcpy(candidate->bssid, bssid, 6);
+		wifi->roam_candidates = g_slist_prepend(wifi->roam_candidates,
+							candidate);
+	}
+
+	candidate->frequency = frequency;
+	candidate->signal[candidate->samples++ % ROAM_HISTORY] = signal;
+	candidate->last_seen = g_get_monotonic_time();
+}
+
+static void roam_callback(int result, GSupplicantInterface *interface,
+							void *user_data)
+{
+	struct wifi_data *wifi = user_data;
+
+	DBG("result %d", result);
+
+	if (result < 0 && wifi->reconnect.roaming) {
+		wifi->reconnect.started = 0;
+		wifi->reconnect.roaming = false;
+	}
+}
+
+static void check_roam(struct wifi_data *wifi,
+				GSupplicantNetwork *supplicant_network)
+{
+	const unsigned char *current;
+	struct roam_candidate *best = NULL;
+	gint64 now = g_get_monotonic_time();
+	int signal;
+	GSList *list;
+
+	signal = g_supplicant_network_get_signal(supplicant_network);
+	if (signal >= ROAM_TRIGGER_SIGNAL)
+		return;
+
+	if (wifi->last_roam &&
+			now - wifi->last_roam < ROAM_HOLDOFF * G_USEC_PER_SEC)
+		return;
+
+	/* Without a best BSS there is nothing to compare with */
+	current = g_supplicant_network_get_bssid(supplicant_network);
+	if (!memcmp(current, no_bssid, sizeof(no_bssid)))
+		return;
+
+	for (list = wifi->roam_candidates; list; list = list->next) {
+		struct roam_candidate *candidate = list->data;
+
+		if (memcmp(candidate->bssid, current, 6) != 0) {
+			best = candidate;
+			break;
+		}
+	}
+
+	if (!best || candidate_signal(best) < signal + ROAM_SIGNAL_DELTA)
+		return;
+
+	DBG("signal %d dBm, roaming to %02x:%02x:%02x:%02x:%02x:%02x "
+		"with %d dBm", signal, best->bssid[0], best->bssid[1],
+		best->bssid[2], best->bssid[3], best->bssid[4],
+		best->bssid[5], candidate_signal(best));
+
+	wifi->last_roam = now;
+
+	if (g_supplicant_interface_roam(wifi->interface, best->bssid,
+					roam_callback, wifi) < 0)
+		return;
+
+	wifi->reconnect.started = now;
+	wifi->reconnect.roaming = true;
+}
+
+/*
+ * Called with the scan results of every network, only the connected
+ * one is tracked.
+ */
+static void update_roam_candidates(struct wifi_data *wifi,
+				GSupplicantNetwork *supplicant_network)
+{
+	const char *identifier;
+	gint64 oldest;
+	GSList *list, *next;
+
+	if (!wifi->network)
+		return;
+
+	identifier = g_supplicant_network_get_identifier(supplicant_network);
+	if (g_strcmp0(identifier,
+			connman_network_get_identifier(wifi->network)) != 0)
+		return;
+
+	if (g_strcmp0(wifi->roam_identifier, identifier) != 0) {
+		g_slist_free_full(wifi->roam_candidates, g_free);
+		wifi->roam_candidates = NULL;
+
+		g_free(wifi->roam_identifier);
+		wifi->roam_identifier = g_strdup(identifier);
+	}
+
+	g_supplicant_network_foreach_bss(supplicant_network,
+					update_candidate, wifi);
+
+	oldest = g_get_monotonic_time() -
+			ROAM_CANDIDATE_MAX_AGE * G_USEC_PER_SEC;
+
+	for (list = wifi->roam_candidates; list; list = next) {
+		struct roam_candidate *candidate = list->data;
+
+		next = list->next;
+
+		if (candidate->last_seen >= oldest)
+			continue;
+
+		wifi->roam_candidates = g_slist_delete_link(
+					wifi->roam_candidates, list);
+		g_free(candidate);
+	}
+
+	wifi->roam_candidates = g_slist_sort(wifi->roam_candidates,
+						compare_candidate);
+
+	/* A roam which did not complete within the holdoff failed */
+	if (wifi->reconnect.roaming && wifi->reconnect.started <
+			g_get_monotonic_time() - ROAM_HOLDOFF * G_USEC_PER_SEC) {
+		wifi->reconnect.started = 0;
+		wifi->reconnect.roaming = false;
+	}
+
+	if (wifi->connected && !wifi->reconnect.started)
+		check_roam(wifi, supplicant_network);
+}
+
+/*
+ * When reconnecting after the connection dropped, the channels the
+ * network was seen on lately are scanned once before connecting, so
+ * wpa_supplicant finds a BSS without waiting for a full scan. The hint
+ * is not part of the network configuration, its own reconnects and
+ * background scans still cover all channels.
+ */
+static GSupplicantScanParams *get_reconnect_scan_params(
+					struct wifi_data *wifi,
+					struct connman_network *network)
+{
+	uint16_t freqs[AUTOSCAN_MAX_FREQS];
+	unsigned int num_freqs = 0, i;
+	gint64 oldest;
+	GSList *list;
+
+	if (!wifi->reconnect.started || wifi->reconnect.roaming ||
+						wifi->reconnect.hinted)
+		return NULL;
+
+	if (g_strcmp0(wifi->roam_identifier,
+			connman_network_get_identifier(network)) != 0)
+		return NULL;
+
+	oldest = g_get_monotonic_time() -
+			ROAM_CANDIDATE_MAX_AGE * G_USEC_PER_SEC;
+
+	for (list = wifi->roam_candidates; list; list = list->next) {
+		struct roam_candidate *candidate = list->data;
+
+		if (candidate->last_seen < oldest || !candidate->frequency)
+			continue;
+
+		for (i = 0; i < num_freqs; i++) {
+			if (freqs[i] == candidate->frequency)
+				break;
+		}
+
+		if (i < num_freqs)
+			continue;
+
+		if (num_freqs == AUTOSCAN_MAX_FREQS)
+			break;
+
+		freqs[num_freqs++] = candidate->frequency;
+	}
+
+	if (num_freqs == 0)
+		return NULL;
+
+	wifi->reconnect.hinted = true;
+
+	DBG("scanning %u channels first", num_freqs);
+
+	return scan_params_new(freqs, num_freqs);
+}
+
+static void reconnect_done(struct wifi_data *wifi)
+{
+	struct reconnect_stats *stats = &wifi->reconnect;
+	unsigned int latency;
+
+	latency = (g_get_monotonic_time() - stats->started) / 1000;
+
+	stats->count++;
+	if (stats->roaming)
+		stats->roams++;
+
+	stats->total += latency;
+	stats->last = latency;
+	if (latency > stats->max)
+		stats->max = latency;
+
+	connman_info("%s %s in %u ms, average %u ms maximum %u ms "
+			"(%u reconnects, %u roams)",
+			g_supplicant_interface_get_ifname(wifi->interface),
+			stats->roaming ? "roamed" : "reconnected", latency,
+			(unsigned int) (stats->total / stats->count),
+			stats->max, stats->count - stats->roams,
+			stats->roams);
+
+	stats->started = 0;
+	stats->roaming = false;
+	stats->hinted = false;
+}
+
 static void ssid_init(GSupplicantSSID *ssid, struct connman_network *network)
 {
 	const char *security;
@@ -2202,9 +2829,6 @@ static void ssid_init(GSupplicantSSID *ssid, struct connman_network *network)
 
 	ssid->use_wps = connman_network_get_bool(network, "WiFi.UseWPS");
 	ssid->pin_wps = connman_network_get_string(network, "WiFi.PinWPS");
-
-	if (connman_setting_get_bool("BackgroundScanning"))
-		ssid->bgscan = BGSCAN_DEFAULT;
 }
 
 static int network_connect(struct connman_network *network)
@@ -2212,6 +2836,7 @@ static int network_connect(struct connman_network *network)
 	struct connman_device *device = connman_network_get_device(network);
 	struct wifi_data *wifi;
 	GSupplicantInterface *interface;
+	GSupplicantScanParams *scan_params;
 	GSupplicantSSID *ssid;
 
 	DBG("network %p", network);
@@ -2238,6 +2863,10 @@ static int network_connect(struct connman_network *network)
 		wifi->network = connman_network_ref(network);
 		wifi->retries = 0;
 
+		scan_params = get_reconnect_scan_params(wifi, network);
+		if (scan_params)
+			throw_partial_scan(device, scan_params);
+
 		return g_supplicant_interface_connect(interface, ssid,
 						connect_callback, network);
 	}
@@ -2291,6 +2920,9 @@ static int network_disconnect(struct connman_network *network)
 		return -EALREADY;
 
 	wifi->disconnecting = true;
+	wifi->reconnect.started = 0;
+	wifi->reconnect.roaming = false;
+	wifi->reconnect.hinted = false;
 
 	err = g_supplicant_interface_disconnect(wifi->interface,
 						disconnect_callback, wifi);
@@ -2632,9 +3264,6 @@ static void interface_state(GSupplicantInterface *interface)
 		break;
 	case G_SUPPLICANT_STATE_SCANNING:
 		wifi->connected = false;
-
-		if (old_connected)
-			start_autoscan(device);
 		break;
 	case G_SUPPLICANT_STATE_COMPLETED:
 		wifi->connected = true;
@@ -2644,6 +3273,28 @@ static void interface_state(GSupplicantInterface *interface)
 		break;
 	}
 
+	/* The connection was lost without being asked for */
+	if (old_connected && !wifi->connected && !wifi->disconnecting) {
+		if (!wifi->reconnect.started)
+			wifi->reconnect.started = g_get_monotonic_time();
+
+		wifi->reconnect.roaming = false;
+	}
+
+	if (state == G_SUPPLICANT_STATE_COMPLETED && wifi->reconnect.started)
+		reconnect_done(wifi);
+
+	/*
+	 * Autoscan uses a different scheme while connected, and it has
+	 * been stopped while roaming.
+	 */
+	if ((wifi->connected != old_connected ||
+				state == G_SUPPLICANT_STATE_COMPLETED) &&
+				state != G_SUPPLICANT_STATE_DISABLED) {
+		reset_autoscan(device);
+		start_autoscan(device);
+	}
+
 	DBG("DONE");
 }
 
@@ -2781,6 +3432,7 @@ static unsigned char calculate_strength(GSupplicantNetwork *supplicant_network)
 static void network_added(GSupplicantNetwork *supplicant_network)
 {
 	struct connman_network *network;
+	struct wifi_network *data;
 	GSupplicantInterface *interface;
 	struct wifi_data *wifi;
 	const char *name, *identifier, *security, *group, *mode;
@@ -2833,8 +3485,22 @@ static void network_added(GSupplicantNetwork *supplicant_network)
 		}
 
 		wifi->networks = g_slist_prepend(wifi->networks, network);
+		wifi->network_changes++;
 	}
 
+	data = connman_network_get_data(network);
+	if (!data) {
+		data = g_try_new0(struct wifi_network, 1);
+		if (!data)
+			return;
+
+		connman_network_set_data(network, data);
+	}
+
+	data->last_seen = g_get_monotonic_time();
+	data->missed_scans = 0;
+	data->gone = false;
+
 	if (name && name[0] != '\0')
 		connman_network_set_name(network, name);
 
@@ -2866,6 +3532,8 @@ static void network_added(GSupplicantNetwork *supplicant_network)
 	if (ssid)
 		connman_network_set_group(network, group);
 
+	update_roam_candidates(wifi, supplicant_network);
+
 	if (wifi->hidden && ssid) {
 		if (!g_strcmp0(wifi->hidden->security, security) &&
 				wifi->hidden->ssid_len == ssid_len &&
@@ -2887,6 +3555,7 @@ static void network_removed(GSupplicantNetwork *network)
 	struct wifi_data *wifi;
 	const char *name, *identifier;
 	struct connman_network *connman_network;
+	struct wifi_network *data;
 
 	interface = g_supplicant_network_get_interface(network);
 	wifi = g_supplicant_interface_get_data(interface);
@@ -2902,6 +3571,14 @@ static void network_removed(GSupplicantNetwork *network)
 	if (!connman_network)
 		return;
 
+	/* The network is kept until its grace period is over */
+	data = connman_network_get_data(connman_network);
+	if (data) {
+		data->gone = true;
+		schedule_network_age_out(wifi);
+		return;
+	}
+
 	wifi->networks = g_slist_remove(wifi->networks, connman_network);
 
 	connman_device_remove_network(wifi->device, connman_network);
@@ -31,6 +31,7 @@ dbus_bool_t __connman_dbus_append_objpath_dict_array(DBusMessage *msg,
 			connman_dbus_append_cb_t function, void *user_data);
 dbus_bool_t __connman_dbus_append_objpath_array(DBusMessage *msg,
 			connman_dbus_append_cb_t function, void *user_data);
+void __connman_dbus_append_message(DBusMessageIter *iter, DBusMessage *msg);
 int __connman_dbus_init(DBusConnection *conn);
 void __connman_dbus_cleanup(void);
 
@@ -276,6 +277,8 @@ void __connman_storage_save_provider(GKeyFile *keyfile, const char *identifier);
 bool __connman_storage_remove_provider(const char *identifier);
 char **__connman_storage_get_providers(void);
 bool __connman_storage_remove_service(const char *service_id);
+void __connman_storage_sync(void);
+void __connman_storage_cleanup(void);
 
 int __connman_detect_init(void);
 void __connman_detect_cleanup(void);
@@ -310,6 +313,7 @@ struct connman_ipconfig_ops {
 	void (*ip_release) (struct connman_ipconfig *ipconfig, const char *ifname);
 	void (*route_set) (struct connman_ipconfig *ipconfig, const char *ifname);
 	void (*route_unset) (struct connman_ipconfig *ipconfig, const char *ifname);
+	void (*changed) (struct connman_ipconfig *ipconfig);
 };
 
 struct connman_ipconfig *__connman_ipconfig_create(int index, int original_index,
@@ -895,6 +899,8 @@ enum connman_device_type __connman_rtnl_get_device_type(int index);
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
 int __connman_rtnl_request_update(void);
+void __connman_rtnl_add_stats_index(int index);
+void __connman_rtnl_remove_stats_index(int index);
 int __connman_rtnl_send(const void *buf, size_t len);
 
 bool __connman_session_policy_autoconnect(enum connman_service_connect_reason reason);
@@ -917,6 +923,25 @@ struct connman_stats_data {
 	unsigned int time;
 };
 
+struct connman_stats_total {
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint32_t rx_packets;
+	uint32_t tx_packets;
+	uint32_t rx_errors;
+	uint32_t tx_errors;
+	uint32_t rx_dropped;
+	uint32_t tx_dropped;
+	uint32_t time;
+	uint32_t reserved;
+};
+
+struct connman_stats_bucket {
+	int64_t start;
+	struct connman_stats_total home;
+	struct connman_stats_total roaming;
+};
+
 int __connman_stats_init(void);
 void __connman_stats_cleanup(void);
 int __connman_stats_service_register(struct connman_service *service);
@@ -927,6 +952,11 @@ int  __connman_stats_update(struct connman_service *service,
 int __connman_stats_get(struct connman_service *service,
 				bool roaming,
 				struct connman_stats_data *data);
+int __connman_stats_get_range(struct connman_service *service,
+				unsigned int resolution,
+				time_t start, time_t end,
+				struct connman_stats_bucket **buckets,
+				unsigned int *count);
 
 int __connman_iptables_dump(const char *table_name);
 int __connman_iptables_new_chain(const char *table_name,
@@ -957,6 +987,9 @@ int __connman_iptables_iterate_chains(const char *table_name,
 int __connman_iptables_init(void);
 void __connman_iptables_cleanup(void);
 int __connman_iptables_commit(const char *table_name);
+void __connman_iptables_begin(void);
+int __connman_iptables_end(void);
+int __connman_iptables_end_failed(GSList **failed);
 
 int __connman_dnsproxy_init(void);
 void __connman_dnsproxy_cleanup(void);
@@ -1035,6 +1068,8 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					char *id, const char *src_ip,
 					uint32_t mark);
 int __connman_firewall_disable_marking(struct firewall_context *ctx);
+void __connman_firewall_begin(void);
+int __connman_firewall_end(void);
 
 int __connman_firewall_init(void);
 void __connman_firewall_cleanup(void);
@@ -227,6 +227,57 @@ void connman_dbus_property_append_array(DBusMessageIter *iter,
 	dbus_message_iter_close_container(iter, &value);
 }
 
+static void append_iter(DBusMessageIter *iter, DBusMessageIter *from)
+{
+	int type;
+
+	while ((type = dbus_message_iter_get_arg_type(from)) !=
+							DBUS_TYPE_INVALID) {
+		DBusMessageIter sub_from, sub_iter;
+		char *signature = NULL;
+		union {
+			dbus_uint64_t u64;
+			double dbl;
+			const char *str;
+		} value;
+
+		if (dbus_type_is_basic(type)) {
+			dbus_message_iter_get_basic(from, &value);
+			dbus_message_iter_append_basic(iter, type, &value);
+			dbus_message_iter_next(from);
+			continue;
+		}
+
+		dbus_message_iter_recurse(from, &sub_from);
+
+		/* The signature of an array also holds the array type */
+		if (type == DBUS_TYPE_ARRAY)
+			signature = dbus_message_iter_get_signature(from);
+		else if (type == DBUS_TYPE_VARIANT)
+			signature = dbus_message_iter_get_signature(&sub_from);
+
+		dbus_message_iter_open_container(iter, type,
+				type == DBUS_TYPE_ARRAY ? signature + 1 :
+							signature, &sub_iter);
+		append_iter(&sub_iter, &sub_from);
+		dbus_message_iter_close_container(iter, &sub_iter);
+
+		dbus_free(signature);
+
+		dbus_message_iter_next(from);
+	}
+}
+
+void __connman_dbus_append_message(DBusMessageIter *iter, DBusMessage *msg)
+{
+	DBusMessageIter from;
+
+	if (!dbus_message_iter_init(msg, &from))
+		return;
+
+	append_iter(iter, &from);
+}
+
 static DBusConnection *connection = NULL;
 
 dbus_bool_t connman_dbus_property_changed_basic(const char *path,
@@ -699,6 +750,13 @@ int __connman_dbus_init(DBusConnection *conn)
 
 	connection = conn;
 
+	/*
+	 * Attach before any object gets registered so that services,
+	 * technologies, peers and VPN connections all end up below
+	 * the object manager at the root path.
+	 */
+	g_dbus_attach_object_manager(connection);
+
 	return 0;
 }
 
@@ -706,5 +764,8 @@ void __connman_dbus_cleanup(void)
 {
 	DBG("");
 
+	if (connection)
+		g_dbus_detach_object_manager(connection);
+
 	connection = NULL;
 }
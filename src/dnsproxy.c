@@ -23,6 +23,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -32,12 +33,15 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <resolv.h>
 #include <gweb/gresolv.h>
 
 #include <glib.h>
+#include <gdbus.h>
 
 #include "connman.h"
 
@@ -103,6 +107,21 @@ struct server_data {
 	bool enabled;
 	bool connected;
 	struct partial_reply *incoming_reply;
+	char *key;
+	unsigned int pending;
+	unsigned int srtt;
+	unsigned int rttvar;
+	unsigned int failure_rate;
+	dbus_uint64_t replies;
+	dbus_uint64_t failures;
+};
+
+struct request_server {
+	struct server_data *server;
+	gint64 sent;
+	unsigned int pending;
+	bool replied;
+	bool timed_out;
 };
 
 struct request_data {
@@ -128,6 +147,10 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	bool append_domain;
+	GList *link;
+	GSList *servers;
+	struct server_data *racing;
+	guint race;
 };
 
 struct listener_data {
@@ -159,22 +182,58 @@ struct tcp_partial_client_data {
 };
 
 struct cache_data {
+	struct cache_data *next;
 	time_t inserted;
 	time_t valid_until;
 	time_t cache_until;
 	int timeout;
 	uint16_t type;
 	uint16_t answers;
+	uint16_t authority; /* SOA record of a negative answer */
+	uint8_t rcode;
 	unsigned int data_len;
 	unsigned char *data; /* contains DNS header + body */
+	uint16_t ttl_count;
+	uint16_t *ttl_offsets; /* TTL fields of the records in data */
 };
 
 struct cache_entry {
 	char *key;
 	bool want_refresh;
 	int hits;
-	struct cache_data *ipv4;
-	struct cache_data *ipv6;
+	struct cache_data *records; /* one record set per query type */
+	size_t size; /* memory accounted to this entry in cache_bytes */
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+};
+
+/*
+ * On disk layout of the cache snapshot. The file is a header followed
+ * by one record per cached record set. Each record is followed by the
+ * NUL terminated name and the cached packet and is padded to a
+ * multiple of 8 bytes. Integers are stored in host byte order.
+ */
+struct cache_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct cache_snapshot_record {
+	uint32_t len;
+	uint32_t data_len;
+	int64_t inserted;
+	int64_t valid_until;
+	int64_t cache_until;
+	int32_t timeout;
+	int32_t hits;
+	uint16_t type;
+	uint16_t answers;
+	uint16_t authority;
+	uint16_t key_len;
+	uint8_t rcode;
+	uint8_t reserved[7];
 };
 
 struct domain_question {
@@ -194,6 +253,38 @@ struct domain_rr {
  */
 #define TCP_MAX_BUF_LEN 4096
 
+/*
+ * Max length of a DNS query received from an UDP client and the
+ * number of queries read from the listener socket at once.
+ */
+#define UDP_MAX_BUF_LEN 768
+#define UDP_BATCH_SIZE 16
+
+/*
+ * Cached answers up to this length are sent to UDP clients from a
+ * stack buffer and batched with other answers, longer answers are
+ * sent one by one.
+ */
+#define UDP_CACHED_REPLY_LEN (NS_PACKETSZ * 2)
+
+/*
+ * Round trip time assumed for servers that have not answered yet and
+ * the bounds of the time we wait before racing the next server, all
+ * in milliseconds.
+ */
+#define SERVER_RTT_INITIAL 100
+#define SERVER_RACE_TIMEOUT_MIN 100
+#define SERVER_RACE_TIMEOUT_MAX 2000
+
+/*
+ * The cache is saved to disk on shutdown and, if it has changed, at
+ * this interval in seconds so it survives restarts.
+ */
+#define CACHE_SNAPSHOT_FILE STORAGEDIR "/dnsproxy.cache"
+#define CACHE_SNAPSHOT_INTERVAL (5 * 60)
+#define CACHE_SNAPSHOT_MAGIC 0x444e5343
+#define CACHE_SNAPSHOT_VERSION 1
+
 /*
  * We limit how long the cached DNS entry stays in the cache.
  * By default the TTL (time-to-live) of the DNS response is used
@@ -206,31 +297,52 @@ struct domain_rr {
 #define MIN_CACHE_TTL (30)
 
 /*
- * We limit the cache size to some sane value so that cached data does
- * not occupy too much memory. Each cached entry occupies on average
- * about 100 bytes memory (depending on DNS name length).
- * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * The cache is limited by the amount of memory the cached entries
+ * occupy (entry and cached packet sizes together), as configured by
+ * DNSProxyCacheSize in main.conf. Entries are kept in a list ordered
+ * by last use so that the least recently used entry can be evicted
+ * in constant time when the limit is reached.
  */
-#define MAX_CACHE_SIZE 256
-
 static int cache_size;
+static size_t cache_bytes;
+static size_t cache_max_bytes;
 static GHashTable *cache;
+static struct cache_entry *cache_lru_head;
+static struct cache_entry *cache_lru_tail;
+
+static struct {
+	dbus_uint64_t hits;
+	dbus_uint64_t misses;
+	dbus_uint64_t evictions;
+} cache_stats;
+
 static int cache_refcount;
 static GSList *server_list = NULL;
-static GSList *request_list = NULL;
+static GHashTable *server_table = NULL;
+static GQueue request_list = G_QUEUE_INIT;
+static GHashTable *request_table = NULL;
 static GHashTable *listener_table = NULL;
 static time_t next_refresh;
 static GHashTable *partial_tcp_req_table;
 static guint cache_timer = 0;
+static guint snapshot_timer = 0;
+static bool cache_dirty;
 
 static guint16 get_id(void)
 {
 	uint64_t rand;
+	guint16 id;
 
-	__connman_util_get_random(&rand);
+	/*
+	 * Outstanding requests are indexed by their IDs, so make sure
+	 * a new ID does not clash with one already in use.
+	 */
+	do {
+		__connman_util_get_random(&rand);
+		id = rand;
+	} while (g_hash_table_lookup(request_table, GUINT_TO_POINTER(id)));
 
-	return rand;
+	return id;
 }
 
 static int protocol_offset(int protocol)
@@ -270,48 +382,290 @@ static time_t round_down_ttl(time_t end_time, int ttl)
 }
 
 static struct request_data *find_request(guint16 id)
+{
+	return g_hash_table_lookup(request_table, GUINT_TO_POINTER(id));
+}
+
+static void request_list_add(struct request_data *req)
+{
+	g_queue_push_tail(&request_list, req);
+	req->link = request_list.tail;
+
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->dstid), req);
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->altid), req);
+}
+
+static void request_list_remove(struct request_data *req)
+{
+	if (!req->link)
+		return;
+
+	g_queue_delete_link(&request_list, req->link);
+	req->link = NULL;
+
+	if (find_request(req->dstid) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->dstid));
+	if (find_request(req->altid) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->altid));
+}
+
+/*
+ * Each server keeps a smoothed round trip time and variance in the
+ * style of TCP (RFC 6298) together with a failure rate in per mille.
+ * Queries are sent to the server with the lowest expected latency
+ * first and only raced against the next one when no reply arrived
+ * within the adaptive timeout.
+ */
+static unsigned int server_score(struct server_data *server)
+{
+	unsigned int failures = MIN(server->failure_rate, 950);
+
+	return server->srtt * 1000 / (1000 - failures);
+}
+
+static unsigned int server_timeout(struct server_data *server)
+{
+	unsigned int timeout = server->srtt + 4 * server->rttvar;
+
+	return CLAMP(timeout, SERVER_RACE_TIMEOUT_MIN,
+					SERVER_RACE_TIMEOUT_MAX);
+}
+
+static void server_update_rtt(struct server_data *server, unsigned int rtt)
+{
+	unsigned int delta;
+
+	delta = rtt > server->srtt ? rtt - server->srtt : server->srtt - rtt;
+
+	server->rttvar = (3 * server->rttvar + delta) / 4;
+	server->srtt = (7 * server->srtt + rtt) / 8;
+	server->failure_rate -= server->failure_rate / 8;
+	server->replies++;
+
+	debug("server %s rtt %u srtt %u rttvar %u", server->server, rtt,
+					server->srtt, server->rttvar);
+}
+
+static void server_failure(struct server_data *server)
+{
+	server->failure_rate += (1000 - server->failure_rate) / 8;
+	server->failures++;
+
+	debug("server %s failure rate %u", server->server,
+					server->failure_rate);
+}
+
+/*
+ * Keep track of the servers a request was sent to, so that the number
+ * of pending requests per server stays accurate and replies can be
+ * timed.
+ */
+static struct request_server *request_lookup_server(struct request_data *req,
+						struct server_data *server)
 {
 	GSList *list;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	for (list = req->servers; list; list = list->next) {
+		struct request_server *entry = list->data;
 
-		if (req->dstid == id || req->altid == id)
-			return req;
+		if (entry->server == server)
+			return entry;
 	}
 
 	return NULL;
 }
 
+static struct request_server *request_mark_server(struct request_data *req,
+						struct server_data *server)
+{
+	struct request_server *entry;
+
+	entry = request_lookup_server(req, server);
+	if (entry)
+		return entry;
+
+	entry = g_new0(struct request_server, 1);
+	entry->server = server;
+	entry->sent = g_get_monotonic_time();
+	req->servers = g_slist_prepend(req->servers, entry);
+
+	return entry;
+}
+
+static void request_add_server(struct request_data *req,
+				struct server_data *server)
+{
+	struct request_server *entry;
+
+	entry = request_mark_server(req, server);
+	entry->pending++;
+	server->pending++;
+}
+
+static void request_remove_server(struct request_data *req,
+				struct server_data *server)
+{
+	struct request_server *entry;
+
+	entry = request_lookup_server(req, server);
+	if (!entry || !entry->pending)
+		return;
+
+	if (!entry->replied) {
+		gint64 rtt = g_get_monotonic_time() - entry->sent;
+
+		server_update_rtt(server, rtt / 1000);
+		entry->replied = true;
+	}
+
+	entry->pending--;
+	server->pending--;
+}
+
+static void request_forget_server(struct request_data *req,
+				struct server_data *server)
+{
+	struct request_server *entry;
+
+	entry = request_lookup_server(req, server);
+	if (!entry)
+		return;
+
+	req->servers = g_slist_remove(req->servers, entry);
+	g_free(entry);
+}
+
+/*
+ * Servers that have not answered when the request is given up are
+ * counted as failures, unless this was already done when the race
+ * timer expired.
+ */
+static void request_release_servers(struct request_data *req, bool expired)
+{
+	GSList *list;
+
+	for (list = req->servers; list; list = list->next) {
+		struct request_server *entry = list->data;
+
+		if (expired && entry->pending && !entry->replied &&
+							!entry->timed_out)
+			server_failure(entry->server);
+
+		entry->server->pending -= entry->pending;
+		g_free(entry);
+	}
+
+	g_slist_free(req->servers);
+	req->servers = NULL;
+}
+
+/*
+ * All servers without an interface share the same index in the lookup
+ * key, as find_server() never distinguished between them.
+ */
+static char *server_key(int index, const char *server, int protocol)
+{
+	return g_strdup_printf("%d/%s/%d", index < 0 ? -1 : index,
+							server, protocol);
+}
+
 static struct server_data *find_server(int index,
 					const char *server,
 						int protocol)
 {
-	GSList *list;
+	struct server_data *data;
+	char *key;
 
 	debug("index %d server %s proto %d", index, server, protocol);
 
+	if (!server)
+		return NULL;
+
+	key = server_key(index, server, protocol);
+	data = g_hash_table_lookup(server_table, key);
+	g_free(key);
+
+	return data;
+}
+
+static void server_list_add(struct server_data *server)
+{
+	server_list = g_slist_append(server_list, server);
+
+	if (!g_hash_table_lookup(server_table, server->key))
+		g_hash_table_insert(server_table, server->key, server);
+}
+
+static void server_list_remove(struct server_data *server)
+{
+	GSList *list;
+
+	server_list = g_slist_remove(server_list, server);
+
+	if (g_hash_table_lookup(server_table, server->key) != server)
+		return;
+
+	g_hash_table_remove(server_table, server->key);
+
+	/* Fall back to a duplicate entry, if any */
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
 
-		if (index < 0 && data->index < 0 &&
-				g_str_equal(data->server, server) &&
-				data->protocol == protocol)
-			return data;
+		if (g_str_equal(data->key, server->key)) {
+			g_hash_table_insert(server_table, data->key, data);
+			break;
+		}
+	}
+}
 
-		if (index < 0 ||
-				data->index < 0 || !data->server)
-			continue;
+static struct cache_data *cache_entry_lookup(struct cache_entry *entry,
+							uint16_t type)
+{
+	struct cache_data *data;
 
-		if (data->index == index &&
-				g_str_equal(data->server, server) &&
-				data->protocol == protocol)
+	for (data = entry->records; data; data = data->next) {
+		if (data->type == type)
 			return data;
 	}
 
 	return NULL;
 }
 
+static void cache_data_free(struct cache_data *data)
+{
+	g_free(data->ttl_offsets);
+	g_free(data->data);
+	g_free(data);
+}
+
+static void cache_entry_remove_data(struct cache_entry *entry,
+					struct cache_data *data)
+{
+	struct cache_data **prev;
+
+	for (prev = &entry->records; *prev; prev = &(*prev)->next) {
+		if (*prev == data) {
+			*prev = data->next;
+			cache_data_free(data);
+			return;
+		}
+	}
+}
+
+static void cache_entry_free_records(struct cache_entry *entry)
+{
+	struct cache_data *data, *next;
+
+	for (data = entry->records; data; data = next) {
+		next = data->next;
+		cache_data_free(data);
+	}
+
+	entry->records = NULL;
+}
+
 /* we can keep using the same resolve's */
 static GResolv *ipv4_resolve;
 static GResolv *ipv6_resolve;
@@ -339,14 +693,14 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 		g_resolv_add_nameserver(ipv6_resolve, "::1", 53, 0);
 	}
 
-	if (!entry->ipv4) {
+	if (!cache_entry_lookup(entry, ns_t_a)) {
 		debug("Refreshing A record for %s", name);
 		g_resolv_lookup_hostname(ipv4_resolve, name,
 					dummy_resolve_func, NULL);
 		age = 4;
 	}
 
-	if (!entry->ipv6) {
+	if (!cache_entry_lookup(entry, ns_t_aaaa)) {
 		debug("Refreshing AAAA record for %s", name);
 		g_resolv_lookup_hostname(ipv6_resolve, name,
 					dummy_resolve_func, NULL);
@@ -365,62 +719,86 @@ static int dns_name_length(unsigned char *buf)
 	return strlen((char *)buf) + 1;
 }
 
-static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
+/*
+ * Turn the cached packet into a response template: the header is
+ * filled in and the location of the TTL field of every record is
+ * remembered, so that sending an answer from the cache only needs
+ * to patch the DNS id and the TTLs.
+ */
+static int cache_data_prepare(struct cache_data *data)
 {
-	unsigned char *c;
+	unsigned char *pkt = data->data + 2;
+	unsigned char *c, *end = data->data + data->data_len;
+	struct domain_hdr *hdr = (void *) pkt;
+	int count = data->answers + data->authority;
 	uint16_t w;
-	int l;
-
-	/* skip the header */
-	c = buf + 12;
-	len -= 12;
-
-	/* skip the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c);
-	c += l;
-	len -= l;
-	c += 4;
-	len -= 4;
-
-	/* now we get the answer records */
-
-	while (len > 0) {
-		/* first a name */
-		l = dns_name_length(c);
-		c += l;
-		len -= l;
-		if (len < 0)
-			break;
-		/* then type + class, 2 bytes each */
-		c += 4;
-		len -= 4;
-		if (len < 0)
-			break;
+	int i;
 
-		/* now the 4 byte TTL field */
-		c[0] = new_ttl >> 24 & 0xff;
-		c[1] = new_ttl >> 16 & 0xff;
-		c[2] = new_ttl >> 8 & 0xff;
-		c[3] = new_ttl & 0xff;
-		c += 4;
-		len -= 4;
-		if (len < 0)
+	hdr->qr = 1;
+	hdr->rcode = data->rcode;
+	hdr->ancount = htons(data->answers);
+	hdr->nscount = htons(data->authority);
+	hdr->arcount = 0;
+
+	/* if this is a negative reply, we are authorative */
+	if (data->answers == 0)
+		hdr->aa = 1;
+
+	data->ttl_count = 0;
+	data->ttl_offsets = NULL;
+
+	if (count == 0)
+		return 0;
+
+	data->ttl_offsets = g_try_new(uint16_t, count);
+	if (!data->ttl_offsets)
+		return -ENOMEM;
+
+	/* skip the header and the query, a name and 2 16 bit words */
+	c = pkt + sizeof(struct domain_hdr);
+	c += dns_name_length(c) + 4;
+
+	for (i = 0; i < count && c < end; i++) {
+		/* name, then type + class, 2 bytes each */
+		c += dns_name_length(c) + 4;
+
+		/* now the 4 byte TTL field and the 2 byte rdlen field */
+		if (c + 6 > end)
 			break;
 
-		/* now the 2 byte rdlen field */
-		w = c[0] << 8 | c[1];
-		c += w + 2;
-		len -= w + 2;
+		data->ttl_offsets[data->ttl_count++] = c - pkt;
+
+		w = c[4] << 8 | c[5];
+		c += w + 6;
 	}
+
+	return 0;
+}
+
+/*
+ * Patch the DNS id and the TTLs of a response made from the cache
+ * template, pkt points to the DNS header.
+ */
+static void cache_data_patch(struct cache_data *data, unsigned char *pkt,
+				uint16_t id, int ttl)
+{
+	struct domain_hdr *hdr = (void *) pkt;
+	uint32_t new_ttl = htonl(ttl);
+	int i;
+
+	hdr->id = id;
+
+	for (i = 0; i < data->ttl_count; i++)
+		memcpy(pkt + data->ttl_offsets[i], &new_ttl, 4);
 }
 
-static void send_cached_response(int sk, unsigned char *buf, int len,
+static void send_cached_response(int sk, struct cache_data *data,
 				const struct sockaddr *to, socklen_t tolen,
-				int protocol, int id, uint16_t answers, int ttl)
+				int protocol, int id, int ttl)
 {
-	struct domain_hdr *hdr;
-	unsigned char *ptr = buf;
-	int err, offset, dns_len, adj_len = len - 2;
+	unsigned char *ptr = data->data;
+	int len = data->data_len;
+	int err, offset, dns_len;
 
 	/*
 	 * The cached packet contains always the TCP offset (two bytes)
@@ -444,23 +822,10 @@ static void send_cached_response(int sk, unsigned char *buf, int len,
 	if (len < 12)
 		return;
 
-	hdr = (void *) (ptr + offset);
-
-	hdr->id = id;
-	hdr->qr = 1;
-	hdr->rcode = ns_r_noerror;
-	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
-	hdr->arcount = 0;
-
-	/* if this is a negative reply, we are authorative */
-	if (answers == 0)
-		hdr->aa = 1;
-	else
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+	cache_data_patch(data, ptr + offset, id, ttl);
 
 	debug("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
-		sk, hdr->id, answers, ptr, len, dns_len);
+		sk, id, data->answers, ptr, len, dns_len);
 
 	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
 	if (err < 0) {
@@ -534,6 +899,11 @@ static void destroy_request_data(struct request_data *req)
 	if (req->timeout > 0)
 		g_source_remove(req->timeout);
 
+	if (req->race > 0)
+		g_source_remove(req->race);
+
+	request_release_servers(req, false);
+
 	g_free(req->resp);
 	g_free(req->request);
 	g_free(req->name);
@@ -551,7 +921,8 @@ static gboolean request_timeout(gpointer user_data)
 
 	debug("id 0x%04x", req->srcid);
 
-	request_list = g_slist_remove(request_list, req);
+	request_list_remove(req);
+	request_release_servers(req, true);
 
 	if (req->protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
@@ -658,6 +1029,93 @@ static int append_query(unsigned char *buf, unsigned int size,
 	return ptr - buf;
 }
 
+static void cache_lru_unlink(struct cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else if (cache_lru_head == entry)
+		cache_lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else if (cache_lru_tail == entry)
+		cache_lru_tail = entry->lru_prev;
+
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+/*
+ * Move the entry to the head of the LRU list, the tail of the list
+ * is the first candidate for eviction.
+ */
+static void cache_lru_touch(struct cache_entry *entry)
+{
+	if (cache_lru_head == entry)
+		return;
+
+	cache_lru_unlink(entry);
+
+	entry->lru_next = cache_lru_head;
+	if (cache_lru_head)
+		cache_lru_head->lru_prev = entry;
+	cache_lru_head = entry;
+
+	if (!cache_lru_tail)
+		cache_lru_tail = entry;
+}
+
+static size_t cache_data_size(struct cache_data *data)
+{
+	if (!data)
+		return 0;
+
+	return sizeof(*data) + data->data_len +
+		data->ttl_count * sizeof(*data->ttl_offsets);
+}
+
+/*
+ * Recalculate the memory used by the entry after its cached data
+ * has been added or removed.
+ */
+static void cache_entry_account(struct cache_entry *entry)
+{
+	struct cache_data *data;
+	size_t size;
+
+	size = sizeof(*entry) + strlen(entry->key) + 1;
+
+	for (data = entry->records; data; data = data->next)
+		size += cache_data_size(data);
+
+	cache_bytes -= entry->size;
+	cache_bytes += size;
+	entry->size = size;
+}
+
+/*
+ * Evict least recently used entries until the cache fits into its
+ * memory limit. The entry given as parameter is never evicted.
+ */
+static void cache_evict(struct cache_entry *keep)
+{
+	while (cache_bytes > cache_max_bytes && cache_lru_tail &&
+						cache_lru_tail != keep) {
+		debug("evicting \"%s\" size %zd", cache_lru_tail->key,
+						cache_lru_tail->size);
+
+		cache_stats.evictions++;
+		g_hash_table_remove(cache, cache_lru_tail->key);
+	}
+}
+
+static void cache_hit(struct cache_entry *entry)
+{
+	entry->hits++;
+	cache_stats.hits++;
+
+	cache_lru_touch(entry);
+}
+
 static bool cache_check_is_valid(struct cache_data *data,
 				time_t current_time)
 {
@@ -676,29 +1134,24 @@ static bool cache_check_is_valid(struct cache_data *data,
 static void cache_enforce_validity(struct cache_entry *entry)
 {
 	time_t current_time = time(NULL);
+	struct cache_data *data, *next;
 
-	if (!cache_check_is_valid(entry->ipv4, current_time)
-							&& entry->ipv4) {
-		debug("cache timeout \"%s\" type A", entry->key);
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
+	for (data = entry->records; data; data = next) {
+		next = data->next;
 
-	}
+		if (cache_check_is_valid(data, current_time))
+			continue;
 
-	if (!cache_check_is_valid(entry->ipv6, current_time)
-							&& entry->ipv6) {
-		debug("cache timeout \"%s\" type AAAA", entry->key);
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
+		debug("cache timeout \"%s\" type %d", entry->key, data->type);
+		cache_entry_remove_data(entry, data);
 	}
+
+	cache_entry_account(entry);
 }
 
 static uint16_t cache_check_validity(char *question, uint16_t type,
 				struct cache_entry *entry)
 {
-	time_t current_time = time(NULL);
 	bool want_refresh = false;
 
 	/*
@@ -710,40 +1163,20 @@ static uint16_t cache_check_validity(char *question, uint16_t type,
 
 	cache_enforce_validity(entry);
 
-	switch (type) {
-	case 1:		/* IPv4 */
-		if (!cache_check_is_valid(entry->ipv4, current_time)) {
-			debug("cache %s \"%s\" type A", entry->ipv4 ?
-					"timeout" : "entry missing", question);
-
-			if (want_refresh)
-				entry->want_refresh = true;
-
-			/*
-			 * We do not remove cache entry if there is still
-			 * valid IPv6 entry found in the cache.
-			 */
-			if (!cache_check_is_valid(entry->ipv6, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
-
-	case 28:	/* IPv6 */
-		if (!cache_check_is_valid(entry->ipv6, current_time)) {
-			debug("cache %s \"%s\" type AAAA", entry->ipv6 ?
-					"timeout" : "entry missing", question);
+	if (!cache_entry_lookup(entry, type)) {
+		debug("cache entry missing \"%s\" type %d", question, type);
 
-			if (want_refresh)
-				entry->want_refresh = true;
+		if (want_refresh)
+			entry->want_refresh = true;
 
-			if (!cache_check_is_valid(entry->ipv4, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
+		/*
+		 * We do not remove cache entry if there is still
+		 * valid data for some other type found in the cache.
+		 */
+		if (!entry->records && !want_refresh) {
+			g_hash_table_remove(cache, question);
+			type = 0;
 		}
-		break;
 	}
 
 	return type;
@@ -756,15 +1189,10 @@ static void cache_element_destroy(gpointer value)
 	if (!entry)
 		return;
 
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-	}
+	cache_entry_free_records(entry);
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-	}
+	cache_lru_unlink(entry);
+	cache_bytes -= entry->size;
 
 	g_free(entry->key);
 	g_free(entry);
@@ -787,15 +1215,42 @@ static gboolean try_remove_cache(gpointer user_data)
 	return FALSE;
 }
 
-static void create_cache(void)
+static void create_cache_table(void)
 {
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
+	if (!cache)
 		cache = g_hash_table_new_full(g_str_hash,
 					g_str_equal,
 					NULL,
 					cache_element_destroy);
 }
 
+static void create_cache(void)
+{
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
+		create_cache_table();
+}
+
+/*
+ * Answers to meta queries (zone transfers, ANY and the like) are not
+ * a record set of their own, so they are never cached.
+ */
+static bool cache_type_is_cacheable(uint16_t type)
+{
+	switch (type) {
+	case ns_t_opt:
+	case ns_t_tkey:
+	case ns_t_tsig:
+	case ns_t_ixfr:
+	case ns_t_axfr:
+	case ns_t_mailb:
+	case ns_t_maila:
+	case ns_t_any:
+		return false;
+	}
+
+	return true;
+}
+
 static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
 {
 	char *question;
@@ -817,8 +1272,7 @@ static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
 	q = (void *) (question + offset);
 	type = ntohs(q->type);
 
-	/* We only cache either A (1) or AAAA (28) requests */
-	if (type != 1 && type != 28)
+	if (ntohs(q->class) != ns_c_in || !cache_type_is_cacheable(type))
 		return NULL;
 
 	if (!cache) {
@@ -908,6 +1362,78 @@ static int get_name(int counter,
 	return 0;
 }
 
+/*
+ * Copy the rdata part of a resource record. Domain names inside the
+ * rdata of the well known record types may be compressed and then
+ * point to other parts of the original packet, so they are copied
+ * uncompressed in order to keep the cached record self contained.
+ * Returns the length of the copied rdata.
+ */
+static int copy_rdata(unsigned char *pkt, unsigned char *max,
+			uint16_t type, unsigned char *rdata, int rdlen,
+			unsigned char *output, int output_max)
+{
+	unsigned char *end = rdata + rdlen;
+	int skip = 0, names = 1, fixed = 0, len, i;
+	char name[NS_MAXDNAME];
+
+	if (end > max)
+		return -ENOBUFS;
+
+	switch (type) {
+	case ns_t_cname:
+	case ns_t_ns:
+	case ns_t_ptr:
+		break;
+	case ns_t_mx:
+		skip = 2;
+		break;
+	case ns_t_srv:
+		skip = 6;
+		break;
+	case ns_t_soa:
+		names = 2;
+		fixed = 20;
+		break;
+	default:
+		if (rdlen > output_max)
+			return -ENOBUFS;
+
+		memcpy(output, rdata, rdlen);
+		return rdlen;
+	}
+
+	if (rdlen < skip || skip > output_max)
+		return -EINVAL;
+
+	memcpy(output, rdata, skip);
+	rdata += skip;
+	len = skip;
+
+	for (i = 0; i < names; i++) {
+		int pos, comp_pos;
+
+		pos = dn_expand(pkt, max, rdata, name, sizeof(name));
+		if (pos < 0 || rdata + pos > end)
+			return -EINVAL;
+
+		comp_pos = dn_comp(name, output + len, output_max - len,
+								NULL, NULL);
+		if (comp_pos < 0)
+			return -ENOBUFS;
+
+		rdata += pos;
+		len += comp_pos;
+	}
+
+	if (end - rdata != fixed || len + fixed > output_max)
+		return -EINVAL;
+
+	memcpy(output + len, rdata, fixed);
+
+	return len + fixed;
+}
+
 static int parse_rr(unsigned char *buf, unsigned char *start,
 			unsigned char *max,
 			unsigned char *response, unsigned int *response_size,
@@ -916,7 +1442,7 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 			char *name, size_t max_name)
 {
 	struct domain_rr *rr;
-	int err, offset;
+	int err, offset, len;
 	int name_len = 0, output_len = 0, max_rsp = *response_size;
 
 	err = get_name(0, buf, start, max, response, max_rsp,
@@ -942,23 +1468,86 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 	if (*ttl < 0)
 		return -EINVAL;
 
+	if ((unsigned int) (offset + sizeof(struct domain_rr)) >
+							*response_size)
+		return -ENOBUFS;
+
 	memcpy(response + offset, *end, sizeof(struct domain_rr));
+	rr = (void *) (response + offset);
 
 	offset += sizeof(struct domain_rr);
 	*end += sizeof(struct domain_rr);
 
-	if ((unsigned int) (offset + *rdlen) > *response_size)
-		return -ENOBUFS;
+	len = copy_rdata(buf, max, *type, *end, *rdlen, response + offset,
+						*response_size - offset);
+	if (len < 0)
+		return len;
 
-	memcpy(response + offset, *end, *rdlen);
+	rr->rdlen = htons(len);
 
 	*end += *rdlen;
 
-	*response_size = offset + *rdlen;
+	*response_size = offset + len;
 
 	return 0;
 }
 
+/*
+ * Copy a resource record with its owner name uncompressed. This is
+ * used for the SOA record of negative answers, as the owner of that
+ * record is the zone and not the name in the question.
+ */
+static int copy_rr(unsigned char *buf, unsigned char *start,
+			unsigned char *max,
+			unsigned char *response, int response_max,
+			uint16_t *type, uint16_t *class, int *ttl,
+			unsigned char **end)
+{
+	struct domain_rr *rr;
+	char name[NS_MAXDNAME];
+	int pos, offset, rdlen, len;
+
+	pos = dn_expand(buf, max, start, name, sizeof(name));
+	if (pos < 0)
+		return -EINVAL;
+
+	offset = dn_comp(name, response, response_max, NULL, NULL);
+	if (offset < 0)
+		return -ENOBUFS;
+
+	start += pos;
+
+	if (start + sizeof(struct domain_rr) > max ||
+			offset + sizeof(struct domain_rr) >
+					(unsigned int) response_max)
+		return -ENOBUFS;
+
+	memcpy(response + offset, start, sizeof(struct domain_rr));
+	rr = (void *) (response + offset);
+
+	*type = ntohs(rr->type);
+	*class = ntohs(rr->class);
+	*ttl = ntohl(rr->ttl);
+	rdlen = ntohs(rr->rdlen);
+
+	if (*ttl < 0)
+		return -EINVAL;
+
+	offset += sizeof(struct domain_rr);
+	start += sizeof(struct domain_rr);
+
+	len = copy_rdata(buf, max, *type, start, rdlen, response + offset,
+						response_max - offset);
+	if (len < 0)
+		return len;
+
+	rr->rdlen = htons(len);
+
+	*end = start + rdlen;
+
+	return offset + len;
+}
+
 static bool check_alias(GSList *aliases, char *name)
 {
 	GSList *list;
@@ -978,14 +1567,15 @@ static int parse_response(unsigned char *buf, int buflen,
 			char *question, int qlen,
 			uint16_t *type, uint16_t *class, int *ttl,
 			unsigned char *response, unsigned int *response_len,
-			uint16_t *answers)
+			uint16_t *answers, uint16_t *authority)
 {
 	struct domain_hdr *hdr = (void *) buf;
 	struct domain_question *q;
 	unsigned char *ptr;
 	uint16_t qdcount = ntohs(hdr->qdcount);
 	uint16_t ancount = ntohs(hdr->ancount);
-	int err, i;
+	uint16_t nscount = ntohs(hdr->nscount);
+	int err, i, rr_ttl;
 	uint16_t qtype, qclass;
 	unsigned char *next = NULL;
 	unsigned int maxlen = *response_len;
@@ -1010,8 +1600,7 @@ static int parse_response(unsigned char *buf, int buflen,
 	q = (void *) ptr;
 	qtype = ntohs(q->type);
 
-	/* We cache only A and AAAA records */
-	if (qtype != 1 && qtype != 28)
+	if (!cache_type_is_cacheable(qtype))
 		return -ENOMSG;
 
 	qclass = ntohs(q->class);
@@ -1021,32 +1610,35 @@ static int parse_response(unsigned char *buf, int buflen,
 	err = -ENOMSG;
 	*response_len = 0;
 	*answers = 0;
+	*authority = 0;
+	*ttl = 0;
 
 	memset(name, 0, sizeof(name));
 
 	/*
 	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
-	 * A or AAAA question. We traverse the answers and parse the
-	 * resource records. Only A and AAAA records are cached, all
-	 * the other records in answers are skipped.
+	 * the question. We traverse the answers and parse the
+	 * resource records. Only records of the queried type are cached,
+	 * all the other records in answers are skipped.
 	 */
 	for (i = 0; i < ancount; i++) {
 		/*
-		 * Get one address at a time to this buffer.
+		 * Get one record at a time to this buffer.
 		 * The max size of the answer is
 		 *   2 (pointer) + 2 (type) + 2 (class) +
 		 *   4 (ttl) + 2 (rdlen) + addr (16 or 4) = 28
 		 * for A or AAAA record.
-		 * For CNAME the size can be bigger.
+		 * For records containing names (CNAME, SRV, PTR etc.)
+		 * and for TXT or HTTPS records the size can be bigger.
 		 */
-		unsigned char rsp[NS_MAXCDNAME];
+		unsigned char rsp[NS_PACKETSZ * 2];
 		unsigned int rsp_len = sizeof(rsp) - 1;
 		int ret, rdlen;
 
 		memset(rsp, 0, sizeof(rsp));
 
 		ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name,
+			type, class, &rr_ttl, &rdlen, &next, name,
 			sizeof(name) - 1);
 		if (ret != 0) {
 			err = ret;
@@ -1092,7 +1684,8 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * address of ipv6.l.google.com. For caching purposes this
 		 * should not cause any issues.
 		 */
-		if (*type == 5 && strncmp(question, name, qlen) == 0) {
+		if (*type == ns_t_cname && qtype != ns_t_cname &&
+				strncmp(question, name, qlen) == 0) {
 			/*
 			 * So now the alias answered the question. This is
 			 * not very useful from caching point of view as
@@ -1136,7 +1729,7 @@ static int parse_response(unsigned char *buf, int buflen,
 
 		if (*type == qtype) {
 			/*
-			 * We found correct type (A or AAAA)
+			 * We found correct type
 			 */
 			if (check_alias(aliases, name) ||
 				(!aliases && strncmp(question, name,
@@ -1155,6 +1748,14 @@ static int parse_response(unsigned char *buf, int buflen,
 				}
 				memcpy(response + *response_len, rsp, rsp_len);
 				*response_len += rsp_len;
+
+				/*
+				 * The record set lives as long as its
+				 * shortest lived record.
+				 */
+				if (*answers == 0 || rr_ttl < *ttl)
+					*ttl = rr_ttl;
+
 				(*answers)++;
 				err = 0;
 			}
@@ -1164,105 +1765,64 @@ static int parse_response(unsigned char *buf, int buflen,
 		next = NULL;
 	}
 
-out:
-	for (list = aliases; list; list = list->next)
-		g_free(list->data);
-	g_slist_free(aliases);
-
-	return err;
-}
-
-struct cache_timeout {
-	time_t current_time;
-	int max_timeout;
-	int try_harder;
-};
-
-static gboolean cache_check_entry(gpointer key, gpointer value,
-					gpointer user_data)
-{
-	struct cache_timeout *data = user_data;
-	struct cache_entry *entry = value;
-	int max_timeout;
-
-	/* Scale the number of hits by half as part of cache aging */
-
-	entry->hits /= 2;
-
 	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
+	 * A name that is an alias is not cached as negative answer, the
+	 * cache entry would lose the CNAME records that RFC 2308 section
+	 * 2.2 requires to be returned with it.
 	 */
+	if (*answers == 0 && !aliases && (hdr->rcode == ns_r_nxdomain ||
+					hdr->rcode == ns_r_noerror)) {
+		/*
+		 * Negative answer (NXDOMAIN or NODATA). As described
+		 * in RFC 2308 the SOA record in the authority section
+		 * tells how long the answer can be cached, the TTL is
+		 * the smaller of the SOA TTL and its MINIMUM field.
+		 */
+		err = 0;
 
-	if (entry->ipv4 && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
-
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
-	}
+		for (i = 0; i < nscount; i++) {
+			unsigned char rsp[NS_PACKETSZ * 2];
+			uint32_t minimum;
+			int rsp_len;
 
-	if (entry->ipv6 && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+			rsp_len = copy_rr(buf, ptr, buf + buflen,
+					rsp, sizeof(rsp), type, class,
+					&rr_ttl, &next);
+			if (rsp_len < 0)
+				break;
 
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
-	}
+			ptr = next;
+			next = NULL;
 
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
+			if (*type != ns_t_soa || *class != qclass)
+				continue;
 
-	return FALSE;
-}
+			if ((unsigned int) rsp_len > maxlen)
+				break;
 
-static void cache_cleanup(void)
-{
-	static int max_timeout;
-	struct cache_timeout data;
-	int count = 0;
+			memcpy(&minimum, rsp + rsp_len - 4, 4);
+			minimum = ntohl(minimum);
 
-	data.current_time = time(NULL);
-	data.max_timeout = 0;
-	data.try_harder = 0;
+			*ttl = rr_ttl;
+			if (minimum < (uint32_t) *ttl)
+				*ttl = minimum;
 
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+			memcpy(response, rsp, rsp_len);
+			*response_len = rsp_len;
+			*authority = 1;
+			break;
+		}
 	}
-	debug("removed %d in the first pass", count);
 
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = 1;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+	*type = qtype;
+	*class = qclass;
 
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+out:
+	for (list = aliases; list; list = list->next)
+		g_free(list->data);
+	g_slist_free(aliases);
+
+	return err;
 }
 
 static gboolean cache_invalidate_entry(gpointer key, gpointer value,
@@ -1274,21 +1834,13 @@ static gboolean cache_invalidate_entry(gpointer key, gpointer value,
 	cache_enforce_validity(entry);
 
 	/* if anything is not expired, mark the entry for refresh */
-	if (entry->hits > 0 && (entry->ipv4 || entry->ipv6))
+	if (entry->hits > 0 && entry->records)
 		entry->want_refresh = true;
 
 	/* delete the cached data */
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-	}
+	cache_entry_free_records(entry);
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
-	}
+	cache_entry_account(entry);
 
 	/* keep the entry if we want it refreshed, delete it otherwise */
 	if (entry->want_refresh)
@@ -1318,9 +1870,9 @@ static void cache_refresh_entry(struct cache_entry *entry)
 
 	cache_enforce_validity(entry);
 
-	if (entry->hits > 2 && !entry->ipv4)
+	if (entry->hits > 2 && !cache_entry_lookup(entry, ns_t_a))
 		entry->want_refresh = true;
-	if (entry->hits > 2 && !entry->ipv6)
+	if (entry->hits > 2 && !cache_entry_lookup(entry, ns_t_aaaa))
 		entry->want_refresh = true;
 
 	if (entry->want_refresh) {
@@ -1359,49 +1911,25 @@ static void cache_refresh(void)
 	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
 }
 
-static int reply_query_type(unsigned char *msg, int len)
-{
-	unsigned char *c;
-	int l;
-	int type;
-
-	/* skip the header */
-	c = msg + sizeof(struct domain_hdr);
-	len -= sizeof(struct domain_hdr);
-
-	if (len < 0)
-		return 0;
-
-	/* now the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c);
-	c += l;
-	type = c[0] << 8 | c[1];
-
-	return type;
-}
-
 static int cache_update(struct server_data *srv, unsigned char *msg,
-			unsigned int msg_len)
+			unsigned int msg_len, bool negative)
 {
 	int offset = protocol_offset(srv->protocol);
 	int err, qlen, ttl = 0;
-	uint16_t answers = 0, type = 0, class = 0;
+	uint16_t answers = 0, authority = 0, type = 0, class = 0;
 	struct domain_hdr *hdr = (void *)(msg + offset);
 	struct domain_question *q;
 	struct cache_entry *entry;
-	struct cache_data *data;
+	struct cache_data *data, *old = NULL;
 	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
+	unsigned char response[TCP_MAX_BUF_LEN];
 	unsigned char *ptr;
 	unsigned int rsplen;
 	bool new_entry = true;
 	time_t current_time;
 
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
+	if (cache_max_bytes == 0)
+		return 0;
 
 	current_time = time(NULL);
 
@@ -1416,8 +1944,8 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	debug("offset %d hdr %p msg %p rcode %d", offset, hdr, msg, hdr->rcode);
 
-	/* Continue only if response code is 0 (=ok) */
-	if (hdr->rcode != ns_r_noerror)
+	/* Continue only if response code is 0 (=ok) or 3 (=nxdomain) */
+	if (hdr->rcode != ns_r_noerror && hdr->rcode != ns_r_nxdomain)
 		return 0;
 
 	if (!cache)
@@ -1429,51 +1957,32 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	err = parse_response(msg + offset, msg_len - offset,
 				question, sizeof(question) - 1,
 				&type, &class, &ttl,
-				response, &rsplen, &answers);
+				response, &rsplen, &answers, &authority);
+	if (err < 0)
+		return 0;
 
-	/*
-	 * special case: if we do a ipv6 lookup and get no result
-	 * for a record that's already in our ipv4 cache.. we want
-	 * to cache the negative response.
-	 */
-	if ((err == -ENOMSG || err == -ENOBUFS) &&
-			reply_query_type(msg + offset,
-					msg_len - offset) == 28) {
-		entry = g_hash_table_lookup(cache, question);
-		if (entry && entry->ipv4 && !entry->ipv6) {
-			int cache_offset = 0;
-
-			data = g_try_new(struct cache_data, 1);
-			if (!data)
-				return -ENOMEM;
-			data->inserted = entry->ipv4->inserted;
-			data->type = type;
-			data->answers = ntohs(hdr->ancount);
-			data->timeout = entry->ipv4->timeout;
-			if (srv->protocol == IPPROTO_UDP)
-				cache_offset = 2;
-			data->data_len = msg_len + cache_offset;
-			data->data = ptr = g_malloc(data->data_len);
-			ptr[0] = (data->data_len - 2) / 256;
-			ptr[1] = (data->data_len - 2) - ptr[0] * 256;
-			if (srv->protocol == IPPROTO_UDP)
-				ptr += 2;
-			data->valid_until = entry->ipv4->valid_until;
-			data->cache_until = entry->ipv4->cache_until;
-			memcpy(ptr, msg, msg_len);
-			entry->ipv6 = data;
-			/*
-			 * we will get a "hit" when we serve the response
-			 * out of the cache
-			 */
-			entry->hits--;
-			if (entry->hits < 0)
-				entry->hits = 0;
-			return 0;
+	if (answers == 0 && !negative)
+		return 0;
+
+	entry = g_hash_table_lookup(cache, question);
+
+	if (answers == 0 && authority == 0) {
+		/*
+		 * A negative answer without SOA record does not tell
+		 * how long it may be cached (RFC 2308 section 5). We only
+		 * keep it together with other valid data of the same name
+		 * (typically a missing AAAA record next to a cached A
+		 * record) and let it expire at the same time.
+		 */
+		for (old = entry ? entry->records : NULL; old;
+							old = old->next) {
+			if (cache_check_is_valid(old, current_time))
+				break;
 		}
-	}
 
-	if (err < 0 || ttl == 0)
+		if (!old)
+			return 0;
+	} else if (ttl == 0)
 		return 0;
 
 	qlen = strlen(question);
@@ -1481,47 +1990,38 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	/*
 	 * If the cache contains already data, check if the
 	 * type of the cached data is the same and do not add
-	 * to cache if data is already there.
-	 * This is needed so that we can cache both A and AAAA
-	 * records for the same name.
+	 * to cache if data is already there. A positive answer
+	 * still replaces a cached negative one.
+	 * This is needed so that we can cache records of several
+	 * types for the same name.
 	 */
-	entry = g_hash_table_lookup(cache, question);
 	if (!entry) {
-		entry = g_try_new(struct cache_entry, 1);
+		entry = g_try_new0(struct cache_entry, 1);
 		if (!entry)
 			return -ENOMEM;
 
-		data = g_try_new(struct cache_data, 1);
+		data = g_try_new0(struct cache_data, 1);
 		if (!data) {
 			g_free(entry);
 			return -ENOMEM;
 		}
 
 		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
 		entry->want_refresh = false;
 		entry->hits = 0;
-
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
 	} else {
-		if (type == 1 && entry->ipv4)
-			return 0;
+		data = cache_entry_lookup(entry, type);
+		if (data) {
+			if (data->answers > 0 || answers == 0)
+				return 0;
 
-		if (type == 28 && entry->ipv6)
-			return 0;
+			cache_entry_remove_data(entry, data);
+		}
 
-		data = g_try_new(struct cache_data, 1);
+		data = g_try_new0(struct cache_data, 1);
 		if (!data)
 			return -ENOMEM;
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
-
 		/*
 		 * compensate for the hit we'll get for serving
 		 * the response out of the cache
@@ -1533,13 +2033,34 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 		new_entry = false;
 	}
 
-	if (ttl < MIN_CACHE_TTL)
-		ttl = MIN_CACHE_TTL;
-
-	data->inserted = current_time;
 	data->type = type;
 	data->answers = answers;
-	data->timeout = ttl;
+	data->authority = authority;
+	data->rcode = hdr->rcode;
+
+	if (answers == 0 && authority == 0) {
+		data->inserted = old->inserted;
+		data->timeout = old->timeout;
+		data->valid_until = old->valid_until;
+		data->cache_until = old->cache_until;
+	} else {
+		if (ttl < MIN_CACHE_TTL)
+			ttl = MIN_CACHE_TTL;
+
+		data->inserted = current_time;
+		data->timeout = ttl;
+		data->valid_until = current_time + ttl;
+
+		/*
+		 * Restrict the cached DNS record TTL to some sane value
+		 * in order to prevent data staying in the cache too long.
+		 */
+		if (ttl > MAX_CACHE_TTL)
+			ttl = MAX_CACHE_TTL;
+
+		data->cache_until = round_down_ttl(current_time + ttl, ttl);
+	}
+
 	/*
 	 * The "2" in start of the length is the TCP offset. We allocate it
 	 * here even for UDP packet because it simplifies the sending
@@ -1547,23 +2068,6 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	 */
 	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
 	data->data = ptr = g_malloc(data->data_len);
-	data->valid_until = current_time + ttl;
-
-	/*
-	 * Restrict the cached DNS record TTL to some sane value
-	 * in order to prevent data staying in the cache too long.
-	 */
-	if (ttl > MAX_CACHE_TTL)
-		ttl = MAX_CACHE_TTL;
-
-	data->cache_until = round_down_ttl(current_time + ttl, ttl);
-
-	if (!data->data) {
-		g_free(entry->key);
-		g_free(data);
-		g_free(entry);
-		return -ENOMEM;
-	}
 
 	/*
 	 * We cache the two extra bytes at the start of the message
@@ -1576,35 +2080,350 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	else
 		memcpy(ptr, msg, offset + 12);
 
-	ptr[0] = (data->data_len - 2) / 256;
-	ptr[1] = (data->data_len - 2) - ptr[0] * 256;
-	if (srv->protocol == IPPROTO_UDP)
-		ptr += 2;
+	ptr[0] = (data->data_len - 2) / 256;
+	ptr[1] = (data->data_len - 2) - ptr[0] * 256;
+	if (srv->protocol == IPPROTO_UDP)
+		ptr += 2;
+
+	memcpy(ptr + offset + 12, question, qlen + 1); /* copy also the \0 */
+
+	q = (void *) (ptr + offset + 12 + qlen + 1);
+	q->type = htons(type);
+	q->class = htons(class);
+	memcpy(ptr + offset + 12 + qlen + 1 + sizeof(struct domain_question),
+		response, rsplen);
+
+	if (cache_data_prepare(data) < 0) {
+		cache_data_free(data);
+		if (new_entry) {
+			g_free(entry->key);
+			g_free(entry);
+		} else
+			cache_entry_account(entry);
+		return -ENOMEM;
+	}
+
+	data->next = entry->records;
+	entry->records = data;
+
+	if (new_entry) {
+		g_hash_table_replace(cache, entry->key, entry);
+		cache_size++;
+	}
+
+	cache_entry_account(entry);
+	cache_lru_touch(entry);
+	cache_evict(entry);
+
+	cache_dirty = true;
+
+	debug("cache %d %squestion \"%s\" type %d ttl %d rcode %d size %zd "
+						"packet %u dns len %u",
+		cache_size, new_entry ? "new " : "old ",
+		question, type, ttl, data->rcode,
+		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
+		data->data_len,
+		srv->protocol == IPPROTO_TCP ?
+			(unsigned int)(data->data[0] * 256 + data->data[1]) :
+			data->data_len);
+
+	return 0;
+}
+
+static size_t snapshot_record_len(struct cache_entry *entry,
+					struct cache_data *data)
+{
+	size_t len;
+
+	len = sizeof(struct cache_snapshot_record) + strlen(entry->key) + 1 +
+							data->data_len;
+
+	return (len + 7) & ~7;
+}
+
+/*
+ * Write all valid cached record sets to disk, least recently used
+ * entries first so that loading the snapshot restores the LRU order.
+ */
+static int cache_snapshot_save(void)
+{
+	struct cache_snapshot_header *hdr;
+	struct cache_entry *entry;
+	struct cache_data *data;
+	time_t current_time = time(NULL);
+	GError *error = NULL;
+	unsigned char *buf, *ptr;
+	size_t len = sizeof(*hdr);
+	int err = 0;
+
+	if (!cache || cache_max_bytes == 0)
+		return 0;
+
+	for (entry = cache_lru_tail; entry; entry = entry->lru_prev)
+		for (data = entry->records; data; data = data->next)
+			if (cache_check_is_valid(data, current_time))
+				len += snapshot_record_len(entry, data);
+
+	buf = g_try_malloc0(len);
+	if (!buf)
+		return -ENOMEM;
+
+	hdr = (void *) buf;
+	hdr->magic = CACHE_SNAPSHOT_MAGIC;
+	hdr->version = CACHE_SNAPSHOT_VERSION;
+
+	ptr = buf + sizeof(*hdr);
+
+	for (entry = cache_lru_tail; entry; entry = entry->lru_prev) {
+		size_t key_len = strlen(entry->key);
+
+		for (data = entry->records; data; data = data->next) {
+			struct cache_snapshot_record *rec = (void *) ptr;
+
+			if (!cache_check_is_valid(data, current_time))
+				continue;
+
+			rec->len = snapshot_record_len(entry, data);
+			rec->data_len = data->data_len;
+			rec->inserted = data->inserted;
+			rec->valid_until = data->valid_until;
+			rec->cache_until = data->cache_until;
+			rec->timeout = data->timeout;
+			rec->hits = entry->hits;
+			rec->type = data->type;
+			rec->answers = data->answers;
+			rec->authority = data->authority;
+			rec->key_len = key_len;
+			rec->rcode = data->rcode;
+
+			memcpy(ptr + sizeof(*rec), entry->key, key_len + 1);
+			memcpy(ptr + sizeof(*rec) + key_len + 1, data->data,
+							data->data_len);
+
+			ptr += rec->len;
+			hdr->count++;
+		}
+	}
+
+	if (!g_file_set_contents(CACHE_SNAPSHOT_FILE, (gchar *) buf, len,
+								&error)) {
+		DBG("Failed to store DNS cache: %s", error->message);
+		g_error_free(error);
+		err = -EIO;
+	} else {
+		DBG("stored %u cached record sets", hdr->count);
+		cache_dirty = false;
+	}
+
+	g_free(buf);
+
+	return err;
+}
+
+static gboolean cache_snapshot_timeout(gpointer user_data)
+{
+	if (cache_dirty)
+		cache_snapshot_save();
+
+	return TRUE;
+}
+
+static int snapshot_name_length(const unsigned char *c,
+					const unsigned char *end)
+{
+	const unsigned char *nul;
+
+	if (c >= end)
+		return -EINVAL;
+
+	if ((c[0] & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+		return end - c >= 2 ? 2 : -EINVAL;
+
+	nul = memchr(c, '\0', end - c);
+	if (!nul)
+		return -EINVAL;
+
+	return nul - c + 1;
+}
+
+/*
+ * The packet comes straight from the file, so check that the question
+ * and all the records cache_data_prepare() walks over are within it.
+ */
+static bool snapshot_packet_is_valid(const unsigned char *packet,
+					unsigned int len, int count)
+{
+	const unsigned char *c, *end = packet + len;
+	int i, n;
+
+	if (len < 2 + sizeof(struct domain_hdr))
+		return false;
+
+	c = packet + 2 + sizeof(struct domain_hdr);
+
+	n = snapshot_name_length(c, end);
+	if (n < 0 || end - c < n + 4)
+		return false;
+
+	c += n + 4;
+
+	for (i = 0; i < count; i++) {
+		/* name, type, class, TTL and rdlen */
+		n = snapshot_name_length(c, end);
+		if (n < 0 || end - c < n + 10)
+			return false;
+
+		c += n + 4;
+
+		n = c[4] << 8 | c[5];
+		if (end - c < n + 6)
+			return false;
+
+		c += n + 6;
+	}
+
+	return true;
+}
+
+static void cache_snapshot_load_record(struct cache_snapshot_record *rec,
+					const char *key, unsigned char *packet)
+{
+	struct cache_entry *entry;
+	struct cache_data *data;
+	bool new_entry = false;
+
+	if (!snapshot_packet_is_valid(packet, rec->data_len,
+					rec->answers + rec->authority))
+		return;
+
+	entry = g_hash_table_lookup(cache, key);
+	if (entry && cache_entry_lookup(entry, rec->type))
+		return;
+
+	data = g_try_new0(struct cache_data, 1);
+	if (!data)
+		return;
+
+	data->type = rec->type;
+	data->answers = rec->answers;
+	data->authority = rec->authority;
+	data->rcode = rec->rcode;
+	data->inserted = rec->inserted;
+	data->timeout = rec->timeout;
+	data->valid_until = rec->valid_until;
+	data->cache_until = rec->cache_until;
+	data->data_len = rec->data_len;
+	data->data = g_memdup(packet, rec->data_len);
+
+	if (!data->data || cache_data_prepare(data) < 0) {
+		cache_data_free(data);
+		return;
+	}
+
+	if (!entry) {
+		entry = g_try_new0(struct cache_entry, 1);
+		if (!entry) {
+			cache_data_free(data);
+			return;
+		}
+
+		entry->key = g_strdup(key);
+		entry->hits = rec->hits;
+		new_entry = true;
+	}
+
+	data->next = entry->records;
+	entry->records = data;
+
+	if (new_entry) {
+		g_hash_table_replace(cache, entry->key, entry);
+		cache_size++;
+	}
+
+	cache_entry_account(entry);
+	cache_lru_touch(entry);
+	cache_evict(entry);
+}
+
+/*
+ * Restore the cache from the snapshot. Record sets whose lifetime
+ * ended while connmand was not running are dropped, the remaining
+ * ones keep their absolute expiry time so TTLs count down as if the
+ * cache had never been gone.
+ */
+static void cache_snapshot_load(void)
+{
+	struct cache_snapshot_header *hdr;
+	time_t current_time = time(NULL);
+	unsigned char *map, *ptr, *end;
+	struct stat st;
+	unsigned int i, loaded = 0;
+	int fd;
+
+	if (cache_max_bytes == 0)
+		return;
+
+	fd = open(CACHE_SNAPSHOT_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	hdr = (void *) map;
+	if (hdr->magic != CACHE_SNAPSHOT_MAGIC ||
+			hdr->version != CACHE_SNAPSHOT_VERSION) {
+		DBG("ignoring DNS cache snapshot of unknown format");
+		goto out;
+	}
+
+	/*
+	 * The restored cache is not a user of its own, it is handed over
+	 * to the DNS servers once they are added and take their reference.
+	 */
+	create_cache_table();
 
-	memcpy(ptr + offset + 12, question, qlen + 1); /* copy also the \0 */
+	ptr = map + sizeof(*hdr);
+	end = map + st.st_size;
 
-	q = (void *) (ptr + offset + 12 + qlen + 1);
-	q->type = htons(type);
-	q->class = htons(class);
-	memcpy(ptr + offset + 12 + qlen + 1 + sizeof(struct domain_question),
-		response, rsplen);
+	for (i = 0; i < hdr->count; i++) {
+		struct cache_snapshot_record *rec = (void *) ptr;
+		char *key;
 
-	if (new_entry) {
-		g_hash_table_replace(cache, entry->key, entry);
-		cache_size++;
+		if ((size_t) (end - ptr) < sizeof(*rec) ||
+				rec->len < sizeof(*rec) || rec->len & 7 ||
+				rec->len > (size_t) (end - ptr))
+			break;
+
+		if (sizeof(*rec) + rec->key_len + 1 + rec->data_len > rec->len)
+			break;
+
+		key = (char *) ptr + sizeof(*rec);
+		ptr += rec->len;
+
+		if (key[rec->key_len] != '\0' || rec->data_len < 2 + 12)
+			continue;
+
+		if (rec->cache_until < current_time ||
+				rec->valid_until < current_time)
+			continue;
+
+		cache_snapshot_load_record(rec, key,
+				(unsigned char *) key + rec->key_len + 1);
+		loaded++;
 	}
 
-	debug("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
-								"dns len %u",
-		cache_size, new_entry ? "new " : "old ",
-		question, type, ttl,
-		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
-		data->data_len,
-		srv->protocol == IPPROTO_TCP ?
-			(unsigned int)(data->data[0] * 256 + data->data[1]) :
-			data->data_len);
+	DBG("restored %u of %u cached record sets", loaded, hdr->count);
 
-	return 0;
+out:
+	munmap(map, st.st_size);
 }
 
 static int ns_resolv(struct server_data *server, struct request_data *req,
@@ -1620,21 +2439,18 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		int ttl_left = 0;
 		struct cache_data *data;
 
-		debug("cache hit %s type %s", lookup, type == 1 ? "A" : "AAAA");
-		if (type == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		debug("cache hit %s type %d", lookup, type);
+		data = cache_entry_lookup(entry, type);
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+			cache_hit(entry);
 		}
 
 		if (data && req->protocol == IPPROTO_TCP) {
-			send_cached_response(req->client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+			send_cached_response(req->client_sk, data,
+					NULL, 0, IPPROTO_TCP,
+					req->srcid, ttl_left);
 			return 1;
 		}
 
@@ -1644,10 +2460,9 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 			if (udp_sk < 0)
 				return -EIO;
 
-			send_cached_response(udp_sk, data->data,
-				data->data_len, &req->sa, req->sa_len,
-				IPPROTO_UDP, req->srcid, data->answers,
-				ttl_left);
+			send_cached_response(udp_sk, data,
+				&req->sa, req->sa_len,
+				IPPROTO_UDP, req->srcid, ttl_left);
 			return 1;
 		}
 	}
@@ -1665,6 +2480,7 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 	}
 
 	req->numserv++;
+	request_add_server(req, server);
 
 	/* If we have more than one dot, we don't add domains */
 	dot = strchr(lookup, '.');
@@ -1725,6 +2541,7 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 			return -EIO;
 
 		req->numserv++;
+		request_add_server(req, server);
 	}
 
 	return 0;
@@ -1932,12 +2749,15 @@ static int strip_domains(char *name, char *answers, int maxlen)
 	return end - start;
 }
 
+static int race_next(struct request_data *req, gpointer request,
+							gpointer name);
+
 static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 				struct server_data *data)
 {
 	struct domain_hdr *hdr;
 	struct request_data *req;
-	int dns_id, sk, err, offset = protocol_offset(protocol);
+	int dns_id, sk, err, status = 0, offset = protocol_offset(protocol);
 
 	if (offset < 0)
 		return offset;
@@ -1958,6 +2778,7 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	reply[offset + 1] = req->srcid >> 8;
 
 	req->numresp++;
+	request_remove_server(req, data);
 
 	if (hdr->rcode == ns_r_noerror || !req->resp) {
 		unsigned char *new_reply = NULL;
@@ -2131,12 +2952,20 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 		memcpy(req->resp, reply, reply_len);
 		req->resplen = reply_len;
 
-		cache_update(data, reply, reply_len);
+		/*
+		 * Negative answers are not cached when we appended a
+		 * domain to the query as the other queries might still
+		 * find the name.
+		 */
+		cache_update(data, reply, reply_len, !req->append_domain);
 
 		g_free(new_reply);
 	}
 
 out:
+	if (hdr->rcode == ns_r_servfail || hdr->rcode == ns_r_refused)
+		server_failure(data);
+
 	if (req->numresp < req->numserv) {
 		if (hdr->rcode > ns_r_noerror) {
 			return -EINVAL;
@@ -2145,7 +2974,24 @@ out:
 		}
 	}
 
-	request_list = g_slist_remove(request_list, req);
+	/*
+	 * The server could not answer, so give the next best one a
+	 * chance before returning the failure to the client.
+	 */
+	if ((hdr->rcode == ns_r_servfail || hdr->rcode == ns_r_refused) &&
+			req->protocol == IPPROTO_UDP && req->request) {
+		status = race_next(req, req->request, req->name);
+		if (status == 0)
+			return -EINVAL;
+	}
+
+	request_list_remove(req);
+
+	if (status > 0) {
+		/* a cached result was sent, nothing left to forward */
+		destroy_request_data(req);
+		return 0;
+	}
 
 	if (protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
@@ -2198,16 +3044,28 @@ static void server_destroy_socket(struct server_data *data)
 
 static void destroy_server(struct server_data *server)
 {
+	GList *list;
+
 	debug("index %d server %s sock %d", server->index, server->server,
 			server->channel ?
 			g_io_channel_unix_get_fd(server->channel): -1);
 
-	server_list = g_slist_remove(server_list, server);
+	server_list_remove(server);
 	server_destroy_socket(server);
 
+	for (list = request_list.head; list; list = list->next) {
+		struct request_data *req = list->data;
+
+		request_forget_server(req, server);
+
+		if (req->racing == server)
+			req->racing = NULL;
+	}
+
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		debug("Removing DNS server %s", server->server);
 
+	g_free(server->key);
 	g_free(server->server);
 	g_list_free_full(server->domains, g_free);
 	g_free(server->server_addr);
@@ -2264,7 +3122,7 @@ static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
 		return FALSE;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		GSList *list;
+		GList *list;
 hangup:
 		debug("TCP server channel closed, sk %d", sk);
 
@@ -2275,7 +3133,7 @@ hangup:
 		g_free(server->incoming_reply);
 		server->incoming_reply = NULL;
 
-		list = request_list;
+		list = request_list.head;
 		while (list) {
 			struct request_data *req = list->data;
 			struct domain_hdr *hdr;
@@ -2300,7 +3158,8 @@ hangup:
 			send_response(req->client_sk, req->request,
 				req->request_len, NULL, 0, IPPROTO_TCP);
 
-			request_list = g_slist_remove(request_list, req);
+			request_release_servers(req, false);
+			request_list_remove(req);
 		}
 
 		destroy_server(server);
@@ -2309,7 +3168,7 @@ hangup:
 	}
 
 	if ((condition & G_IO_OUT) && !server->connected) {
-		GSList *list;
+		GList *list;
 		GList *domains;
 		bool no_request_sent = true;
 		struct server_data *udp_server;
@@ -2330,14 +3189,14 @@ hangup:
 		}
 
 		server->connected = true;
-		server_list = g_slist_append(server_list, server);
+		server_list_add(server);
 
 		if (server->timeout > 0) {
 			g_source_remove(server->timeout);
 			server->timeout = 0;
 		}
 
-		for (list = request_list; list; ) {
+		for (list = request_list.head; list; ) {
 			struct request_data *req = list->data;
 			int status;
 
@@ -2356,7 +3215,7 @@ hangup:
 				 * so the request can be released
 				 */
 				list = list->next;
-				request_list = g_slist_remove(request_list, req);
+				request_list_remove(req);
 				destroy_request_data(req);
 				continue;
 			}
@@ -2581,6 +3440,9 @@ static struct server_data *create_server(int index,
 		data->domains = g_list_append(data->domains, g_strdup(domain));
 	data->server = g_strdup(server);
 	data->protocol = protocol;
+	data->key = server_key(index, server, protocol);
+	data->srtt = SERVER_RTT_INITIAL;
+	data->rttvar = SERVER_RTT_INITIAL / 2;
 
 	memset(&hints, 0, sizeof(hints));
 
@@ -2650,15 +3512,15 @@ static struct server_data *create_server(int index,
 			enable_fallback(false);
 		}
 
-		server_list = g_slist_append(server_list, data);
+		server_list_add(data);
 	}
 
 	return data;
 }
 
-static bool resolv(struct request_data *req,
-				gpointer request, gpointer name)
+static struct server_data *best_server(struct request_data *req)
 {
+	struct server_data *best = NULL;
 	GSList *list;
 
 	for (list = server_list; list; list = list->next) {
@@ -2669,11 +3531,49 @@ static bool resolv(struct request_data *req,
 			continue;
 		}
 
-		debug("server %s enabled %d", data->server, data->enabled);
+		debug("server %s enabled %d score %u", data->server,
+					data->enabled, server_score(data));
 
 		if (!data->enabled)
 			continue;
 
+		if (request_lookup_server(req, data))
+			continue;
+
+		if (best && server_score(best) <= server_score(data))
+			continue;
+
+		best = data;
+	}
+
+	return best;
+}
+
+static gboolean race_timeout(gpointer user_data);
+
+/*
+ * Send the request to the best server it was not sent to yet. Returns
+ * 1 if a cached answer was sent instead, 0 if the request was sent and
+ * -ENOENT if no server is left to try.
+ */
+static int race_next(struct request_data *req, gpointer request,
+							gpointer name)
+{
+	struct server_data *data;
+	int err;
+
+	if (req->race > 0) {
+		g_source_remove(req->race);
+		req->race = 0;
+	}
+
+	req->racing = NULL;
+
+	while ((data = best_server(req))) {
+		struct request_server *entry;
+
+		entry = request_mark_server(req, data);
+
 		if (!data->channel && data->protocol == IPPROTO_UDP) {
 			if (server_create_socket(data) < 0) {
 				DBG("socket creation failed while resolving");
@@ -2681,11 +3581,51 @@ static bool resolv(struct request_data *req,
 			}
 		}
 
-		if (ns_resolv(data, req, request, name) > 0)
-			return true;
+		err = ns_resolv(data, req, request, name);
+		if (err > 0)
+			return 1;
+
+		if (err < 0 && !entry->pending) {
+			server_failure(data);
+			continue;
+		}
+
+		req->racing = data;
+		req->race = g_timeout_add(server_timeout(data),
+						race_timeout, req);
+		return 0;
 	}
 
-	return false;
+	return -ENOENT;
+}
+
+static gboolean race_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+	struct request_server *entry;
+
+	req->race = 0;
+
+	entry = request_lookup_server(req, req->racing);
+	if (entry && entry->pending && !entry->replied) {
+		debug("server %s did not answer in time", req->racing->server);
+		entry->timed_out = true;
+		server_failure(req->racing);
+	}
+
+	if (race_next(req, req->request, req->name) > 0) {
+		/* a cached result was sent, so the request can be released */
+		request_list_remove(req);
+		destroy_request_data(req);
+	}
+
+	return FALSE;
+}
+
+static bool resolv(struct request_data *req,
+				gpointer request, gpointer name)
+{
+	return race_next(req, request, name) > 0;
 }
 
 static void update_domain(int index, const char *domain, bool append)
@@ -2742,9 +3682,9 @@ static void remove_domain(int index, const char *domain)
 
 static void flush_requests(struct server_data *server)
 {
-	GSList *list;
+	GList *list;
 
-	list = request_list;
+	list = request_list.head;
 	while (list) {
 		struct request_data *req = list->data;
 
@@ -2755,8 +3695,7 @@ static void flush_requests(struct server_data *server)
 			 * A cached result was sent,
 			 * so the request can be released
 			 */
-			request_list =
-				g_slist_remove(request_list, req);
+			request_list_remove(req);
 			destroy_request_data(req);
 			continue;
 		}
@@ -2915,6 +3854,137 @@ static void dnsproxy_default_changed(struct connman_service *service)
 	cache_refresh();
 }
 
+static DBusMessage *get_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+	dbus_uint32_t val;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+
+	val = cache_size;
+	connman_dbus_dict_append_basic(&dict, "CacheEntries",
+					DBUS_TYPE_UINT32, &val);
+
+	val = cache_bytes;
+	connman_dbus_dict_append_basic(&dict, "CacheSize",
+					DBUS_TYPE_UINT32, &val);
+
+	val = cache_max_bytes;
+	connman_dbus_dict_append_basic(&dict, "CacheLimit",
+					DBUS_TYPE_UINT32, &val);
+
+	connman_dbus_dict_append_basic(&dict, "CacheHits",
+					DBUS_TYPE_UINT64, &cache_stats.hits);
+	connman_dbus_dict_append_basic(&dict, "CacheMisses",
+					DBUS_TYPE_UINT64, &cache_stats.misses);
+	connman_dbus_dict_append_basic(&dict, "CacheEvictions",
+					DBUS_TYPE_UINT64,
+					&cache_stats.evictions);
+
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
+static void append_server(DBusMessageIter *iter, struct server_data *server)
+{
+	DBusMessageIter dict;
+	const char *str;
+	dbus_int32_t index = server->index;
+	dbus_bool_t enabled = server->enabled;
+	dbus_uint32_t val;
+
+	connman_dbus_dict_open(iter, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Address",
+					DBUS_TYPE_STRING, &server->server);
+
+	connman_dbus_dict_append_basic(&dict, "Index",
+					DBUS_TYPE_INT32, &index);
+
+	str = server->protocol == IPPROTO_TCP ? "tcp" : "udp";
+	connman_dbus_dict_append_basic(&dict, "Protocol",
+					DBUS_TYPE_STRING, &str);
+
+	connman_dbus_dict_append_basic(&dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &enabled);
+
+	connman_dbus_dict_append_basic(&dict, "PendingRequests",
+					DBUS_TYPE_UINT32, &server->pending);
+
+	connman_dbus_dict_append_basic(&dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &server->srtt);
+
+	connman_dbus_dict_append_basic(&dict, "RoundTripTimeVariance",
+					DBUS_TYPE_UINT32, &server->rttvar);
+
+	connman_dbus_dict_append_basic(&dict, "FailureRate",
+					DBUS_TYPE_UINT32, &server->failure_rate);
+
+	val = server_score(server);
+	connman_dbus_dict_append_basic(&dict, "Score",
+					DBUS_TYPE_UINT32, &val);
+
+	connman_dbus_dict_append_basic(&dict, "Replies",
+					DBUS_TYPE_UINT64, &server->replies);
+
+	connman_dbus_dict_append_basic(&dict, "Failures",
+					DBUS_TYPE_UINT64, &server->failures);
+
+	connman_dbus_dict_close(iter, &dict);
+}
+
+static DBusMessage *get_servers(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+	GSList *list;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	for (list = server_list; list; list = list->next)
+		append_server(&array, list->data);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
+static const GDBusMethodTable dnsproxy_methods[] = {
+	{ GDBUS_METHOD("GetStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_statistics) },
+	{ GDBUS_METHOD("GetServers",
+			NULL, GDBUS_ARGS({ "servers", "aa{sv}" }),
+			get_servers) },
+	{ },
+};
+
+static DBusConnection *connection = NULL;
+
 static struct connman_notifier dnsproxy_notifier = {
 	.name			= "dnsproxy",
 	.default_changed	= dnsproxy_default_changed,
@@ -3129,19 +4199,16 @@ read_another:
 		int ttl_left = 0;
 		struct cache_data *data;
 
-		debug("cache hit %s type %s", query, qtype == 1 ? "A" : "AAAA");
-		if (qtype == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		debug("cache hit %s type %d", query, qtype);
+		data = cache_entry_lookup(entry, qtype);
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+			cache_hit(entry);
 
-			send_cached_response(client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+			send_cached_response(client_sk, data,
+					NULL, 0, IPPROTO_TCP,
+					req->srcid, ttl_left);
 
 			g_free(req);
 			goto out;
@@ -3149,6 +4216,8 @@ read_another:
 			debug("data missing, ignoring cache for this query");
 	}
 
+	cache_stats.misses++;
+
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
 
@@ -3197,7 +4266,7 @@ read_another:
 
 	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
 
-	request_list = g_slist_append(request_list, req);
+	request_list_add(req);
 
 out:
 	if (client->buf_end > (msg_len + 2)) {
@@ -3475,57 +4544,56 @@ static gboolean tcp6_listener_event(GIOChannel *channel, GIOCondition condition,
 				&ifdata->tcp6_listener_watch);
 }
 
-static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
-				struct listener_data *ifdata, int family,
-				guint *listener_watch)
+/*
+ * Fast path for cache hits. The answer is built from the cached
+ * response template into the given buffer without allocating any
+ * request data. Returns the length of the answer, or 0 if the query
+ * cannot be answered this way.
+ */
+static int cache_reply(unsigned char *buf, unsigned char *reply,
+							int reply_max)
 {
-	unsigned char buf[768];
-	char query[512];
-	struct request_data *req;
-	struct sockaddr_in6 client_addr6;
-	socklen_t client_addr6_len = sizeof(client_addr6);
-	struct sockaddr_in client_addr4;
-	socklen_t client_addr4_len = sizeof(client_addr4);
-	void *client_addr;
-	socklen_t *client_addr_len;
-	int sk, err, len;
+	struct cache_entry *entry;
+	struct cache_data *data;
+	int qtype = 0, len;
+	uint16_t id;
 
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		*listener_watch = 0;
-		return false;
-	}
+	entry = cache_check(buf, &qtype, IPPROTO_UDP);
+	if (!entry)
+		return 0;
 
-	sk = g_io_channel_unix_get_fd(channel);
+	data = cache_entry_lookup(entry, qtype);
+	if (!data)
+		return 0;
 
-	if (family == AF_INET) {
-		client_addr = &client_addr4;
-		client_addr_len = &client_addr4_len;
-	} else {
-		client_addr = &client_addr6;
-		client_addr_len = &client_addr6_len;
-	}
+	len = data->data_len - 2;
+	if (len > reply_max)
+		return 0;
 
-	memset(client_addr, 0, *client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, client_addr, client_addr_len);
-	if (len < 2)
-		return true;
+	debug("cache hit type %d", qtype);
 
-	debug("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
+	cache_hit(entry);
 
-	err = parse_request(buf, len, query, sizeof(query));
-	if (err < 0 || (g_slist_length(server_list) == 0)) {
-		send_response(sk, buf, len, client_addr,
-				*client_addr_len, IPPROTO_UDP);
-		return true;
-	}
+	memcpy(&id, buf, sizeof(id));
+	memcpy(reply, data->data + 2, len);
+	cache_data_patch(data, reply, id, data->valid_until - time(NULL));
+
+	return len;
+}
+
+static void udp_handle_request(int sk, struct listener_data *ifdata,
+				int family, unsigned char *buf, int len,
+				char *query, void *client_addr,
+				socklen_t client_addr_len)
+{
+	struct request_data *req;
 
 	req = g_try_new0(struct request_data, 1);
 	if (!req)
-		return true;
+		return;
 
-	memcpy(&req->sa, client_addr, *client_addr_len);
-	req->sa_len = *client_addr_len;
+	memcpy(&req->sa, client_addr, client_addr_len);
+	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 	req->family = family;
@@ -3545,14 +4613,115 @@ static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	if (resolv(req, buf, query)) {
 		/* a cached result was sent, so the request can be released */
 	        g_free(req);
-		return true;
+		return;
 	}
 
+	cache_stats.misses++;
+
 	req->name = g_strdup(query);
 	req->request = g_malloc(len);
 	memcpy(req->request, buf, len);
 	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
-	request_list = g_slist_append(request_list, req);
+	request_list_add(req);
+}
+
+/*
+ * Queries are read in batches with recvmmsg(). Cache hits are
+ * answered from stack buffers and sent back with a single sendmmsg()
+ * call, only the queries that need to be forwarded allocate request
+ * data.
+ */
+static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
+				struct listener_data *ifdata, int family,
+				guint *listener_watch)
+{
+	unsigned char buf[UDP_BATCH_SIZE][UDP_MAX_BUF_LEN];
+	unsigned char reply[UDP_BATCH_SIZE][UDP_CACHED_REPLY_LEN];
+	struct sockaddr_in6 client_addr[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE], reply_iov[UDP_BATCH_SIZE];
+	struct mmsghdr msgs[UDP_BATCH_SIZE], replies[UDP_BATCH_SIZE];
+	char query[512];
+	int sk, err, len, count, num_replies = 0, i;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		*listener_watch = 0;
+		return false;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	memset(msgs, 0, sizeof(msgs));
+	memset(client_addr, 0, sizeof(client_addr));
+
+	for (i = 0; i < UDP_BATCH_SIZE; i++) {
+		/* leave room for terminating the question name */
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = UDP_MAX_BUF_LEN - 1;
+
+		msgs[i].msg_hdr.msg_name = &client_addr[i];
+		msgs[i].msg_hdr.msg_namelen = family == AF_INET ?
+						sizeof(struct sockaddr_in) :
+						sizeof(struct sockaddr_in6);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	count = recvmmsg(sk, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (count <= 0)
+		return true;
+
+	for (i = 0; i < count; i++) {
+		void *addr = &client_addr[i];
+		socklen_t addr_len = msgs[i].msg_hdr.msg_namelen;
+
+		len = msgs[i].msg_len;
+		if (len < 2)
+			continue;
+
+		buf[i][len] = '\0';
+
+		debug("Received %d bytes (id 0x%04x)", len,
+						buf[i][0] | buf[i][1] << 8);
+
+		err = parse_request(buf[i], len, query, sizeof(query));
+		if (err < 0 || !server_list) {
+			send_response(sk, buf[i], len, addr, addr_len,
+							IPPROTO_UDP);
+			continue;
+		}
+
+		err = cache_reply(buf[i], reply[num_replies],
+						UDP_CACHED_REPLY_LEN);
+		if (err > 0) {
+			struct mmsghdr *msg = &replies[num_replies];
+
+			reply_iov[num_replies].iov_base = reply[num_replies];
+			reply_iov[num_replies].iov_len = err;
+
+			memset(msg, 0, sizeof(*msg));
+			msg->msg_hdr.msg_name = addr;
+			msg->msg_hdr.msg_namelen = addr_len;
+			msg->msg_hdr.msg_iov = &reply_iov[num_replies];
+			msg->msg_hdr.msg_iovlen = 1;
+
+			num_replies++;
+			continue;
+		}
+
+		udp_handle_request(sk, ifdata, family, buf[i], len, query,
+							addr, addr_len);
+	}
+
+	if (num_replies > 0) {
+		err = sendmmsg(sk, replies, num_replies, MSG_NOSIGNAL);
+		if (err < 0)
+			connman_error("Cannot send cached DNS responses: %s",
+							strerror(errno));
+		else if (err < num_replies)
+			debug("sent %d of %d cached responses", err,
+							num_replies);
+	}
 
 	return true;
 }
@@ -3812,7 +4981,7 @@ static int create_listener(struct listener_data *ifdata)
 static void destroy_listener(struct listener_data *ifdata)
 {
 	int index;
-	GSList *list;
+	GList *list;
 
 	index = connman_inet_ifindex("lo");
 	if (ifdata->index == index) {
@@ -3820,17 +4989,18 @@ static void destroy_listener(struct listener_data *ifdata)
 		__connman_resolvfile_remove(index, NULL, "::1");
 	}
 
-	for (list = request_list; list; list = list->next) {
+	for (list = request_list.head; list; list = list->next) {
 		struct request_data *req = list->data;
 
 		debug("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
+		req->link = NULL;
 		destroy_request_data(req);
 		list->data = NULL;
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
+	g_queue_clear(&request_list);
+	g_hash_table_remove_all(request_table);
 
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
@@ -3928,6 +5098,9 @@ int __connman_dnsproxy_init(void)
 							NULL,
 							free_partial_reqs);
 
+	request_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	server_table = g_hash_table_new(g_str_hash, g_str_equal);
+
 	index = connman_inet_ifindex("lo");
 	err = __connman_dnsproxy_add_listener(index);
 	if (err < 0)
@@ -3937,12 +5110,27 @@ int __connman_dnsproxy_init(void)
 	if (err < 0)
 		goto destroy;
 
+	cache_max_bytes = connman_setting_get_uint("DNSProxyCacheSize");
+
+	cache_snapshot_load();
+	snapshot_timer = g_timeout_add_seconds(CACHE_SNAPSHOT_INTERVAL,
+						cache_snapshot_timeout, NULL);
+
+	connection = connman_dbus_get_connection();
+	if (connection)
+		g_dbus_register_interface(connection, CONNMAN_MANAGER_PATH,
+						CONNMAN_DNSPROXY_INTERFACE,
+						dnsproxy_methods, NULL,
+						NULL, NULL, NULL);
+
 	return 0;
 
 destroy:
 	__connman_dnsproxy_remove_listener(index);
 	g_hash_table_destroy(listener_table);
 	g_hash_table_destroy(partial_tcp_req_table);
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(server_table);
 
 	return err;
 }
@@ -3961,6 +5149,13 @@ void __connman_dnsproxy_cleanup(void)
 		cache_timer = 0;
 	}
 
+	if (snapshot_timer) {
+		g_source_remove(snapshot_timer);
+		snapshot_timer = 0;
+	}
+
+	cache_snapshot_save();
+
 	if (cache) {
 		g_hash_table_destroy(cache);
 		cache = NULL;
@@ -3968,9 +5163,19 @@ void __connman_dnsproxy_cleanup(void)
 
 	connman_notifier_unregister(&dnsproxy_notifier);
 
+	if (connection) {
+		g_dbus_unregister_interface(connection, CONNMAN_MANAGER_PATH,
+						CONNMAN_DNSPROXY_INTERFACE);
+		dbus_connection_unref(connection);
+		connection = NULL;
+	}
+
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
 
 	g_hash_table_destroy(listener_table);
 
 	g_hash_table_destroy(partial_tcp_req_table);
+
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(server_table);
 }
@@ -350,8 +350,12 @@ static void firewall_remove_rules(struct firewall_context *ctx)
 static int firewall_enable_rules(struct firewall_context *ctx)
 {
 	struct fw_rule *rule;
-	GList *list;
-	int err = -ENOENT;
+	GList *list, *last;
+	GSList *failed = NULL;
+	int e, err = -ENOENT;
+
+	/* Replace each table only once for all rules of the context */
+	__connman_iptables_begin();
 
 	for (list = g_list_first(ctx->rules); list; list = g_list_next(list)) {
 		rule = list->data;
@@ -361,6 +365,25 @@ static int firewall_enable_rules(struct firewall_context *ctx)
 			break;
 	}
 
+	e = __connman_iptables_end_failed(&failed);
+	if (e < 0) {
+		/*
+		 * The rules enabled above are in the kernel unless their
+		 * table could not be replaced.
+		 */
+		for (last = list, list = g_list_first(ctx->rules);
+					list != last; list = g_list_next(list)) {
+			rule = list->data;
+
+			if (g_slist_find_custom(failed, rule->table,
+						(GCompareFunc) g_strcmp0))
+				rule->enabled = false;
+		}
+
+		g_slist_free_full(failed, g_free);
+		err = e;
+	}
+
 	return err;
 }
 
@@ -371,6 +394,8 @@ static int firewall_disable_rules(struct firewall_context *ctx)
 	int e;
 	int err = -ENOENT;
 
+	__connman_iptables_begin();
+
 	for (list = g_list_last(ctx->rules); list;
 			list = g_list_previous(list)) {
 		rule = list->data;
@@ -384,6 +409,13 @@ static int firewall_disable_rules(struct firewall_context *ctx)
 			err = e;
 	}
 
+	e = __connman_iptables_end();
+	if (e < 0) {
+		connman_error("Cannot remove previously installed "
+			"iptables rules: %s", strerror(-e));
+		err = e;
+	}
+
 	return err;
 }
 
@@ -527,6 +559,16 @@ int __connman_firewall_disable_marking(struct firewall_context *ctx)
 	return firewall_disable_rules(ctx);
 }
 
+void __connman_firewall_begin(void)
+{
+	__connman_iptables_begin();
+}
+
+int __connman_firewall_end(void)
+{
+	return __connman_iptables_end();
+}
+
 static void iterate_chains_cb(const char *chain_name, void *user_data)
 {
 	GSList **chains = user_data;
@@ -597,9 +639,13 @@ static void flush_all_tables(void)
 		return;
 	}
 
+	__connman_iptables_begin();
+
 	flush_table("filter");
 	flush_table("mangle");
 	flush_table("nat");
+
+	__connman_iptables_end();
 }
 
 int __connman_firewall_init(void)
@@ -56,6 +56,7 @@
 #include <libnftnl/table.h>
 #include <libnftnl/chain.h>
 #include <libnftnl/rule.h>
+#include <libnftnl/set.h>
 #include <libnftnl/expr.h>
 
 #include <glib.h>
@@ -66,6 +67,20 @@
 #define CONNMAN_CHAIN_NAT_PRE "nat-prerouting"
 #define CONNMAN_CHAIN_NAT_POST "nat-postrouting"
 #define CONNMAN_CHAIN_ROUTE_OUTPUT "route-output"
+#define CONNMAN_SET_UID_MARK "uid-mark"
+#define CONNMAN_SET_SADDR_MARK "saddr-mark"
+
+/* Data types as known to nft, only used when listing the sets */
+#define NFT_TYPE_IPADDR 7
+#define NFT_TYPE_MARK 19
+#define NFT_TYPE_UID 24
+
+/*
+ * Commands are flushed to the kernel before the batch grows beyond
+ * this size. The buffer is twice as large so the message built last
+ * always fits.
+ */
+#define BATCH_LIMIT (32 * 1024)
 
 static bool debug_enabled = true;
 
@@ -74,8 +89,32 @@ struct firewall_handle {
 	const char *chain;
 };
 
+/*
+ * Sessions are marked through two maps, one keyed by the socket owner
+ * and one by the source address, which are looked up by a single rule
+ * each. Enabling marking for a session only adds an element, so the
+ * number of rules does not grow with the number of sessions.
+ */
+struct mark_map {
+	const char *name;
+	uint32_t id;
+	GHashTable *entries;
+};
+
+struct mark_entry {
+	struct mark_map *map;
+	uint32_t key;
+	GSList *contexts;	/* most recent first, its mark is used */
+	bool installed;
+	uint32_t mark;		/* mark of the element in the kernel */
+	bool dirty;
+};
+
 struct firewall_context {
 	struct firewall_handle rule;
+	struct mark_entry *uid;
+	struct mark_entry *saddr;
+	uint32_t mark;
 };
 
 struct nftables_info {
@@ -84,6 +123,19 @@ struct nftables_info {
 
 static struct nftables_info *nft_info;
 
+static struct mark_map uid_map = { CONNMAN_SET_UID_MARK, 1, NULL };
+static struct mark_map saddr_map = { CONNMAN_SET_SADDR_MARK, 2, NULL };
+static GSList *dirty_entries;
+static unsigned int transaction_depth;
+
+struct nft_batch {
+	char *buf;
+	struct mnl_nlmsg_batch *batch;
+	struct nlmsghdr *last;
+	uint32_t seq;
+	unsigned int count;
+};
+
 enum callback_return_type {
         CALLBACK_RETURN_NONE = 0,
         CALLBACK_RETURN_HANDLE,
@@ -423,36 +475,6 @@ static int table_cmd(struct mnl_socket *nl, struct nftnl_table *t,
         return err;
 }
 
-static int chain_cmd(struct mnl_socket *nl, struct nftnl_chain *chain,
-		uint16_t cmd, int family, uint16_t type,
-		enum callback_return_type cb_type, uint64_t *cb_val)
-{
-        char buf[MNL_SOCKET_BUFFER_SIZE];
-        struct mnl_nlmsg_batch *batch;
-        struct nlmsghdr *nlh;
-        uint32_t seq = 0;
-        int err;
-
-        batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
-        nftnl_batch_begin(mnl_nlmsg_batch_current(batch), seq++);
-        mnl_nlmsg_batch_next(batch);
-
-        nlh = nftnl_chain_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch),
-					cmd, family, type, seq++);
-        nftnl_chain_nlmsg_build_payload(nlh, chain);
-	nftnl_chain_free(chain);
-        mnl_nlmsg_batch_next(batch);
-
-        nftnl_batch_end(mnl_nlmsg_batch_current(batch), seq++);
-        mnl_nlmsg_batch_next(batch);
-
-        err = send_and_dispatch(nl, mnl_nlmsg_batch_head(batch),
-			mnl_nlmsg_batch_size(batch), cb_type, cb_val);
-
-        mnl_nlmsg_batch_stop(batch);
-        return err;
-}
-
 static int rule_cmd(struct mnl_socket *nl, struct nftnl_rule *rule,
 			uint16_t cmd, uint16_t family, uint16_t type,
 			enum callback_return_type callback_type,
@@ -489,6 +511,139 @@ static int rule_cmd(struct mnl_socket *nl, struct nftnl_rule *rule,
         return err;
 }
 
+static struct nft_batch *batch_new(void)
+{
+	struct nft_batch *batch;
+
+	batch = g_new0(struct nft_batch, 1);
+	batch->buf = g_malloc(BATCH_LIMIT * 2);
+	batch->batch = mnl_nlmsg_batch_start(batch->buf, BATCH_LIMIT);
+
+	nftnl_batch_begin(mnl_nlmsg_batch_current(batch->batch),
+							batch->seq++);
+	mnl_nlmsg_batch_next(batch->batch);
+
+	return batch;
+}
+
+static bool batch_full(struct nft_batch *batch)
+{
+	return mnl_nlmsg_batch_size(batch->batch) > BATCH_LIMIT / 2;
+}
+
+static void *batch_current(struct nft_batch *batch)
+{
+	return mnl_nlmsg_batch_current(batch->batch);
+}
+
+static void batch_next(struct nft_batch *batch, struct nlmsghdr *nlh)
+{
+	batch->last = nlh;
+	batch->count++;
+
+	mnl_nlmsg_batch_next(batch->batch);
+}
+
+static void batch_add_table(struct nft_batch *batch, struct nftnl_table *t,
+				uint16_t cmd, uint16_t flags)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_table_nlmsg_build_hdr(batch_current(batch), cmd,
+					NFPROTO_IPV4, flags, batch->seq++);
+	nftnl_table_nlmsg_build_payload(nlh, t);
+	batch_next(batch, nlh);
+}
+
+static void batch_add_chain(struct nft_batch *batch, struct nftnl_chain *c,
+				uint16_t cmd, uint16_t flags)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_chain_nlmsg_build_hdr(batch_current(batch), cmd,
+					NFPROTO_IPV4, flags, batch->seq++);
+	nftnl_chain_nlmsg_build_payload(nlh, c);
+	batch_next(batch, nlh);
+}
+
+static void batch_add_rule(struct nft_batch *batch, struct nftnl_rule *r,
+				uint16_t cmd, uint16_t flags)
+{
+	struct nlmsghdr *nlh;
+
+	debug_netlink_dump_rule(r);
+
+	nlh = nftnl_rule_nlmsg_build_hdr(batch_current(batch), cmd,
+					NFPROTO_IPV4, flags, batch->seq++);
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	batch_next(batch, nlh);
+}
+
+static void batch_add_set(struct nft_batch *batch, struct nftnl_set *set,
+				uint16_t cmd, uint16_t flags)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_set_nlmsg_build_hdr(batch_current(batch), cmd,
+					NFPROTO_IPV4, flags, batch->seq++);
+	nftnl_set_nlmsg_build_payload(nlh, set);
+	batch_next(batch, nlh);
+}
+
+static void batch_add_set_elems(struct nft_batch *batch,
+				struct nftnl_set *set,
+				uint16_t cmd, uint16_t flags)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_set_nlmsg_build_hdr(batch_current(batch), cmd,
+					NFPROTO_IPV4, flags, batch->seq++);
+	nftnl_set_elems_nlmsg_build_payload(nlh, set);
+	batch_next(batch, nlh);
+}
+
+/*
+ * Sends all commands of the batch in one transaction and frees the
+ * batch. Either all of them are applied or none.
+ */
+static int batch_commit(struct nft_batch *batch)
+{
+	struct mnl_socket *nl;
+	int err = 0;
+
+	if (batch->count == 0)
+		goto out;
+
+	/*
+	 * Errors are reported for every command anyway, one
+	 * acknowledgment for the last command tells we are done.
+	 */
+	batch->last->nlmsg_flags |= NLM_F_ACK;
+
+	nftnl_batch_end(mnl_nlmsg_batch_current(batch->batch), batch->seq++);
+	mnl_nlmsg_batch_next(batch->batch);
+
+	DBG("batch commands %u size %zu", batch->count,
+				mnl_nlmsg_batch_size(batch->batch));
+
+	err = socket_open_and_bind(&nl);
+	if (err < 0)
+		goto out;
+
+	err = send_and_dispatch(nl, mnl_nlmsg_batch_head(batch->batch),
+				mnl_nlmsg_batch_size(batch->batch),
+				CALLBACK_RETURN_NONE, NULL);
+
+	mnl_socket_close(nl);
+
+out:
+	mnl_nlmsg_batch_stop(batch->batch);
+	g_free(batch->buf);
+	g_free(batch);
+
+	return err;
+}
+
 static int rule_delete(struct firewall_handle *handle)
 {
 	struct nftnl_rule *rule;
@@ -497,6 +652,9 @@ static int rule_delete(struct firewall_handle *handle)
 
 	DBG("");
 
+	if (!handle->chain)
+		return -ENOENT;
+
 	rule = nftnl_rule_alloc();
 	if (!rule)
 		return -ENOMEM;
@@ -534,6 +692,9 @@ void __connman_firewall_destroy(struct firewall_context *ctx)
 {
 	DBG("");
 
+	if (ctx->uid || ctx->saddr)
+		__connman_firewall_disable_marking(ctx);
+
 	g_free(ctx);
 }
 
@@ -740,23 +901,27 @@ int __connman_firewall_disable_snat(struct firewall_context *ctx)
 	return rule_delete(&ctx->rule);
 }
 
-static int build_rule_marking(uid_t uid, uint32_t mark, struct nftnl_rule **res)
+static int build_rule_mark_map(struct mark_map *map, struct nftnl_rule **res)
 {
 	struct nftnl_rule *rule;
 	struct nftnl_expr *expr;
 	int err;
 
 	/*
-	 * http://wiki.nftables.org/wiki-nftables/index.php/Setting_packet_metainformation
-	 * http://wiki.nftables.org/wiki-nftables/index.php/Matching_packet_metainformation
-	 *
 	 * # nft --debug netlink add rule connman route-output	\
-	 *	meta skuid wagi mark set 1234
+	 *	mark set meta skuid map @uid-mark
 	 *
 	 *	ip connman route-output
 	 *	  [ meta load skuid => reg 1 ]
-	 *	  [ cmp eq reg 1 0x000003e8 ]
-	 *	  [ immediate reg 1 0x000004d2 ]
+	 *	  [ lookup reg 1 set uid-mark dreg 1 ]
+	 *	  [ meta set mark with reg 1 ]
+	 *
+	 * # nft --debug netlink add rule connman route-output	\
+	 *	mark set ip saddr map @saddr-mark
+	 *
+	 *	ip connman route-output
+	 *	  [ payload load 4b @ network header + 12 => reg 1 ]
+	 *	  [ lookup reg 1 set saddr-mark dreg 1 ]
 	 *	  [ meta set mark with reg 1 ]
 	 */
 
@@ -767,21 +932,31 @@ static int build_rule_marking(uid_t uid, uint32_t mark, struct nftnl_rule **res)
 	nftnl_rule_set(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
 	nftnl_rule_set(rule, NFTNL_RULE_CHAIN, CONNMAN_CHAIN_ROUTE_OUTPUT);
 
-	expr = nftnl_expr_alloc("meta");
-	if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_SKUID);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
-	nftnl_rule_add_expr(rule, expr);
-	err = add_cmp(rule, NFT_REG_1, NFT_CMP_EQ, &uid, sizeof(uid));
-	if (err < 0)
-		goto err;
+	/* family ipv4 */
+	nftnl_rule_set_u32(rule, NFTNL_RULE_FAMILY, NFPROTO_IPV4);
 
-	expr = nftnl_expr_alloc("immediate");
+	if (map == &uid_map) {
+		expr = nftnl_expr_alloc("meta");
+		if (!expr)
+			goto err;
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_SKUID);
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
+		nftnl_rule_add_expr(rule, expr);
+	} else {
+		err = add_payload(rule, NFT_PAYLOAD_NETWORK_HEADER, NFT_REG_1,
+				offsetof(struct iphdr, saddr),
+				sizeof(struct in_addr));
+		if (err < 0)
+			goto err;
+	}
+
+	expr = nftnl_expr_alloc("lookup");
 	if (!expr)
 		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
-	nftnl_expr_set(expr, NFTNL_EXPR_IMM_DATA, &mark, sizeof(mark));
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_DREG, NFT_REG_1);
+	nftnl_expr_set_str(expr, NFTNL_EXPR_LOOKUP_SET, map->name);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SET_ID, map->id);
 	nftnl_rule_add_expr(rule, expr);
 
 	expr = nftnl_expr_alloc("meta");
@@ -795,67 +970,187 @@ static int build_rule_marking(uid_t uid, uint32_t mark, struct nftnl_rule **res)
 	return 0;
 
 err:
+	nftnl_rule_free(rule);
 	return -ENOMEM;
 }
 
-static int build_rule_src_ip(const char *src_ip, uint32_t mark, struct nftnl_rule **res)
+static struct nftnl_set *build_mark_map(struct mark_map *map,
+						uint32_t key_type)
 {
-	struct nftnl_rule *rule;
-	struct nftnl_expr *expr;
-	int err;
-	in_addr_t s_addr;
+	struct nftnl_set *set;
+
+	set = nftnl_set_alloc();
+	if (!set)
+		return NULL;
+
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, CONNMAN_TABLE);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, map->name);
+	nftnl_set_set_u32(set, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+	nftnl_set_set_u32(set, NFTNL_SET_ID, map->id);
+	nftnl_set_set_u32(set, NFTNL_SET_FLAGS, NFT_SET_MAP);
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_TYPE, key_type);
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_LEN, sizeof(uint32_t));
+	nftnl_set_set_u32(set, NFTNL_SET_DATA_TYPE, NFT_TYPE_MARK);
+	nftnl_set_set_u32(set, NFTNL_SET_DATA_LEN, sizeof(uint32_t));
+
+	return set;
+}
 
-	/*
-	 * # nft --debug netlink add rule connman route-output \
-	 *	ip saddr 192.168.10.31 mark set 1234
-	 *
-	 *	ip connman route-output
-	 *	  [ payload load 4b @ network header + 12 => reg 1 ]
-	 *	  [ cmp eq reg 1 0x1f0aa8c0 ]
-	 *	  [ immediate reg 1 0x000004d2 ]
-	 *	  [ meta set mark with reg 1 ]
-	 */
+static int batch_add_mark(struct nft_batch *batch, struct mark_entry *entry,
+				uint16_t cmd, uint32_t mark)
+{
+	struct nftnl_set_elem *elem;
+	struct nftnl_set *set;
 
-	rule = nftnl_rule_alloc();
-	if (!rule)
+	DBG("%s key %u mark %u %s", entry->map->name, entry->key, mark,
+			cmd == NFT_MSG_NEWSETELEM ? "add" : "delete");
+
+	set = nftnl_set_alloc();
+	if (!set)
 		return -ENOMEM;
 
-	nftnl_rule_set(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
-	nftnl_rule_set(rule, NFTNL_RULE_CHAIN, CONNMAN_CHAIN_ROUTE_OUTPUT);
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, CONNMAN_TABLE);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, entry->map->name);
 
-	/* family ipv4 */
-	nftnl_rule_set_u32(rule, NFTNL_RULE_FAMILY, NFPROTO_IPV4);
+	elem = nftnl_set_elem_alloc();
+	if (!elem) {
+		nftnl_set_free(set);
+		return -ENOMEM;
+	}
 
-	/* source IP */
-	err = add_payload(rule, NFT_PAYLOAD_NETWORK_HEADER, NFT_REG_1,
-			offsetof(struct iphdr, saddr), sizeof(struct in_addr));
-	if (err < 0)
-		goto err;
+	nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, &entry->key,
+						sizeof(entry->key));
+	if (cmd == NFT_MSG_NEWSETELEM)
+		nftnl_set_elem_set(elem, NFTNL_SET_ELEM_DATA, &mark,
+							sizeof(mark));
+	nftnl_set_elem_add(set, elem);
 
-	s_addr = inet_addr(src_ip);
-	err = add_cmp(rule, NFT_REG_1, NFT_CMP_EQ, &s_addr, sizeof(s_addr));
-	if (err < 0)
-		goto err;
+	batch_add_set_elems(batch, set, cmd,
+			cmd == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0);
+	nftnl_set_free(set);
 
-	expr = nftnl_expr_alloc("immediate");
-	if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
-	nftnl_expr_set(expr, NFTNL_EXPR_IMM_DATA, &mark, sizeof(mark));
-	nftnl_rule_add_expr(rule, expr);
+	return 0;
+}
 
-	expr = nftnl_expr_alloc("meta");
-	if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_MARK);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_SREG, NFT_REG_1);
-	nftnl_rule_add_expr(rule, expr);
+static void mark_entry_dirty(struct mark_entry *entry)
+{
+	if (entry->dirty)
+		return;
 
-	*res = rule;
-	return 0;
+	entry->dirty = true;
+	dirty_entries = g_slist_prepend(dirty_entries, entry);
+}
 
-err:
-	return -ENOMEM;
+static struct mark_entry *mark_entry_attach(struct firewall_context *ctx,
+					struct mark_map *map, uint32_t key)
+{
+	struct mark_entry *entry;
+
+	entry = g_hash_table_lookup(map->entries, GUINT_TO_POINTER(key));
+	if (!entry) {
+		entry = g_new0(struct mark_entry, 1);
+		entry->map = map;
+		entry->key = key;
+
+		g_hash_table_replace(map->entries, GUINT_TO_POINTER(key),
+									entry);
+	}
+
+	/* Like appending one more rule, the latest session wins */
+	entry->contexts = g_slist_prepend(entry->contexts, ctx);
+	mark_entry_dirty(entry);
+
+	return entry;
+}
+
+static void mark_entry_detach(struct firewall_context *ctx,
+					struct mark_entry **entry)
+{
+	if (!*entry)
+		return;
+
+	(*entry)->contexts = g_slist_remove((*entry)->contexts, ctx);
+	mark_entry_dirty(*entry);
+
+	*entry = NULL;
+}
+
+static void mark_entry_done(struct mark_entry *entry, bool applied)
+{
+	struct firewall_context *ctx;
+
+	if (applied) {
+		entry->installed = entry->contexts != NULL;
+
+		if (entry->contexts) {
+			ctx = entry->contexts->data;
+			entry->mark = ctx->mark;
+		}
+	}
+
+	if (!entry->contexts && !entry->installed)
+		g_hash_table_remove(entry->map->entries,
+					GUINT_TO_POINTER(entry->key));
+}
+
+/*
+ * Brings the map elements of all modified entries in line with the
+ * sessions using them. Only entries whose effective mark changed
+ * result in a command, so removing and adding the same session again
+ * within a transaction does not touch the kernel at all.
+ */
+static int commit_marks(void)
+{
+	struct firewall_context *ctx;
+	struct mark_entry *entry;
+	struct nft_batch *batch;
+	GSList *list, *done = NULL;
+	int err = 0, ret;
+
+	if (!dirty_entries)
+		return 0;
+
+	batch = batch_new();
+
+	while (dirty_entries) {
+		entry = dirty_entries->data;
+		dirty_entries = g_slist_delete_link(dirty_entries,
+							dirty_entries);
+		entry->dirty = false;
+
+		ctx = entry->contexts ? entry->contexts->data : NULL;
+
+		ret = 0;
+		if (entry->installed && (!ctx || ctx->mark != entry->mark))
+			ret = batch_add_mark(batch, entry,
+						NFT_MSG_DELSETELEM, 0);
+		if (ret == 0 && ctx &&
+				(!entry->installed || ctx->mark != entry->mark))
+			ret = batch_add_mark(batch, entry,
+						NFT_MSG_NEWSETELEM, ctx->mark);
+		if (ret < 0 && err == 0)
+			err = ret;
+
+		done = g_slist_prepend(done, entry);
+
+		if (dirty_entries && !batch_full(batch))
+			continue;
+
+		ret = batch_commit(batch);
+		if (ret < 0 && err == 0)
+			err = ret;
+
+		for (list = done; list; list = list->next)
+			mark_entry_done(list->data, ret == 0);
+
+		g_slist_free(done);
+		done = NULL;
+
+		if (dirty_entries)
+			batch = batch_new();
+	}
+
+	return err;
 }
 
 int __connman_firewall_enable_marking(struct firewall_context *ctx,
@@ -863,14 +1158,15 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					char *id, const char *src_ip,
 					uint32_t mark)
 {
-	struct nftnl_rule *rule;
-	struct mnl_socket *nl;
 	struct passwd *pw;
 	uid_t uid;
 	int err;
 
 	DBG("");
 
+	if (ctx->uid || ctx->saddr)
+		return -EALREADY;
+
 	if (id_type == CONNMAN_SESSION_ID_TYPE_UID) {
 		pw = getpwnam(id);
 		if (!pw)
@@ -880,47 +1176,71 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 	else if (!src_ip)
 		return -ENOTSUP;
 
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return err;
+	ctx->mark = mark;
 
-	if (id_type == CONNMAN_SESSION_ID_TYPE_UID) {
-		err = build_rule_marking(uid, mark, &rule);
-		if (err < 0)
-			goto out;
+	if (id_type == CONNMAN_SESSION_ID_TYPE_UID)
+		ctx->uid = mark_entry_attach(ctx, &uid_map, uid);
 
-		ctx->rule.chain = CONNMAN_CHAIN_ROUTE_OUTPUT;
-		err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-				NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
-				CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
+	if (src_ip)
+		ctx->saddr = mark_entry_attach(ctx, &saddr_map,
+							inet_addr(src_ip));
 
-		nftnl_rule_free(rule);
-	}
+	if (transaction_depth > 0)
+		return 0;
 
-	if (src_ip) {
-		err = build_rule_src_ip(src_ip, mark, &rule);
-		if (err < 0)
-			goto out;
-
-		ctx->rule.chain = CONNMAN_CHAIN_ROUTE_OUTPUT;
-		err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-				NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
-				CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
-
-		nftnl_rule_free(rule);
+	err = commit_marks();
+	if (err < 0) {
+		/* Nothing was applied, forget about this session again */
+		mark_entry_detach(ctx, &ctx->uid);
+		mark_entry_detach(ctx, &ctx->saddr);
+		commit_marks();
 	}
-out:
-	mnl_socket_close(nl);
+
 	return err;
 }
 
 int __connman_firewall_disable_marking(struct firewall_context *ctx)
+{
+	DBG("");
+
+	if (!ctx->uid && !ctx->saddr)
+		return -ENOENT;
+
+	mark_entry_detach(ctx, &ctx->uid);
+	mark_entry_detach(ctx, &ctx->saddr);
+
+	if (transaction_depth > 0)
+		return 0;
+
+	return commit_marks();
+}
+
+void __connman_firewall_begin(void)
+{
+	transaction_depth++;
+
+	DBG("depth %u", transaction_depth);
+}
+
+int __connman_firewall_end(void)
 {
 	int err;
 
-	DBG("");
+	if (transaction_depth == 0)
+		return -EINVAL;
+
+	transaction_depth--;
+
+	DBG("depth %u", transaction_depth);
+
+	if (transaction_depth > 0)
+		return 0;
+
+	err = commit_marks();
+	if (err < 0)
+		connman_warn("Failed to update session marks: %s",
+							strerror(-err));
 
-	err = rule_delete(&ctx->rule);
 	return err;
 }
 
@@ -965,17 +1285,21 @@ static struct nftnl_chain *build_chain(const char *name, const char *table,
 
 static int create_table_and_chains(struct nftables_info *nft_info)
 {
-	struct mnl_socket *nl;
+	struct nft_batch *batch;
 	struct nftnl_table *table;
 	struct nftnl_chain *chain;
+	struct nftnl_set *set;
+	struct nftnl_rule *rule;
 	int err;
 
 
 	DBG("");
 
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return err;
+	/*
+	 * The table, its chains, the mark maps and the rules using
+	 * them are all created in one transaction.
+	 */
+	batch = batch_new();
 
 	/*
 	 * Add table
@@ -991,10 +1315,8 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 		goto out;
 	}
 
-        err = table_cmd(nl, table, NFT_MSG_NEWTABLE, NFPROTO_IPV4,
-			NLM_F_CREATE|NLM_F_ACK);
-        if (err < 0)
-                goto out;
+	batch_add_table(batch, table, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+	nftnl_table_free(table);
 
 	/*
 	 * Add basic chains
@@ -1012,11 +1334,8 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 		goto out;
 	}
 
-	err = chain_cmd(nl, chain, NFT_MSG_NEWCHAIN,
-			NFPROTO_IPV4, NLM_F_CREATE | NLM_F_ACK,
-			CALLBACK_RETURN_NONE, NULL);
-	if (err < 0)
-		goto out;
+	batch_add_chain(batch, chain, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	nftnl_chain_free(chain);
 
 	/*
 	 * # nft add chain connman nat-postrouting		\
@@ -1029,11 +1348,8 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 		goto out;
 	}
 
-	err = chain_cmd(nl, chain, NFT_MSG_NEWCHAIN,
-			NFPROTO_IPV4, NLM_F_CREATE | NLM_F_ACK,
-			CALLBACK_RETURN_NONE, NULL);
-	if (err < 0)
-		goto out;
+	batch_add_chain(batch, chain, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	nftnl_chain_free(chain);
 
 	/*
 	 * # nft add chain connman route-output		\
@@ -1046,17 +1362,67 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 		goto out;
 	}
 
-	err = chain_cmd(nl, chain, NFT_MSG_NEWCHAIN,
-			NFPROTO_IPV4, NLM_F_CREATE | NLM_F_ACK,
-			CALLBACK_RETURN_NONE, NULL);
+	batch_add_chain(batch, chain, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	nftnl_chain_free(chain);
+
+	/*
+	 * Add the session mark maps and their rules
+	 * http://wiki.nftables.org/wiki-nftables/index.php/Maps
+	 */
+
+	/*
+	 * # nft add map connman uid-mark { type uid : mark ; }
+	 */
+	set = build_mark_map(&uid_map, NFT_TYPE_UID);
+	if (!set) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	batch_add_set(batch, set, NFT_MSG_NEWSET, NLM_F_CREATE);
+	nftnl_set_free(set);
+
+	err = build_rule_mark_map(&uid_map, &rule);
+	if (err < 0)
+		goto out;
+
+	batch_add_rule(batch, rule, NFT_MSG_NEWRULE,
+				NLM_F_APPEND | NLM_F_CREATE);
+	nftnl_rule_free(rule);
+
+	/*
+	 * # nft add map connman saddr-mark { type ipv4_addr : mark ; }
+	 */
+	set = build_mark_map(&saddr_map, NFT_TYPE_IPADDR);
+	if (!set) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	batch_add_set(batch, set, NFT_MSG_NEWSET, NLM_F_CREATE);
+	nftnl_set_free(set);
+
+	err = build_rule_mark_map(&saddr_map, &rule);
 	if (err < 0)
 		goto out;
 
+	batch_add_rule(batch, rule, NFT_MSG_NEWRULE,
+				NLM_F_APPEND | NLM_F_CREATE);
+	nftnl_rule_free(rule);
+
+	err = batch_commit(batch);
+	batch = NULL;
+
 out:
+	if (batch) {
+		/* Drop the commands built so far */
+		batch->count = 0;
+		batch_commit(batch);
+	}
+
 	if (err)
 		connman_warn("Failed to create basic chains: %s",
 				strerror(-err));
-	mnl_socket_close(nl);
 	return err;
 }
 
@@ -1096,6 +1462,11 @@ int __connman_firewall_init(void)
 	if (getenv("CONNMAN_NFTABLES_DEBUG"))
 		debug_enabled = true;
 
+	uid_map.entries = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, g_free);
+	saddr_map.entries = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, g_free);
+
 	/*
 	 * EAFNOSUPPORT is return whenever the nf_tables_ipv4 hasn't been
 	 * loaded yet. ENOENT is return in case the table is missing.
@@ -1130,4 +1501,12 @@ void __connman_firewall_cleanup(void)
 
 	g_free(nft_info);
 	nft_info = NULL;
+
+	g_slist_free(dirty_entries);
+	dirty_entries = NULL;
+
+	g_hash_table_destroy(uid_map.entries);
+	uid_map.entries = NULL;
+	g_hash_table_destroy(saddr_map.entries);
+	saddr_map.entries = NULL;
 }
@@ -393,6 +393,8 @@ static void free_ipdevice(gpointer data)
 		ipdevice->config_ipv6 = NULL;
 	}
 
+	__connman_rtnl_remove_stats_index(ipdevice->index);
+
 	free_address_list(ipdevice);
 	g_free(ipdevice->ipv4_gateway);
 	g_free(ipdevice->ipv6_gateway);
@@ -993,6 +995,16 @@ const char *__connman_ipconfig_get_local(struct connman_ipconfig *ipconfig)
 	return ipconfig->address->local;
 }
 
+/*
+ * The owner is told about settings changed by the setters below, they
+ * are called from other modules without it knowing.
+ */
+static void ipconfig_changed(struct connman_ipconfig *ipconfig)
+{
+	if (ipconfig->ops && ipconfig->ops->changed)
+		ipconfig->ops->changed(ipconfig);
+}
+
 void __connman_ipconfig_set_local(struct connman_ipconfig *ipconfig,
 					const char *address)
 {
@@ -1001,6 +1013,8 @@ void __connman_ipconfig_set_local(struct connman_ipconfig *ipconfig,
 
 	g_free(ipconfig->address->local);
 	ipconfig->address->local = g_strdup(address);
+
+	ipconfig_changed(ipconfig);
 }
 
 const char *__connman_ipconfig_get_peer(struct connman_ipconfig *ipconfig)
@@ -1019,6 +1033,8 @@ void __connman_ipconfig_set_peer(struct connman_ipconfig *ipconfig,
 
 	g_free(ipconfig->address->peer);
 	ipconfig->address->peer = g_strdup(address);
+
+	ipconfig_changed(ipconfig);
 }
 
 const char *__connman_ipconfig_get_broadcast(struct connman_ipconfig *ipconfig)
@@ -1037,6 +1053,8 @@ void __connman_ipconfig_set_broadcast(struct connman_ipconfig *ipconfig,
 
 	g_free(ipconfig->address->broadcast);
 	ipconfig->address->broadcast = g_strdup(broadcast);
+
+	ipconfig_changed(ipconfig);
 }
 
 const char *__connman_ipconfig_get_gateway(struct connman_ipconfig *ipconfig)
@@ -1056,6 +1074,8 @@ void __connman_ipconfig_set_gateway(struct connman_ipconfig *ipconfig,
 		return;
 	g_free(ipconfig->address->gateway);
 	ipconfig->address->gateway = g_strdup(gateway);
+
+	ipconfig_changed(ipconfig);
 }
 
 int __connman_ipconfig_gateway_add(struct connman_ipconfig *ipconfig)
@@ -1110,6 +1130,8 @@ void __connman_ipconfig_set_prefixlen(struct connman_ipconfig *ipconfig,
 		return;
 
 	ipconfig->address->prefixlen = prefixlen;
+
+	ipconfig_changed(ipconfig);
 }
 
 static struct connman_ipconfig *create_ipv6config(int index, int original_index)
@@ -1316,6 +1338,8 @@ int __connman_ipconfig_set_method(struct connman_ipconfig *ipconfig,
 {
 	ipconfig->method = method;
 
+	ipconfig_changed(ipconfig);
+
 	return 0;
 }
 
@@ -1609,6 +1633,8 @@ int __connman_ipconfig_enable(struct connman_ipconfig *ipconfig)
 	}
 	ipconfig_list = g_list_append(ipconfig_list, ipconfig);
 
+	__connman_rtnl_add_stats_index(ipdevice->index);
+
 	if (ipdevice->flags & IFF_UP)
 		up = true;
 	else
@@ -1660,7 +1686,7 @@ int __connman_ipconfig_disable(struct connman_ipconfig *ipconfig)
 		connman_ipaddress_clear(ipdevice->config_ipv4->system);
 		__connman_ipconfig_unref(ipdevice->config_ipv4);
 		ipdevice->config_ipv4 = NULL;
-		return 0;
+		goto done;
 	}
 
 	if (ipdevice->config_ipv6 == ipconfig) {
@@ -1669,10 +1695,20 @@ int __connman_ipconfig_disable(struct connman_ipconfig *ipconfig)
 		connman_ipaddress_clear(ipdevice->config_ipv6->system);
 		__connman_ipconfig_unref(ipdevice->config_ipv6);
 		ipdevice->config_ipv6 = NULL;
-		return 0;
+		goto done;
 	}
 
 	return -EINVAL;
+
+done:
+	/*
+	 * Counters are only fed from interfaces with an ipconfig, so
+	 * stop asking the kernel for statistics once the last one is gone.
+	 */
+	if (!ipdevice->config_ipv4 && !ipdevice->config_ipv6)
+		__connman_rtnl_remove_stats_index(ipdevice->index);
+
+	return 0;
 }
 
 const char *__connman_ipconfig_method2string(enum connman_ipconfig_method method)
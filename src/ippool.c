@@ -57,179 +57,318 @@ struct connman_ippool {
 	void *user_data;
 };
 
-GSList *allocated_blocks;
+/*
+ * The /24 blocks of the private address ranges are numbered in the
+ * order they are handed out. The x.x.255.0 blocks and 10.255.0.0/16
+ * are never used.
+ */
+#define BLOCKS_PER_16 255
+
+struct private_range {
+	uint32_t base;
+	unsigned int count;	/* number of /16 networks */
+	unsigned int offset;	/* number of the first block */
+};
+
+static struct private_range private_ranges[3];
+static unsigned int total_blocks;
+
+/*
+ * Segment tree over the block numbers. A node counts the address
+ * ranges covering all of its blocks. Subtrees without any range are
+ * not allocated, so the memory used grows with the number of ranges
+ * and not with the size of the private address space.
+ */
+struct block_node {
+	unsigned int count;
+	bool full;
+	struct block_node *child[2];
+};
+
+static struct block_node *block_tree;
+
+/* start address -> list of address_info */
+static GHashTable *info_table;
 
-static uint32_t last_block;
-static uint32_t block_16_bits;
-static uint32_t block_20_bits;
-static uint32_t block_24_bits;
+static unsigned int last_index;
 static uint32_t subnet_mask_24;
 
-struct connman_ippool *
-__connman_ippool_ref_debug(struct connman_ippool *pool,
-				const char *file, int line, const char *caller)
+static char *get_ip(uint32_t ip)
 {
-	DBG("%p ref %d by %s:%d:%s()", pool, pool->refcount + 1,
-		file, line, caller);
+	struct in_addr addr;
 
-	__sync_fetch_and_add(&pool->refcount, 1);
+	addr.s_addr = htonl(ip);
 
-	return pool;
+	return g_strdup(inet_ntoa(addr));
 }
 
-void __connman_ippool_unref_debug(struct connman_ippool *pool,
-				const char *file, int line, const char *caller)
+static uint32_t block_address(unsigned int index)
 {
-	if (!pool)
-		return;
+	struct private_range *range;
+	unsigned int i;
 
-	DBG("%p ref %d by %s:%d:%s()", pool, pool->refcount - 1,
-		file, line, caller);
+	for (i = 0; i < G_N_ELEMENTS(private_ranges); i++) {
+		range = &private_ranges[i];
 
-	if (__sync_fetch_and_sub(&pool->refcount, 1) != 1)
-		return;
+		if (index >= range->offset + range->count * BLOCKS_PER_16)
+			continue;
 
-	if (pool->info) {
-		allocated_blocks = g_slist_remove(allocated_blocks, pool->info);
-		g_free(pool->info);
+		index -= range->offset;
+
+		return range->base | (index / BLOCKS_PER_16) << 16 |
+					(index % BLOCKS_PER_16) << 8;
 	}
 
-	g_free(pool->gateway);
-	g_free(pool->broadcast);
-	g_free(pool->start_ip);
-	g_free(pool->end_ip);
-	g_free(pool->subnet_mask);
+	return 0;
+}
 
-	g_free(pool);
+/*
+ * Returns the numbers of the first and last block within range whose
+ * network address lies between start and end.
+ */
+static bool block_span(struct private_range *range, uint32_t start,
+			uint32_t end, unsigned int *first, unsigned int *last)
+{
+	uint32_t range_end, b, c;
+
+	range_end = range->base + (range->count << 16) - 1;
+
+	if (end < range->base || start > range_end)
+		return false;
+
+	if (start < range->base)
+		start = range->base;
+	if (end > range_end)
+		end = range_end;
+
+	/* first network address not below start */
+	c = ((start - range->base) + 0xff) >> 8;
+	b = c >> 8;
+	c = c & 0xff;
+	if (c == BLOCKS_PER_16) {
+		b += 1;
+		c = 0;
+	}
+
+	if (b >= range->count)
+		return false;
+
+	*first = range->offset + b * BLOCKS_PER_16 + c;
+
+	/* last network address not above end */
+	c = (end - range->base) >> 8;
+	b = c >> 8;
+	c = c & 0xff;
+	if (c == BLOCKS_PER_16)
+		c -= 1;
+
+	*last = range->offset + b * BLOCKS_PER_16 + c;
+
+	return *first <= *last;
 }
 
-static char *get_ip(uint32_t ip)
+static struct block_node *tree_update(struct block_node *node,
+				unsigned int lo, unsigned int hi,
+				unsigned int first, unsigned int last,
+				int delta)
 {
-	struct in_addr addr;
+	unsigned int mid;
+
+	if (!node)
+		node = g_new0(struct block_node, 1);
+
+	if (first <= lo && hi <= last) {
+		node->count += delta;
+	} else {
+		mid = lo + (hi - lo) / 2;
+
+		if (first <= mid)
+			node->child[0] = tree_update(node->child[0], lo, mid,
+							first, last, delta);
+		if (last > mid)
+			node->child[1] = tree_update(node->child[1], mid + 1,
+							hi, first, last, delta);
+	}
 
-	addr.s_addr = htonl(ip);
+	if (node->count == 0 && !node->child[0] && !node->child[1]) {
+		g_free(node);
+		return NULL;
+	}
 
-	return g_strdup(inet_ntoa(addr));
+	node->full = node->count > 0 ||
+		(node->child[0] && node->child[0]->full &&
+			node->child[1] && node->child[1]->full);
+
+	return node;
 }
 
-static uint32_t next_block(uint32_t block)
+/*
+ * Returns the number of the first block not covered by any range,
+ * starting at from, or -1 if there is none.
+ */
+static int tree_find_free(struct block_node *node, unsigned int lo,
+				unsigned int hi, unsigned int from)
 {
-	uint32_t next;
+	unsigned int mid;
+	int index;
 
-	/*
-	 * Return the next IP block within the private IP range
-	 *
-	 * 16-bit block 192.168.0.0 – 192.168.255.255
-	 * 20-bit block  172.16.0.0 –  172.31.255.255
-	 * 24-bit block    10.0.0.0 –  10.255.255.255
-	 */
+	if (hi < from)
+		return -1;
+
+	if (!node)
+		return lo > from ? lo : from;
+
+	if (node->full)
+		return -1;
+
+	mid = lo + (hi - lo) / 2;
+
+	index = tree_find_free(node->child[0], lo, mid, from);
+	if (index >= 0)
+		return index;
+
+	return tree_find_free(node->child[1], mid + 1, hi, from);
+}
 
-	next = (block & 0x0000ff00) >> 8;
-	next += 1;
-
-	if (next == 255) {
-		if ((block & 0xffff0000) == block_16_bits) {
-			/*
-			 * Reached the end of the 16 bit block, switch
-			 * to the 20-bit block.
-			 */
-			return block_20_bits;
-		}
-
-		if ((block & 0xffff0000) >= block_20_bits) {
-			next = (block & 0x00ff0000) >> 16;
-			if (next >= 16 && next < 32)
-				next += 1;
-
-			if (next == 32) {
-				/*
-				 * Reached the end of the 20 bit
-				 * block, switch to the 24-bit block.
-				 */
-				return block_24_bits;
-			}
-
-			return (block & 0xff000000) |
-				((next << 16) & 0x00ff0000);
-		}
-
-		if ((block & 0xff000000) == block_24_bits) {
-			next = (block & 0x00ff0000) >> 16;
-			if (next < 255)
-				next += 1;
-
-			if (next == 255) {
-				/*
-				 * Reached the end of the 24 bit
-				 * block, switch to the 16-bit block.
-				 */
-				return block_16_bits;
-			}
-
-			return (block & 0xff000000) |
-				((next << 16) & 0x00ff0000);
-		}
+static void tree_free(struct block_node *node)
+{
+	if (!node)
+		return;
+
+	tree_free(node->child[0]);
+	tree_free(node->child[1]);
+	g_free(node);
+}
+
+static void update_blocks(struct address_info *info, int delta)
+{
+	unsigned int i, first, last;
+
+	for (i = 0; i < G_N_ELEMENTS(private_ranges); i++) {
+		if (!block_span(&private_ranges[i], info->start, info->end,
+							&first, &last))
+			continue;
+
+		block_tree = tree_update(block_tree, 0, total_blocks - 1,
+						first, last, delta);
 	}
+}
 
-	return (block & 0xffff0000) | ((next << 8) & 0x0000ff00);
+static void add_info(struct address_info *info)
+{
+	GSList *list;
+
+	list = g_hash_table_lookup(info_table, GUINT_TO_POINTER(info->start));
+	list = g_slist_prepend(list, info);
+	g_hash_table_replace(info_table, GUINT_TO_POINTER(info->start), list);
+
+	update_blocks(info, 1);
 }
 
-static uint32_t get_free_block(unsigned int size)
+static void remove_info(struct address_info *info)
 {
-	struct address_info *info;
-	uint32_t block;
 	GSList *list;
-	bool collision;
+
+	if (!info_table)
+		return;
+
+	list = g_hash_table_lookup(info_table, GUINT_TO_POINTER(info->start));
+	list = g_slist_remove(list, info);
+	if (list)
+		g_hash_table_replace(info_table,
+				GUINT_TO_POINTER(info->start), list);
+	else
+		g_hash_table_remove(info_table,
+				GUINT_TO_POINTER(info->start));
+
+	update_blocks(info, -1);
+}
+
+static int get_free_block(void)
+{
+	int index;
 
 	/*
 	 * Instead starting always from the 16 bit block, we start
-	 * from the last assigned block. This is a simple optimimazion
-	 * for the case where a lot of blocks have been assigned, e.g.
-	 * the first half of the private IP pool is in use and a new
-	 * we need to find a new block.
-	 *
-	 * To only thing we have to make sure is that we terminated if
-	 * there is no block left.
+	 * from the last assigned block and wrap around only when
+	 * nothing is left behind it.
 	 */
-	if (last_block)
-		block = last_block;
-	else
-		block = block_16_bits;
+	index = tree_find_free(block_tree, 0, total_blocks - 1, last_index);
+	if (index < 0 && last_index > 0)
+		index = tree_find_free(block_tree, 0, total_blocks - 1, 0);
 
-	do {
-		collision = false;
-		for (list = allocated_blocks; list; list = list->next) {
-			info = list->data;
+	return index;
+}
 
-			if (info->start <= block && block <= info->end) {
-				collision = true;
-				break;
-			}
-		}
+static struct address_info *lookup_info(int index, uint32_t start)
+{
+	GSList *list;
 
-		if (!collision)
-			return block;
+	list = g_hash_table_lookup(info_table, GUINT_TO_POINTER(start));
+	for (; list; list = list->next) {
+		struct address_info *info = list->data;
 
-		block = next_block(block);
-	} while (block != last_block);
+		if (info->index == index)
+			return info;
+	}
 
-	return 0;
+	return NULL;
 }
 
-static struct address_info *lookup_info(int index, uint32_t start)
+static struct address_info *lookup_pool(uint32_t address)
 {
 	GSList *list;
 
-	for (list = allocated_blocks; list; list = list->next) {
+	list = g_hash_table_lookup(info_table,
+				GUINT_TO_POINTER(address & subnet_mask_24));
+	for (; list; list = list->next) {
 		struct address_info *info = list->data;
 
-		if (info->index == index && info->start == start)
+		if (info->pool && address <= info->end)
 			return info;
 	}
 
 	return NULL;
 }
 
+struct connman_ippool *
+__connman_ippool_ref_debug(struct connman_ippool *pool,
+				const char *file, int line, const char *caller)
+{
+	DBG("%p ref %d by %s:%d:%s()", pool, pool->refcount + 1,
+		file, line, caller);
+
+	__sync_fetch_and_add(&pool->refcount, 1);
+
+	return pool;
+}
+
+void __connman_ippool_unref_debug(struct connman_ippool *pool,
+				const char *file, int line, const char *caller)
+{
+	if (!pool)
+		return;
+
+	DBG("%p ref %d by %s:%d:%s()", pool, pool->refcount - 1,
+		file, line, caller);
+
+	if (__sync_fetch_and_sub(&pool->refcount, 1) != 1)
+		return;
+
+	if (pool->info) {
+		remove_info(pool->info);
+		g_free(pool->info);
+	}
+
+	g_free(pool->gateway);
+	g_free(pool->broadcast);
+	g_free(pool->start_ip);
+	g_free(pool->end_ip);
+	g_free(pool->subnet_mask);
+
+	g_free(pool);
+}
+
 static bool is_private_address(uint32_t address)
 {
 	unsigned int a, b;
@@ -250,7 +389,6 @@ void __connman_ippool_newaddr(int index, const char *address,
 	struct address_info *info, *it;
 	struct in_addr inp;
 	uint32_t start, end, mask;
-	GSList *list;
 
 	if (inet_aton(address, &inp) == 0)
 		return;
@@ -279,7 +417,7 @@ void __connman_ippool_newaddr(int index, const char *address,
 	info->start = start;
 	info->end = end;
 
-	allocated_blocks = g_slist_prepend(allocated_blocks, info);
+	add_info(info);
 
 update:
 	info->use_count = info->use_count + 1;
@@ -292,20 +430,9 @@ update:
 		return;
 	}
 
-	for (list = allocated_blocks; list; list = list->next) {
-		it = list->data;
-
-		if (it == info)
-			continue;
-
-		if (!(info->start >= it->start && info->start <= it->end))
-			continue;
-
-		if (it->pool && it->pool->collision_cb)
-			it->pool->collision_cb(it->pool, it->pool->user_data);
-
-		return;
-	}
+	it = lookup_pool(info->start);
+	if (it && it->pool->collision_cb)
+		it->pool->collision_cb(it->pool, it->pool->user_data);
 }
 
 void __connman_ippool_deladdr(int index, const char *address,
@@ -339,7 +466,7 @@ void __connman_ippool_deladdr(int index, const char *address,
 	if (info->use_count > 0)
 		return;
 
-	allocated_blocks = g_slist_remove(allocated_blocks, info);
+	remove_info(info);
 	g_free(info);
 }
 
@@ -352,6 +479,7 @@ struct connman_ippool *__connman_ippool_create(int index,
 	struct connman_ippool *pool;
 	struct address_info *info;
 	uint32_t block;
+	int block_index;
 
 	DBG("");
 
@@ -364,12 +492,14 @@ struct connman_ippool *__connman_ippool_create(int index,
 		return NULL;
 	}
 
-	block = get_free_block(start + range);
-	if (block == 0) {
+	block_index = get_free_block();
+	if (block_index < 0) {
 		connman_warn("Could not find a free IP block");
 		return NULL;
 	}
 
+	block = block_address(block_index);
+
 	pool = g_try_new0(struct connman_ippool, 1);
 	if (!pool)
 		return NULL;
@@ -380,7 +510,7 @@ struct connman_ippool *__connman_ippool_create(int index,
 		return NULL;
 	}
 
-	last_block = block;
+	last_index = block_index;
 
 	info->index = index;
 	info->start = block;
@@ -402,7 +532,7 @@ struct connman_ippool *__connman_ippool_create(int index,
 	pool->start_ip = get_ip(block + start);
 	pool->end_ip = get_ip(block + start + range);
 
-	allocated_blocks = g_slist_prepend(allocated_blocks, info);
+	add_info(info);
 
 	return pool;
 }
@@ -434,21 +564,50 @@ const char *__connman_ippool_get_subnet_mask(struct connman_ippool *pool)
 
 int __connman_ippool_init(void)
 {
+	unsigned int i;
+
 	DBG("");
 
-	block_16_bits = ntohl(inet_addr("192.168.0.0"));
-	block_20_bits = ntohl(inet_addr("172.16.0.0"));
-	block_24_bits = ntohl(inet_addr("10.0.0.0"));
+	/*
+	 * 16-bit block 192.168.0.0 – 192.168.255.255
+	 * 20-bit block  172.16.0.0 –  172.31.255.255
+	 * 24-bit block    10.0.0.0 –  10.255.255.255
+	 */
+	private_ranges[0].base = ntohl(inet_addr("192.168.0.0"));
+	private_ranges[0].count = 1;
+	private_ranges[1].base = ntohl(inet_addr("172.16.0.0"));
+	private_ranges[1].count = 16;
+	private_ranges[2].base = ntohl(inet_addr("10.0.0.0"));
+	private_ranges[2].count = 255;
+
+	total_blocks = 0;
+	for (i = 0; i < G_N_ELEMENTS(private_ranges); i++) {
+		private_ranges[i].offset = total_blocks;
+		total_blocks += private_ranges[i].count * BLOCKS_PER_16;
+	}
+
 	subnet_mask_24 = ntohl(inet_addr("255.255.255.0"));
 
+	info_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	return 0;
 }
 
+static void free_info_list(gpointer key, gpointer value, gpointer user_data)
+{
+	g_slist_free_full(value, g_free);
+}
+
 void __connman_ippool_cleanup(void)
 {
 	DBG("");
 
-	g_slist_free_full(allocated_blocks, g_free);
-	last_block = 0;
-	allocated_blocks = NULL;
+	g_hash_table_foreach(info_table, free_info_list, NULL);
+	g_hash_table_destroy(info_table);
+	info_table = NULL;
+
+	tree_free(block_tree);
+	block_tree = NULL;
+
+	last_index = 0;
 }
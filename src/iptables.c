@@ -175,10 +175,27 @@ struct connman_iptables {
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 
 	GList *entries;
+
+	/*
+	 * Chain name to struct connman_iptables_chain. The index and the
+	 * entry offsets are rebuilt together in one pass over the entries
+	 * the first time they are needed after the table was modified.
+	 */
+	GHashTable *chains;
+	bool index_valid;
+
+	/* Commit requested while a transaction was open */
+	bool pending;
+};
+
+struct connman_iptables_chain {
+	GList *head;
+	GList *tail;
 };
 
 static GHashTable *table_hash = NULL;
 static bool debug_enabled = false;
+static unsigned int transaction_depth = 0;
 
 typedef int (*iterate_entries_cb_t)(struct ipt_entry *entry, int builtin,
 					unsigned int hook, size_t size,
@@ -330,94 +347,99 @@ static bool is_fallthrough(struct connman_iptables_entry *e)
 	return false;
 }
 
-static bool is_chain(struct connman_iptables *table,
-				struct connman_iptables_entry *e)
+static const char *chain_name(struct connman_iptables_entry *e)
 {
-	struct ipt_entry *entry;
 	struct xt_entry_target *target;
 
-	entry = e->entry;
+	/* Buit-in chain */
 	if (e->builtin >= 0)
-		return true;
+		return hooknames[e->builtin];
 
-	target = ipt_get_target(entry);
+	/* User defined chain */
+	target = ipt_get_target(e->entry);
 	if (!g_strcmp0(target->u.user.name, IPT_ERROR_TARGET))
-		return true;
+		return (const char *)target->data;
 
-	return false;
+	return NULL;
 }
 
-static GList *find_chain_head(struct connman_iptables *table,
-				const char *chain_name)
+static void table_index(struct connman_iptables *table)
 {
-	GList *list;
-	struct connman_iptables_entry *head;
-	struct ipt_entry *entry;
-	struct xt_entry_target *target;
-	int builtin;
+	struct connman_iptables_chain *chain = NULL;
+	struct connman_iptables_entry *e;
+	GList *list, *last = NULL;
+	const char *name;
+	int offset = 0;
+
+	if (table->index_valid)
+		return;
+
+	g_hash_table_remove_all(table->chains);
 
 	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-		entry = head->entry;
+		e = list->data;
+		last = list;
 
-		/* Buit-in chain */
-		builtin = head->builtin;
-		if (builtin >= 0 && !g_strcmp0(hooknames[builtin], chain_name))
-			break;
+		e->offset = offset;
+		offset += e->entry->next_offset;
 
-		/* User defined chain */
-		target = ipt_get_target(entry);
-		if (!g_strcmp0(target->u.user.name, IPT_ERROR_TARGET) &&
-		    !g_strcmp0((char *)target->data, chain_name))
-			break;
-	}
+		name = chain_name(e);
+		if (!name)
+			continue;
 
-	return list;
-}
+		/* A chain ends where the next one starts */
+		if (chain)
+			chain->tail = list;
 
-static GList *find_chain_tail(struct connman_iptables *table,
-				const char *chain_name)
-{
-	struct connman_iptables_entry *tail;
-	GList *chain_head, *list;
+		chain = NULL;
 
-	chain_head = find_chain_head(table, chain_name);
-	if (!chain_head)
-		return NULL;
+		if (g_hash_table_lookup(table->chains, name))
+			continue;
 
-	/* Then we look for the next chain */
-	for (list = chain_head->next; list; list = list->next) {
-		tail = list->data;
+		chain = g_new0(struct connman_iptables_chain, 1);
+		chain->head = list;
 
-		if (is_chain(table, tail))
-			return list;
+		g_hash_table_insert(table->chains, (gpointer) name, chain);
 	}
 
-	/* Nothing found, we return the table end */
-	return g_list_last(table->entries);
+	/* Nothing found, the last chain ends with the table */
+	if (chain)
+		chain->tail = last;
+
+	table->index_valid = true;
 }
 
+static void table_invalidate(struct connman_iptables *table)
+{
+	table->index_valid = false;
+}
 
-static void update_offsets(struct connman_iptables *table)
+static GList *find_chain_head(struct connman_iptables *table,
+				const char *chain_name)
 {
-	GList *list, *prev;
-	struct connman_iptables_entry *entry, *prev_entry;
+	struct connman_iptables_chain *chain;
 
-	for (list = table->entries; list; list = list->next) {
-		entry = list->data;
+	table_index(table);
 
-		if (list == table->entries) {
-			entry->offset = 0;
+	chain = g_hash_table_lookup(table->chains, chain_name);
+	if (!chain)
+		return NULL;
 
-			continue;
-		}
+	return chain->head;
+}
+
+static GList *find_chain_tail(struct connman_iptables *table,
+				const char *chain_name)
+{
+	struct connman_iptables_chain *chain;
 
-		prev = list->prev;
-		prev_entry = prev->data;
+	table_index(table);
 
-		entry->offset = prev_entry->offset +
-					prev_entry->entry->next_offset;
-	}
+	chain = g_hash_table_lookup(table->chains, chain_name);
+	if (!chain)
+		return NULL;
+
+	return chain->tail;
 }
 
 static void update_targets_reference(struct connman_iptables *table,
@@ -478,10 +500,16 @@ static int iptables_add_entry(struct connman_iptables *table,
 	e->builtin = builtin;
 	e->counter_idx = counter_idx;
 
+	/* The references below are fixed up using the current offsets */
+	if (before)
+		table_index(table);
+
 	table->entries = g_list_insert_before(table->entries, before, e);
 	table->num_entries++;
 	table->size += entry->next_offset;
 
+	table_invalidate(table);
+
 	if (!before) {
 		e->offset = table->size - entry->next_offset;
 
@@ -496,8 +524,6 @@ static int iptables_add_entry(struct connman_iptables *table,
 	 */
 	update_targets_reference(table, entry_before, e, false);
 
-	update_offsets(table);
-
 	return 0;
 }
 
@@ -512,6 +538,8 @@ static int remove_table_entry(struct connman_iptables *table,
 
 	table->entries = g_list_remove(table->entries, entry);
 
+	table_invalidate(table);
+
 	g_free(entry->entry);
 	g_free(entry);
 
@@ -581,8 +609,6 @@ static int iptables_flush_chain(struct connman_iptables *table,
 	if (builtin >= 0)
 		delete_update_hooks(table, builtin, chain_tail->prev, removed);
 
-	update_offsets(table);
-
 	return 0;
 }
 
@@ -690,8 +716,6 @@ static int iptables_delete_chain(struct connman_iptables *table,
 	entry = chain_tail->prev->data;
 	remove_table_entry(table, entry);
 
-	update_offsets(table);
-
 	return 0;
 }
 
@@ -1095,7 +1119,6 @@ static int iptables_delete_rule(struct connman_iptables *table,
 	if (builtin >= 0)
 		delete_update_hooks(table, builtin, chain_head, removed);
 
-	update_offsets(table);
 
 	return 0;
 }
@@ -1463,6 +1486,7 @@ static void table_cleanup(struct connman_iptables *table)
 	}
 
 	g_list_free(table->entries);
+	g_hash_table_destroy(table->chains);
 	g_free(table->name);
 	g_free(table->info);
 	g_free(table->blob_entries);
@@ -1493,6 +1517,9 @@ static struct connman_iptables *iptables_init(const char *table_name)
 	if (!table)
 		return NULL;
 
+	table->chains = g_hash_table_new_full(g_str_hash, g_str_equal,
+								NULL, g_free);
+
 	table->info = g_try_new0(struct ipt_getinfo, 1);
 	if (!table->info)
 		goto err;
@@ -2346,9 +2373,8 @@ out:
 	return err;
 }
 
-int __connman_iptables_commit(const char *table_name)
+static int iptables_commit(struct connman_iptables *table)
 {
-	struct connman_iptables *table;
 	struct ipt_replace *repl;
 	int err;
 	struct xt_counters_info *counters;
@@ -2356,11 +2382,7 @@ int __connman_iptables_commit(const char *table_name)
 	GList *list;
 	unsigned int cnt;
 
-	DBG("%s", table_name);
-
-	table = g_hash_table_lookup(table_hash, table_name);
-	if (!table)
-		return -EINVAL;
+	DBG("%s", table->name);
 
 	repl = iptables_blob(table);
 	if (!repl)
@@ -2396,13 +2418,111 @@ int __connman_iptables_commit(const char *table_name)
 	err = 0;
 
 out_hash_remove:
-	g_hash_table_remove(table_hash, table_name);
+	g_hash_table_remove(table_hash, table->name);
 out_free:
 	g_free(repl->counters);
 	g_free(repl);
 	return err;
 }
 
+int __connman_iptables_commit(const char *table_name)
+{
+	struct connman_iptables *table;
+
+	DBG("%s", table_name);
+
+	table = g_hash_table_lookup(table_hash, table_name);
+	if (!table)
+		return -EINVAL;
+
+	/*
+	 * Inside a transaction the table is kept and only replaced
+	 * once when the outermost transaction ends.
+	 */
+	if (transaction_depth > 0) {
+		table->pending = true;
+		return 0;
+	}
+
+	return iptables_commit(table);
+}
+
+void __connman_iptables_begin(void)
+{
+	transaction_depth++;
+
+	DBG("depth %u", transaction_depth);
+}
+
+/*
+ * Like __connman_iptables_end(), the names of the tables that could not
+ * be replaced are added to failed. The cached copy of such a table is
+ * dropped, so it is read back from the kernel when it is used next.
+ */
+int __connman_iptables_end_failed(GSList **failed)
+{
+	struct connman_iptables *table;
+	GHashTableIter iter;
+	GSList *pending = NULL, *list;
+	gpointer value;
+	char *name;
+	int err = 0, ret;
+
+	if (transaction_depth == 0)
+		return -EINVAL;
+
+	transaction_depth--;
+
+	DBG("depth %u", transaction_depth);
+
+	if (transaction_depth > 0)
+		return 0;
+
+	g_hash_table_iter_init(&iter, table_hash);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		table = value;
+
+		if (table->pending)
+			pending = g_slist_prepend(pending, table);
+	}
+
+	for (list = pending; list; list = list->next) {
+		table = list->data;
+
+		table->pending = false;
+
+		/* The table is freed once it has been committed */
+		name = g_strdup(table->name);
+
+		ret = iptables_commit(table);
+		if (ret < 0) {
+			connman_error("Failed to commit table %s: %s",
+					name, strerror(-ret));
+
+			g_hash_table_remove(table_hash, name);
+
+			if (failed)
+				*failed = g_slist_prepend(*failed,
+							g_strdup(name));
+
+			if (err == 0)
+				err = ret;
+		}
+
+		g_free(name);
+	}
+
+	g_slist_free(pending);
+
+	return err;
+}
+
+int __connman_iptables_end(void)
+{
+	return __connman_iptables_end_failed(NULL);
+}
+
 static void remove_table(gpointer user_data)
 {
 	struct connman_iptables *table = user_data;
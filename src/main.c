@@ -24,6 +24,7 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -41,6 +42,9 @@
 
 #define DEFAULT_INPUT_REQUEST_TIMEOUT (120 * 1000)
 #define DEFAULT_BROWSER_LAUNCH_TIMEOUT (300 * 1000)
+#define DEFAULT_DNSPROXY_CACHE_SIZE (64 * 1024)
+#define DEFAULT_STRENGTH_UPDATE_INTERVAL 1
+#define DEFAULT_STRENGTH_HYSTERESIS 3
 
 #define MAINFILE "main.conf"
 #define CONFIGMAINFILE CONFIGDIR "/" MAINFILE
@@ -82,6 +86,9 @@ static struct {
 	bool enable_online_check;
 	bool auto_connect_roaming_services;
 	bool enable_ipv4ll;
+	unsigned int dnsproxy_cache_size;
+	unsigned int strength_update_interval;
+	unsigned int strength_hysteresis;
 } connman_settings  = {
 	.bg_scan = true,
 	.pref_timeservers = NULL,
@@ -102,6 +109,9 @@ static struct {
 	.enable_online_check = true,
 	.auto_connect_roaming_services = false,
 	.enable_ipv4ll = true,
+	.dnsproxy_cache_size = DEFAULT_DNSPROXY_CACHE_SIZE,
+	.strength_update_interval = DEFAULT_STRENGTH_UPDATE_INTERVAL,
+	.strength_hysteresis = DEFAULT_STRENGTH_HYSTERESIS,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -123,6 +133,9 @@ static struct {
 #define CONF_ENABLE_ONLINE_CHECK        "EnableOnlineCheck"
 #define CONF_AUTO_CONNECT_ROAMING_SERVICES "AutoConnectRoamingServices"
 #define CONF_ENABLE_IPV4LL              "EnableIPv4LL"
+#define CONF_DNSPROXY_CACHE_SIZE        "DNSProxyCacheSize"
+#define CONF_STRENGTH_UPDATE_INTERVAL   "StrengthUpdateInterval"
+#define CONF_STRENGTH_HYSTERESIS        "StrengthHysteresis"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -144,6 +157,9 @@ static const char *supported_options[] = {
 	CONF_ENABLE_ONLINE_CHECK,
 	CONF_AUTO_CONNECT_ROAMING_SERVICES,
 	CONF_ENABLE_IPV4LL,
+	CONF_DNSPROXY_CACHE_SIZE,
+	CONF_STRENGTH_UPDATE_INTERVAL,
+	CONF_STRENGTH_HYSTERESIS,
 	NULL
 };
 
@@ -269,6 +285,7 @@ static void parse_config(GKeyFile *config)
         char *vendor_class_id;
 	gsize len;
 	int timeout;
+	int size;
 
 	if (!config) {
 		connman_settings.auto_connect =
@@ -445,6 +462,27 @@ static void parse_config(GKeyFile *config)
 	}
 
 	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_CACHE_SIZE, &error);
+	if (!error && size >= 0 && (unsigned int) size <= UINT_MAX / 1024)
+		connman_settings.dnsproxy_cache_size = size * 1024U;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_STRENGTH_UPDATE_INTERVAL, &error);
+	if (!error && size >= 0)
+		connman_settings.strength_update_interval = size;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_STRENGTH_HYSTERESIS, &error);
+	if (!error && size >= 0 && size <= 100)
+		connman_settings.strength_hysteresis = size;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -699,6 +737,20 @@ unsigned int *connman_setting_get_uint_list(const char *key)
 	return NULL;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, CONF_DNSPROXY_CACHE_SIZE))
+		return connman_settings.dnsproxy_cache_size;
+
+	if (g_str_equal(key, CONF_STRENGTH_UPDATE_INTERVAL))
+		return connman_settings.strength_update_interval;
+
+	if (g_str_equal(key, CONF_STRENGTH_HYSTERESIS))
+		return connman_settings.strength_hysteresis;
+
+	return 0;
+}
+
 unsigned int connman_timeout_input_request(void)
 {
 	return connman_settings.timeout_inputreq;
@@ -866,6 +918,7 @@ int main(int argc, char *argv[])
 	__connman_ipconfig_cleanup();
 	__connman_notifier_cleanup();
 	__connman_technology_cleanup();
+	__connman_storage_cleanup();
 	__connman_inotify_cleanup();
 
 	__connman_util_cleanup();
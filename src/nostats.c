@@ -47,6 +47,15 @@ int __connman_stats_get(struct connman_service *service,
 	return 0;
 }
 
+int __connman_stats_get_range(struct connman_service *service,
+				unsigned int resolution,
+				time_t start, time_t end,
+				struct connman_stats_bucket **buckets,
+				unsigned int *count)
+{
+	return -ENOTSUP;
+}
+
 int __connman_stats_init(void)
 {
 	return 0;
@@ -379,6 +379,11 @@ static void append_properties(DBusMessageIter *iter, struct connman_peer *peer)
 	connman_dbus_dict_close(iter, &dict);
 }
 
+static void append_object_properties(DBusMessageIter *iter, void *user_data)
+{
+	append_properties(iter, user_data);
+}
+
 static void settings_changed(struct connman_peer *peer)
 {
 	if (!allow_property_changed(peer))
@@ -1107,10 +1112,10 @@ int connman_peer_register(struct connman_peer *peer)
 
 	g_hash_table_insert(peers_table, peer->path, peer);
 
-	g_dbus_register_interface(connection, peer->path,
+	g_dbus_register_interface_dict(connection, peer->path,
 					CONNMAN_PEER_INTERFACE,
 					peer_methods, peer_signals,
-					NULL, peer, NULL);
+					append_object_properties, peer, NULL);
 	peer->registered = true;
 	peer_added(peer);
 
@@ -63,6 +63,18 @@ static GSList *update_list = NULL;
 static guint update_interval = G_MAXUINT;
 static guint update_timeout = 0;
 
+/*
+ * Interfaces whose statistics feed the service counters. Only these
+ * are queried when the update interval expires, each one with its own
+ * RTM_GETLINK request instead of a dump of every link in the system.
+ */
+struct stats_data {
+	int index;
+	gint64 updated;
+};
+
+static GHashTable *stats_table = NULL;
+
 struct interface_data {
 	int index;
 	char *ident;
@@ -362,11 +374,25 @@ static const char *operstate2str(unsigned char operstate)
 	return "";
 }
 
+static void stats_updated(int index)
+{
+	struct stats_data *data;
+
+	if (!stats_table)
+		return;
+
+	data = g_hash_table_lookup(stats_table, GINT_TO_POINTER(index));
+	if (data)
+		data->updated = g_get_monotonic_time();
+}
+
 static bool extract_link(struct ifinfomsg *msg, int bytes,
 				struct ether_addr *address, const char **ifname,
 				unsigned int *mtu, unsigned char *operstate,
 				struct rtnl_link_stats *stats)
 {
+	struct rtnl_link_stats64 stats64;
+	bool has_stats64 = false;
 	struct rtattr *attr;
 
 	for (attr = IFLA_RTA(msg); RTA_OK(attr, bytes);
@@ -385,10 +411,33 @@ static bool extract_link(struct ifinfomsg *msg, int bytes,
 				*mtu = *((unsigned int *) RTA_DATA(attr));
 			break;
 		case IFLA_STATS:
-			if (stats)
+			if (stats && !has_stats64)
 				memcpy(stats, RTA_DATA(attr),
 					sizeof(struct rtnl_link_stats));
 			break;
+		case IFLA_STATS64:
+			if (!stats)
+				break;
+
+			memset(&stats64, 0, sizeof(stats64));
+			memcpy(&stats64, RTA_DATA(attr),
+					MIN(RTA_PAYLOAD(attr), sizeof(stats64)));
+			has_stats64 = true;
+
+			/*
+			 * The service counters only accumulate the
+			 * difference between two samples, so truncating
+			 * the 64 bit values keeps the deltas exact.
+			 */
+			stats->rx_packets = stats64.rx_packets;
+			stats->tx_packets = stats64.tx_packets;
+			stats->rx_bytes = stats64.rx_bytes;
+			stats->tx_bytes = stats64.tx_bytes;
+			stats->rx_errors = stats64.rx_errors;
+			stats->tx_errors = stats64.tx_errors;
+			stats->rx_dropped = stats64.rx_dropped;
+			stats->tx_dropped = stats64.tx_dropped;
+			break;
 		case IFLA_OPERSTATE:
 			if (operstate)
 				*operstate = *((unsigned char *) RTA_DATA(attr));
@@ -419,6 +468,8 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	if (!extract_link(msg, bytes, &address, &ifname, &mtu, &operstate, &stats))
 		return;
 
+	stats_updated(index);
+
 	snprintf(ident, 13, "%02x%02x%02x%02x%02x%02x",
 						address.ether_addr_octet[0],
 						address.ether_addr_octet[1],
@@ -1305,12 +1356,18 @@ static guint channel_watch = 0;
 
 struct rtnl_request {
 	struct nlmsghdr hdr;
-	struct rtgenmsg msg;
+	union {
+		struct rtgenmsg gen;
+		struct ifinfomsg ifi;
+	} msg;
 };
 #define RTNL_REQUEST_SIZE  (sizeof(struct nlmsghdr) + sizeof(struct rtgenmsg))
+#define RTNL_LINK_REQUEST_SIZE  (sizeof(struct nlmsghdr) + \
+					sizeof(struct ifinfomsg))
 
 static GSList *request_list = NULL;
 static guint32 request_seq = 0;
+static guint32 request_pid = 0;
 
 static struct rtnl_request *find_request(guint32 seq)
 {
@@ -1374,6 +1431,24 @@ static int process_response(guint32 seq)
 	return send_request(req);
 }
 
+/*
+ * Requests for a single link are not terminated by NLMSG_DONE, their
+ * reply (or the error returned instead) completes them.
+ */
+static void process_reply(struct nlmsghdr *hdr)
+{
+	struct rtnl_request *req;
+
+	if (hdr->nlmsg_pid != request_pid)
+		return;
+
+	req = g_slist_nth_data(request_list, 0);
+	if (!req || req->hdr.nlmsg_seq != hdr->nlmsg_seq)
+		return;
+
+	process_response(hdr->nlmsg_seq);
+}
+
 static void rtnl_message(void *buf, size_t len)
 {
 	while (len > 0) {
@@ -1400,9 +1475,12 @@ static void rtnl_message(void *buf, size_t len)
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			process_reply(hdr);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
+			if (!(hdr->nlmsg_flags & NLM_F_MULTI))
+				process_reply(hdr);
 			break;
 		case RTM_DELLINK:
 			rtnl_dellink(hdr);
@@ -1473,7 +1551,7 @@ static int send_getlink(void)
 
 	DBG("");
 
-	req = g_try_malloc0(RTNL_REQUEST_SIZE);
+	req = g_try_new0(struct rtnl_request, 1);
 	if (!req)
 		return -ENOMEM;
 
@@ -1482,7 +1560,7 @@ static int send_getlink(void)
 	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 	req->hdr.nlmsg_pid = 0;
 	req->hdr.nlmsg_seq = request_seq++;
-	req->msg.rtgen_family = AF_INET;
+	req->msg.gen.rtgen_family = AF_INET;
 
 	return queue_request(req);
 }
@@ -1493,7 +1571,7 @@ static int send_getaddr(void)
 
 	DBG("");
 
-	req = g_try_malloc0(RTNL_REQUEST_SIZE);
+	req = g_try_new0(struct rtnl_request, 1);
 	if (!req)
 		return -ENOMEM;
 
@@ -1502,7 +1580,7 @@ static int send_getaddr(void)
 	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 	req->hdr.nlmsg_pid = 0;
 	req->hdr.nlmsg_seq = request_seq++;
-	req->msg.rtgen_family = AF_INET;
+	req->msg.gen.rtgen_family = AF_INET;
 
 	return queue_request(req);
 }
@@ -1513,7 +1591,7 @@ static int send_getroute(void)
 
 	DBG("");
 
-	req = g_try_malloc0(RTNL_REQUEST_SIZE);
+	req = g_try_new0(struct rtnl_request, 1);
 	if (!req)
 		return -ENOMEM;
 
@@ -1522,14 +1600,75 @@ static int send_getroute(void)
 	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 	req->hdr.nlmsg_pid = 0;
 	req->hdr.nlmsg_seq = request_seq++;
-	req->msg.rtgen_family = AF_INET;
+	req->msg.gen.rtgen_family = AF_INET;
 
 	return queue_request(req);
 }
 
+static int send_getlink_index(int index)
+{
+	struct rtnl_request *req;
+	GSList *list;
+
+	for (list = request_list; list; list = list->next) {
+		req = list->data;
+
+		if (req->hdr.nlmsg_type != RTM_GETLINK)
+			continue;
+
+		/* A pending dump already covers this link */
+		if (req->hdr.nlmsg_flags & NLM_F_DUMP)
+			return -EALREADY;
+
+		if (req->msg.ifi.ifi_index == index)
+			return -EALREADY;
+	}
+
+	DBG("index %d", index);
+
+	req = g_try_new0(struct rtnl_request, 1);
+	if (!req)
+		return -ENOMEM;
+
+	req->hdr.nlmsg_len = RTNL_LINK_REQUEST_SIZE;
+	req->hdr.nlmsg_type = RTM_GETLINK;
+	req->hdr.nlmsg_flags = NLM_F_REQUEST;
+	req->hdr.nlmsg_pid = 0;
+	req->hdr.nlmsg_seq = request_seq++;
+	req->msg.ifi.ifi_family = AF_UNSPEC;
+	req->msg.ifi.ifi_index = index;
+
+	return queue_request(req);
+}
+
+static void request_stats(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+	gint64 now, age;
+
+	now = g_get_monotonic_time();
+	age = (gint64) update_interval * G_USEC_PER_SEC / 2;
+
+	g_hash_table_iter_init(&iter, stats_table);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct stats_data *data = value;
+
+		/*
+		 * Link events carry the statistics as well, no need to
+		 * ask again when one arrived recently.
+		 */
+		if (data->updated > 0 && now - data->updated < age)
+			continue;
+
+		send_getlink_index(data->index);
+	}
+}
+
 static gboolean update_timeout_cb(gpointer user_data)
 {
-	__connman_rtnl_request_update();
+	request_stats();
 
 	return TRUE;
 }
@@ -1599,9 +1738,40 @@ int __connman_rtnl_request_update(void)
 	return send_getlink();
 }
 
+void __connman_rtnl_add_stats_index(int index)
+{
+	struct stats_data *data;
+
+	if (index < 0 || !stats_table)
+		return;
+
+	if (g_hash_table_lookup(stats_table, GINT_TO_POINTER(index)))
+		return;
+
+	DBG("index %d", index);
+
+	data = g_try_new0(struct stats_data, 1);
+	if (!data)
+		return;
+
+	data->index = index;
+
+	g_hash_table_insert(stats_table, GINT_TO_POINTER(index), data);
+}
+
+void __connman_rtnl_remove_stats_index(int index)
+{
+	if (!stats_table)
+		return;
+
+	if (g_hash_table_remove(stats_table, GINT_TO_POINTER(index)))
+		DBG("index %d", index);
+}
+
 int __connman_rtnl_init(void)
 {
 	struct sockaddr_nl addr;
+	socklen_t addr_len;
 	int sk;
 
 	DBG("");
@@ -1609,6 +1779,9 @@ int __connman_rtnl_init(void)
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
 
+	stats_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, g_free);
+
 	sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
 	if (sk < 0)
 		return -1;
@@ -1624,6 +1797,10 @@ int __connman_rtnl_init(void)
 		return -1;
 	}
 
+	addr_len = sizeof(addr);
+	if (getsockname(sk, (struct sockaddr *) &addr, &addr_len) == 0)
+		request_pid = addr.nl_pid;
+
 	channel = g_io_channel_unix_new(sk);
 	g_io_channel_set_close_on_unref(channel, TRUE);
 
@@ -1693,4 +1870,7 @@ void __connman_rtnl_cleanup(void)
 	channel = NULL;
 
 	g_hash_table_destroy(interface_list);
+
+	g_hash_table_destroy(stats_table);
+	stats_table = NULL;
 }
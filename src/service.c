@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <gdbus.h>
@@ -43,11 +44,57 @@ static DBusConnection *connection = NULL;
 
 static GList *service_list = NULL;
 static GHashTable *service_hash = NULL;
+static GHashTable *service_path_hash = NULL;
 static GSList *counter_list = NULL;
 static unsigned int autoconnect_id = 0;
 static unsigned int vpn_autoconnect_id = 0;
 static struct connman_service *current_default = NULL;
 static bool services_dirty = false;
+static GHashTable *services_reorder = NULL;
+static guint services_reorder_id = 0;
+static GHashTable *services_property = NULL;
+static guint services_property_id = 0;
+static guint services_property_timer = 0;
+
+/*
+ * Properties which may change very often. Their changes are collected
+ * and signaled once per main loop iteration, and not more often than
+ * their interval allows.
+ */
+enum service_property {
+	SERVICE_PROPERTY_NAME = 0,
+	SERVICE_PROPERTY_STRENGTH,
+	SERVICE_PROPERTY_ROAMING,
+	SERVICE_PROPERTY_MAX,
+};
+
+struct service_property_notify {
+	unsigned int pending;
+	gint64 sent[SERVICE_PROPERTY_MAX];
+	uint8_t strength;	/* last signaled strength */
+};
+
+/* Minimum time between two signals of a property in milliseconds */
+static unsigned int property_interval[SERVICE_PROPERTY_MAX];
+
+/* Strength changes smaller than this are not signaled */
+static unsigned int strength_hysteresis;
+
+/*
+ * Nested properties which are costly to build. They are kept serialized
+ * per service and only rebuilt after their data has changed. Code that
+ * changes such data without signaling it has to invalidate the section.
+ */
+enum service_section {
+	SERVICE_SECTION_IPV4 = 0,
+	SERVICE_SECTION_IPV4_CONFIG,
+	SERVICE_SECTION_IPV6,
+	SERVICE_SECTION_IPV6_CONFIG,
+	SERVICE_SECTION_NAMESERVERS,
+	SERVICE_SECTION_NAMESERVERS_CONFIG,
+	SERVICE_SECTION_PROXY_CONFIG,
+	SERVICE_SECTION_MAX,
+};
 
 struct connman_stats {
 	bool valid;
@@ -134,6 +181,8 @@ struct connman_service {
 	bool hidden_service;
 	char *config_file;
 	char *config_entry;
+	struct service_property_notify property_notify;
+	DBusMessage *sections[SERVICE_SECTION_MAX];
 };
 
 static bool allow_property_changed(struct connman_service *service);
@@ -144,32 +193,32 @@ static struct connman_ipconfig *create_ip6config(struct connman_service *service
 		int index, int original_index);
 static void dns_changed(struct connman_service *service);
 
-struct find_data {
-	const char *path;
-	struct connman_service *service;
-};
-
-static void compare_path(gpointer value, gpointer user_data)
+static void section_invalidate(struct connman_service *service,
+					enum service_section section)
 {
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
-
-	if (data->service)
+	if (!service->sections[section])
 		return;
 
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
+	dbus_message_unref(service->sections[section]);
+	service->sections[section] = NULL;
 }
 
-static struct connman_service *find_service(const char *path)
+static void sections_invalidate(struct connman_service *service)
 {
-	struct find_data data = { .path = path, .service = NULL };
+	enum service_section section;
 
+	for (section = 0; section < SERVICE_SECTION_MAX; section++)
+		section_invalidate(service, section);
+}
+
+static struct connman_service *find_service(const char *path)
+{
 	DBG("path %s", path);
 
-	g_list_foreach(service_list, compare_path, &data);
+	if (!path)
+		return NULL;
 
-	return data.service;
+	return g_hash_table_lookup(service_path_hash, path);
 }
 
 static const char *reason2string(enum connman_service_connect_reason reason)
@@ -809,6 +858,16 @@ done:
 	return err;
 }
 
+/*
+ * Settings changed on request of the user are written to disk right
+ * away instead of being batched with other changes.
+ */
+static void service_save_sync(struct connman_service *service)
+{
+	service_save(service);
+	__connman_storage_sync();
+}
+
 void __connman_service_save(struct connman_service *service)
 {
 	if (!service)
@@ -974,6 +1033,8 @@ static int nameservers_changed_cb(void *user_data)
 
 static void nameservers_changed(struct connman_service *service)
 {
+	section_invalidate(service, SERVICE_SECTION_NAMESERVERS);
+
 	if (!service->nameservers_timeout)
 		service->nameservers_timeout = g_idle_add(nameservers_changed_cb,
 							service);
@@ -1256,6 +1317,8 @@ set_servers:
 	g_strfreev(nameservers);
 	nameservers = servers;
 
+	section_invalidate(service, SERVICE_SECTION_NAMESERVERS);
+
 	if (is_auto) {
 		service->nameservers_auto = nameservers;
 	} else {
@@ -1274,6 +1337,8 @@ void __connman_service_nameserver_clear(struct connman_service *service)
 	g_strfreev(service->nameservers);
 	service->nameservers = NULL;
 
+	section_invalidate(service, SERVICE_SECTION_NAMESERVERS);
+
 	nameserver_add_all(service, CONNMAN_IPCONFIG_TYPE_ALL);
 }
 
@@ -1548,6 +1613,9 @@ static void state_changed(struct connman_service *service)
 
 	__connman_notifier_service_state_changed(service, service->state);
 
+	/* Addresses and name servers are only shown while connected */
+	sections_invalidate(service);
+
 	str = state2string(service->state);
 	if (!str)
 		return;
@@ -1560,17 +1628,124 @@ static void state_changed(struct connman_service *service)
 						DBUS_TYPE_STRING, &str);
 }
 
+static void property_emit(struct connman_service *service,
+				enum service_property property)
+{
+	dbus_bool_t roaming;
+
+	switch (property) {
+	case SERVICE_PROPERTY_NAME:
+		connman_dbus_property_changed_basic(service->path,
+					CONNMAN_SERVICE_INTERFACE, "Name",
+					DBUS_TYPE_STRING, &service->name);
+		break;
+	case SERVICE_PROPERTY_STRENGTH:
+		service->property_notify.strength = service->strength;
+		connman_dbus_property_changed_basic(service->path,
+				CONNMAN_SERVICE_INTERFACE, "Strength",
+					DBUS_TYPE_BYTE, &service->strength);
+		break;
+	case SERVICE_PROPERTY_ROAMING:
+		roaming = service->roaming;
+		connman_dbus_property_changed_basic(service->path,
+				CONNMAN_SERVICE_INTERFACE, "Roaming",
+					DBUS_TYPE_BOOLEAN, &roaming);
+		break;
+	case SERVICE_PROPERTY_MAX:
+		break;
+	}
+}
+
+static gboolean property_flush(gpointer user_data)
+{
+	struct service_property_notify *notify;
+	struct connman_service *service;
+	GHashTableIter iter;
+	gpointer key;
+	gint64 now, delay, next = 0;
+	unsigned int i;
+
+	if (user_data)
+		services_property_timer = 0;
+	else
+		services_property_id = 0;
+
+	now = g_get_monotonic_time();
+
+	g_hash_table_iter_init(&iter, services_property);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		service = key;
+		notify = &service->property_notify;
+
+		for (i = 0; i < SERVICE_PROPERTY_MAX; i++) {
+			if (!(notify->pending & (1 << i)))
+				continue;
+
+			delay = notify->sent[i] +
+				property_interval[i] * 1000 - now;
+			if (notify->sent[i] && delay > 0) {
+				if (next == 0 || delay < next)
+					next = delay;
+				continue;
+			}
+
+			notify->pending &= ~(1 << i);
+			notify->sent[i] = now;
+
+			if (allow_property_changed(service))
+				property_emit(service, i);
+		}
+
+		if (!notify->pending)
+			g_hash_table_iter_remove(&iter);
+	}
+
+	if (next > 0) {
+		if (services_property_timer)
+			g_source_remove(services_property_timer);
+
+		services_property_timer = g_timeout_add((next + 999) / 1000,
+						property_flush, GINT_TO_POINTER(1));
+	}
+
+	return FALSE;
+}
+
+static void property_changed(struct connman_service *service,
+				enum service_property property)
+{
+	if (!allow_property_changed(service))
+		return;
+
+	service->property_notify.pending |= 1 << property;
+	g_hash_table_replace(services_property, service, service);
+
+	if (!services_property_id)
+		services_property_id = g_idle_add(property_flush, NULL);
+}
+
+static void property_cancel(struct connman_service *service)
+{
+	service->property_notify.pending = 0;
+	g_hash_table_remove(services_property, service);
+}
+
 static void strength_changed(struct connman_service *service)
 {
+	struct service_property_notify *notify = &service->property_notify;
+
 	if (service->strength == 0)
 		return;
 
-	if (!allow_property_changed(service))
+	/* Small changes around the last signaled value are not sent */
+	if (notify->strength &&
+			abs(service->strength - notify->strength) <
+						(int) strength_hysteresis) {
+		notify->pending &= ~(1 << SERVICE_PROPERTY_STRENGTH);
 		return;
+	}
 
-	connman_dbus_property_changed_basic(service->path,
-				CONNMAN_SERVICE_INTERFACE, "Strength",
-					DBUS_TYPE_BYTE, &service->strength);
+	property_changed(service, SERVICE_PROPERTY_STRENGTH);
 }
 
 static void favorite_changed(struct connman_service *service)
@@ -1607,18 +1782,10 @@ static void immutable_changed(struct connman_service *service)
 
 static void roaming_changed(struct connman_service *service)
 {
-	dbus_bool_t roaming;
-
 	if (!service->path)
 		return;
 
-	if (!allow_property_changed(service))
-		return;
-
-	roaming = service->roaming;
-	connman_dbus_property_changed_basic(service->path,
-				CONNMAN_SERVICE_INTERFACE, "Roaming",
-					DBUS_TYPE_BOOLEAN, &roaming);
+	property_changed(service, SERVICE_PROPERTY_ROAMING);
 }
 
 static void autoconnect_changed(struct connman_service *service)
@@ -1987,6 +2154,104 @@ static void append_provider(DBusMessageIter *iter, void *user_data)
 		__connman_provider_append_properties(service->provider, iter);
 }
 
+static const struct {
+	const char *name;
+	int type;	/* array element type, or DBUS_TYPE_INVALID for dicts */
+	connman_dbus_append_cb_t function;
+} service_sections[SERVICE_SECTION_MAX] = {
+	[SERVICE_SECTION_IPV4] = {
+		"IPv4", DBUS_TYPE_INVALID, append_ipv4 },
+	[SERVICE_SECTION_IPV4_CONFIG] = {
+		"IPv4.Configuration", DBUS_TYPE_INVALID, append_ipv4config },
+	[SERVICE_SECTION_IPV6] = {
+		"IPv6", DBUS_TYPE_INVALID, append_ipv6 },
+	[SERVICE_SECTION_IPV6_CONFIG] = {
+		"IPv6.Configuration", DBUS_TYPE_INVALID, append_ipv6config },
+	[SERVICE_SECTION_NAMESERVERS] = {
+		"Nameservers", DBUS_TYPE_STRING, append_dns },
+	[SERVICE_SECTION_NAMESERVERS_CONFIG] = {
+		"Nameservers.Configuration", DBUS_TYPE_STRING,
+							append_dnsconfig },
+	[SERVICE_SECTION_PROXY_CONFIG] = {
+		"Proxy.Configuration", DBUS_TYPE_INVALID, append_proxyconfig },
+};
+
+/*
+ * Returns the section as a message holding its name and variant value,
+ * building it first if its data has changed since the last use.
+ */
+static DBusMessage *section_get(struct connman_service *service,
+					enum service_section section)
+{
+	const char *name = service_sections[section].name;
+	int type = service_sections[section].type;
+	connman_dbus_append_cb_t function = service_sections[section].function;
+	DBusMessageIter iter;
+	DBusMessage *msg;
+
+	if (service->sections[section])
+		return service->sections[section];
+
+	msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!msg)
+		return NULL;
+
+	dbus_message_iter_init_append(msg, &iter);
+
+	if (type == DBUS_TYPE_INVALID)
+		connman_dbus_property_append_dict(&iter, name, function,
+								service);
+	else
+		connman_dbus_property_append_array(&iter, name, type,
+							function, service);
+
+	service->sections[section] = msg;
+
+	return msg;
+}
+
+static void section_append(DBusMessageIter *dict,
+				struct connman_service *service,
+				enum service_section section)
+{
+	DBusMessageIter entry;
+	DBusMessage *msg;
+
+	msg = section_get(service, section);
+	if (!msg)
+		return;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+	__connman_dbus_append_message(&entry, msg);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static void section_changed(struct connman_service *service,
+					enum service_section section)
+{
+	DBusMessage *signal, *msg;
+	DBusMessageIter iter;
+
+	section_invalidate(service, section);
+
+	if (!allow_property_changed(service))
+		return;
+
+	msg = section_get(service, section);
+	if (!msg)
+		return;
+
+	signal = dbus_message_new_signal(service->path,
+				CONNMAN_SERVICE_INTERFACE, "PropertyChanged");
+	if (!signal)
+		return;
+
+	dbus_message_iter_init_append(signal, &iter);
+	__connman_dbus_append_message(&iter, msg);
+
+	g_dbus_send_message(connection, signal);
+}
 
 static void settings_changed(struct connman_service *service,
 				struct connman_ipconfig *ipconfig)
@@ -1997,29 +2262,18 @@ static void settings_changed(struct connman_service *service,
 
 	__connman_notifier_ipconfig_changed(service, ipconfig);
 
-	if (!allow_property_changed(service))
-		return;
-
 	if (type == CONNMAN_IPCONFIG_TYPE_IPV4)
-		connman_dbus_property_changed_dict(service->path,
-					CONNMAN_SERVICE_INTERFACE, "IPv4",
-					append_ipv4, service);
+		section_changed(service, SERVICE_SECTION_IPV4);
 	else if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
-		connman_dbus_property_changed_dict(service->path,
-					CONNMAN_SERVICE_INTERFACE, "IPv6",
-					append_ipv6, service);
+		section_changed(service, SERVICE_SECTION_IPV6);
 }
 
 static void ipv4_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	/* The method is part of the IPv4 settings as well */
+	section_invalidate(service, SERVICE_SECTION_IPV4);
 
-	connman_dbus_property_changed_dict(service->path,
-					CONNMAN_SERVICE_INTERFACE,
-							"IPv4.Configuration",
-							append_ipv4config,
-							service);
+	section_changed(service, SERVICE_SECTION_IPV4_CONFIG);
 }
 
 void __connman_service_notify_ipv4_configuration(
@@ -2033,35 +2287,19 @@ void __connman_service_notify_ipv4_configuration(
 
 static void ipv6_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	section_invalidate(service, SERVICE_SECTION_IPV6);
 
-	connman_dbus_property_changed_dict(service->path,
-					CONNMAN_SERVICE_INTERFACE,
-							"IPv6.Configuration",
-							append_ipv6config,
-							service);
+	section_changed(service, SERVICE_SECTION_IPV6_CONFIG);
 }
 
 static void dns_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
-
-	connman_dbus_property_changed_array(service->path,
-				CONNMAN_SERVICE_INTERFACE, "Nameservers",
-					DBUS_TYPE_STRING, append_dns, service);
+	section_changed(service, SERVICE_SECTION_NAMESERVERS);
 }
 
 static void dns_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
-
-	connman_dbus_property_changed_array(service->path,
-				CONNMAN_SERVICE_INTERFACE,
-				"Nameservers.Configuration",
-				DBUS_TYPE_STRING, append_dnsconfig, service);
+	section_changed(service, SERVICE_SECTION_NAMESERVERS_CONFIG);
 
 	dns_changed(service);
 }
@@ -2099,12 +2337,7 @@ static void proxy_changed(struct connman_service *service)
 
 static void proxy_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
-
-	connman_dbus_property_changed_dict(service->path,
-			CONNMAN_SERVICE_INTERFACE, "Proxy.Configuration",
-						append_proxyconfig, service);
+	section_changed(service, SERVICE_SECTION_PROXY_CONFIG);
 
 	proxy_changed(service);
 }
@@ -2497,21 +2730,12 @@ static void append_properties(DBusMessageIter *dict, dbus_bool_t limited,
 		break;
 	}
 
-	connman_dbus_dict_append_dict(dict, "IPv4", append_ipv4, service);
-
-	connman_dbus_dict_append_dict(dict, "IPv4.Configuration",
-						append_ipv4config, service);
-
-	connman_dbus_dict_append_dict(dict, "IPv6", append_ipv6, service);
-
-	connman_dbus_dict_append_dict(dict, "IPv6.Configuration",
-						append_ipv6config, service);
-
-	connman_dbus_dict_append_array(dict, "Nameservers",
-				DBUS_TYPE_STRING, append_dns, service);
-
-	connman_dbus_dict_append_array(dict, "Nameservers.Configuration",
-				DBUS_TYPE_STRING, append_dnsconfig, service);
+	section_append(dict, service, SERVICE_SECTION_IPV4);
+	section_append(dict, service, SERVICE_SECTION_IPV4_CONFIG);
+	section_append(dict, service, SERVICE_SECTION_IPV6);
+	section_append(dict, service, SERVICE_SECTION_IPV6_CONFIG);
+	section_append(dict, service, SERVICE_SECTION_NAMESERVERS);
+	section_append(dict, service, SERVICE_SECTION_NAMESERVERS_CONFIG);
 
 	if (service->state == CONNMAN_SERVICE_STATE_READY ||
 			service->state == CONNMAN_SERVICE_STATE_ONLINE)
@@ -2535,8 +2759,7 @@ static void append_properties(DBusMessageIter *dict, dbus_bool_t limited,
 
 	connman_dbus_dict_append_dict(dict, "Proxy", append_proxy, service);
 
-	connman_dbus_dict_append_dict(dict, "Proxy.Configuration",
-						append_proxyconfig, service);
+	section_append(dict, service, SERVICE_SECTION_PROXY_CONFIG);
 
 	val = service->mdns;
 	connman_dbus_dict_append_basic(dict, "mDNS", DBUS_TYPE_BOOLEAN,
@@ -2576,6 +2799,16 @@ static void append_dict_properties(DBusMessageIter *dict, void *user_data)
 	append_properties(dict, TRUE, service);
 }
 
+static void append_object_properties(DBusMessageIter *iter, void *user_data)
+{
+	struct connman_service *service = user_data;
+	DBusMessageIter dict;
+
+	connman_dbus_dict_open(iter, &dict);
+	append_properties(&dict, FALSE, service);
+	connman_dbus_dict_close(iter, &dict);
+}
+
 static void append_struct(gpointer value, gpointer user_data)
 {
 	struct connman_service *service = value;
@@ -2940,6 +3173,8 @@ void __connman_service_set_pac(struct connman_service *service,
 	g_free(service->pac);
 	service->pac = g_strdup(pac);
 
+	section_invalidate(service, SERVICE_SECTION_PROXY_CONFIG);
+
 	proxy_changed(service);
 }
 
@@ -3404,6 +3639,8 @@ int __connman_service_reset_ipconfig(struct connman_service *service,
 	else if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
 		service->ipconfig_ipv6 = new_ipconfig;
 
+	sections_invalidate(service);
+
 	if (is_connecting(state) || is_connected(state))
 		__connman_ipconfig_enable(new_ipconfig);
 
@@ -3486,7 +3723,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 		if (autoconnect)
 			__connman_service_auto_connect(CONNMAN_SERVICE_CONNECT_REASON_AUTO);
 
-		service_save(service);
+		service_save_sync(service);
 	} else if (g_str_equal(name, "Nameservers.Configuration")) {
 		DBusMessageIter entry;
 		GString *str;
@@ -3562,7 +3799,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 						CONNMAN_IPCONFIG_TYPE_IPV6))
 			__connman_service_wispr_start(service, CONNMAN_IPCONFIG_TYPE_IPV6);
 
-		service_save(service);
+		service_save_sync(service);
 	} else if (g_str_equal(name, "Timeservers.Configuration")) {
 		DBusMessageIter entry;
 		GString *str;
@@ -3604,7 +3841,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 
 		g_string_free(str, TRUE);
 
-		service_save(service);
+		service_save_sync(service);
 		timeservers_configuration_changed(service);
 
 		if (service == __connman_service_get_default())
@@ -3656,7 +3893,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 		domain_configuration_changed(service);
 		domain_changed(service);
 
-		service_save(service);
+		service_save_sync(service);
 	} else if (g_str_equal(name, "Proxy.Configuration")) {
 		int err;
 
@@ -3675,7 +3912,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 
 		__connman_notifier_proxy_changed(service);
 
-		service_save(service);
+		service_save_sync(service);
 	} else if (g_str_equal(name, "mDNS.Configuration")) {
 		dbus_bool_t val;
 
@@ -3692,7 +3929,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 
 		set_mdns(service, service->mdns_config);
 
-		service_save(service);
+		service_save_sync(service);
 	} else if (g_str_equal(name, "IPv4.Configuration") ||
 			g_str_equal(name, "IPv6.Configuration")) {
 
@@ -3748,7 +3985,7 @@ static DBusMessage *set_property(DBusConnection *conn,
 								service->ipconfig_ipv6);
 		}
 
-		service_save(service);
+		service_save_sync(service);
 	} else
 		return __connman_error_invalid_property(msg);
 
@@ -3813,7 +4050,7 @@ static void service_complete(struct connman_service *service)
 		__connman_service_auto_connect(service->connect_reason);
 
 	g_get_current_time(&service->modified);
-	service_save(service);
+	service_save_sync(service);
 }
 
 static DBusMessage *clear_property(DBusConnection *conn,
@@ -4594,6 +4831,7 @@ static DBusMessage *move_service(DBusConnection *conn,
 	g_get_current_time(&service->modified);
 	service_save(service);
 	service_save(target);
+	__connman_storage_sync();
 
 	/*
 	 * If the service which goes down is the default service and is
@@ -4633,6 +4871,143 @@ static DBusMessage *reset_counters(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static void append_stats_total(DBusMessageIter *iter, void *user_data)
+{
+	struct connman_stats_total *total = user_data;
+
+	connman_dbus_dict_append_basic(iter, "RX.Packets",
+					DBUS_TYPE_UINT32, &total->rx_packets);
+	connman_dbus_dict_append_basic(iter, "TX.Packets",
+					DBUS_TYPE_UINT32, &total->tx_packets);
+	connman_dbus_dict_append_basic(iter, "RX.Bytes",
+					DBUS_TYPE_UINT64, &total->rx_bytes);
+	connman_dbus_dict_append_basic(iter, "TX.Bytes",
+					DBUS_TYPE_UINT64, &total->tx_bytes);
+	connman_dbus_dict_append_basic(iter, "RX.Errors",
+					DBUS_TYPE_UINT32, &total->rx_errors);
+	connman_dbus_dict_append_basic(iter, "TX.Errors",
+					DBUS_TYPE_UINT32, &total->tx_errors);
+	connman_dbus_dict_append_basic(iter, "RX.Dropped",
+					DBUS_TYPE_UINT32, &total->rx_dropped);
+	connman_dbus_dict_append_basic(iter, "TX.Dropped",
+					DBUS_TYPE_UINT32, &total->tx_dropped);
+	connman_dbus_dict_append_basic(iter, "Time",
+					DBUS_TYPE_UINT32, &total->time);
+}
+
+static void stats_total_add(struct connman_stats_total *total,
+				struct connman_stats_total *add)
+{
+	total->rx_bytes += add->rx_bytes;
+	total->tx_bytes += add->tx_bytes;
+	total->rx_packets += add->rx_packets;
+	total->tx_packets += add->tx_packets;
+	total->rx_errors += add->rx_errors;
+	total->tx_errors += add->tx_errors;
+	total->rx_dropped += add->rx_dropped;
+	total->tx_dropped += add->tx_dropped;
+	total->time += add->time;
+}
+
+static unsigned int string2resolution(const char *resolution)
+{
+	if (g_strcmp0(resolution, "minute") == 0)
+		return 60;
+	else if (g_strcmp0(resolution, "hour") == 0)
+		return 60 * 60;
+	else if (g_strcmp0(resolution, "day") == 0)
+		return 24 * 60 * 60;
+
+	return 0;
+}
+
+static DBusMessage *get_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct connman_service *service = user_data;
+	struct connman_stats_bucket *buckets = NULL;
+	struct connman_stats_total home, roaming;
+	DBusMessageIter iter, dict, array;
+	const char *str;
+	dbus_uint64_t start, end, time_max;
+	unsigned int resolution, count, i;
+	DBusMessage *reply;
+	int err;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &str,
+					DBUS_TYPE_UINT64, &start,
+					DBUS_TYPE_UINT64, &end,
+					DBUS_TYPE_INVALID))
+		return __connman_error_invalid_arguments(msg);
+
+	resolution = string2resolution(str);
+	if (resolution == 0 || start > end)
+		return __connman_error_invalid_arguments(msg);
+
+	/* Times beyond what time_t holds are in the far future anyway */
+	time_max = ((dbus_uint64_t) 1 << (sizeof(time_t) * 8 - 1)) - 1;
+	if (start > time_max)
+		start = time_max;
+	if (end > time_max)
+		end = time_max;
+
+	err = __connman_stats_get_range(service, resolution, start, end,
+							&buckets, &count);
+	if (err == -EINVAL)
+		return __connman_error_invalid_arguments(msg);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply) {
+		g_free(buckets);
+		return NULL;
+	}
+
+	memset(&home, 0, sizeof(home));
+	memset(&roaming, 0, sizeof(roaming));
+
+	for (i = 0; i < count; i++) {
+		stats_total_add(&home, &buckets[i].home);
+		stats_total_add(&roaming, &buckets[i].roaming);
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	connman_dbus_dict_open(&iter, &dict);
+	connman_dbus_dict_append_dict(&dict, "Home",
+					append_stats_total, &home);
+	connman_dbus_dict_append_dict(&dict, "Roaming",
+					append_stats_total, &roaming);
+	connman_dbus_dict_close(&iter, &dict);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	for (i = 0; i < count; i++) {
+		dbus_uint64_t bucket_start = buckets[i].start;
+
+		connman_dbus_dict_open(&array, &dict);
+		connman_dbus_dict_append_basic(&dict, "Start",
+					DBUS_TYPE_UINT64, &bucket_start);
+		connman_dbus_dict_append_dict(&dict, "Home",
+					append_stats_total, &buckets[i].home);
+		connman_dbus_dict_append_dict(&dict, "Roaming",
+					append_stats_total,
+					&buckets[i].roaming);
+		connman_dbus_dict_close(&array, &dict);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	g_free(buckets);
+
+	return reply;
+}
+
 static struct _services_notify {
 	int id;
 	GHashTable *add;
@@ -4777,6 +5152,12 @@ static const GDBusMethodTable service_methods[] = {
 			GDBUS_ARGS({ "service", "o" }), NULL,
 			move_after) },
 	{ GDBUS_METHOD("ResetCounters", NULL, NULL, reset_counters) },
+	{ GDBUS_METHOD("GetStatistics",
+			GDBUS_ARGS({ "resolution", "s" }, { "start", "t" },
+					{ "end", "t" }),
+			GDBUS_ARGS({ "totals", "a{sv}" },
+					{ "buckets", "aa{sv}" }),
+			get_statistics) },
 	{ },
 };
 
@@ -4809,6 +5190,8 @@ static void service_free(gpointer user_data)
 	service->path = NULL;
 
 	if (path) {
+		g_hash_table_remove(service_path_hash, path);
+
 		__connman_connection_update_gateway();
 
 		g_dbus_unregister_interface(connection, path,
@@ -4841,6 +5224,8 @@ static void service_free(gpointer user_data)
 		service->ipconfig_ipv6 = NULL;
 	}
 
+	sections_invalidate(service);
+
 	g_strfreev(service->timeservers);
 	g_strfreev(service->timeservers_config);
 	g_strfreev(service->nameservers);
@@ -5009,6 +5394,8 @@ void connman_service_unref_debug(struct connman_service *service,
 		return;
 
 	service_list = g_list_remove(service_list, service);
+	g_hash_table_remove(services_reorder, service);
+	property_cancel(service);
 
 	__connman_service_disconnect(service);
 
@@ -5117,14 +5504,113 @@ static gint service_compare(gconstpointer a, gconstpointer b)
 	return g_strcmp0(service_a->name, service_b->name);
 }
 
+/*
+ * Up to this many changed services are moved to their new position
+ * one by one, more changes are handled by sorting the whole list.
+ */
+#define SERVICE_REORDER_MAX 8
+
+static void service_list_reorder_cancel(void)
+{
+	if (services_reorder_id) {
+		g_source_remove(services_reorder_id);
+		services_reorder_id = 0;
+	}
+
+	g_hash_table_remove_all(services_reorder);
+}
+
 static void service_list_sort(void)
 {
+	service_list_reorder_cancel();
+
 	if (service_list && service_list->next) {
 		service_list = g_list_sort(service_list, service_compare);
 		service_schedule_changed();
 	}
 }
 
+static bool service_in_order(GList *link)
+{
+	if (link->prev && service_compare(link->prev->data, link->data) > 0)
+		return false;
+
+	if (link->next && service_compare(link->data, link->next->data) > 0)
+		return false;
+
+	return true;
+}
+
+static gboolean service_list_reorder_run(gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer key;
+	GSList *moved = NULL, *list;
+	bool in_order = true;
+
+	services_reorder_id = 0;
+
+	if (g_hash_table_size(services_reorder) > SERVICE_REORDER_MAX) {
+		service_list_sort();
+		return FALSE;
+	}
+
+	g_hash_table_iter_init(&iter, services_reorder);
+	while (in_order && g_hash_table_iter_next(&iter, &key, NULL)) {
+		GList *link = g_list_find(service_list, key);
+
+		if (link && !service_in_order(link))
+			in_order = false;
+	}
+
+	if (in_order) {
+		g_hash_table_remove_all(services_reorder);
+		return FALSE;
+	}
+
+	/*
+	 * Take out all changed services, the remaining list is still
+	 * sorted so the services can be put back at their new position.
+	 */
+	g_hash_table_iter_init(&iter, services_reorder);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		GList *link = g_list_find(service_list, key);
+
+		if (!link)
+			continue;
+
+		service_list = g_list_delete_link(service_list, link);
+		moved = g_slist_prepend(moved, key);
+	}
+
+	g_hash_table_remove_all(services_reorder);
+
+	for (list = moved; list; list = list->next)
+		service_list = g_list_insert_sorted(service_list, list->data,
+							service_compare);
+
+	g_slist_free(moved);
+
+	service_schedule_changed();
+
+	return FALSE;
+}
+
+/*
+ * Changes that only affect the position of a single service, such as
+ * signal strength updates during a scan, are collected and the
+ * services are moved to their new position once per main loop
+ * iteration instead of sorting the whole list for every change.
+ */
+static void service_list_reorder(struct connman_service *service)
+{
+	g_hash_table_replace(services_reorder, service, service);
+
+	if (!services_reorder_id)
+		services_reorder_id = g_idle_add(service_list_reorder_run,
+									NULL);
+}
+
 int __connman_service_compare(const struct connman_service *a,
 					const struct connman_service *b)
 {
@@ -6193,6 +6679,8 @@ int __connman_service_ipconfig_indicate_state(struct connman_service *service,
 	else
 		service->state_ipv6 = new_state;
 
+	sections_invalidate(service);
+
 	if (!is_connected(old_state) && is_connected(new_state))
 		nameserver_add_all(service, type);
 
@@ -6646,6 +7134,9 @@ void __connman_service_set_config(struct connman_service *service,
 
 	g_free(service->config_entry);
 	service->config_entry = g_strdup(entry);
+
+	/* Provisioning sets up the IP configuration behind our back */
+	sections_invalidate(service);
 }
 
 /**
@@ -6692,13 +7183,17 @@ static int service_register(struct connman_service *service)
 
 	DBG("path %s", service->path);
 
+	g_hash_table_insert(service_path_hash, service->path, service);
+
 	if (__connman_config_provision_service(service) < 0)
 		service_load(service);
 
-	g_dbus_register_interface(connection, service->path,
+	sections_invalidate(service);
+
+	g_dbus_register_interface_dict(connection, service->path,
 					CONNMAN_SERVICE_INTERFACE,
 					service_methods, service_signals,
-							NULL, service, NULL);
+					append_object_properties, service, NULL);
 
 	service_list_sort();
 
@@ -6812,6 +7307,20 @@ static void service_route_changed(struct connman_ipconfig *ipconfig,
 	settings_changed(service, ipconfig);
 }
 
+static void service_ipconfig_changed(struct connman_ipconfig *ipconfig)
+{
+	struct connman_service *service = __connman_ipconfig_get_data(ipconfig);
+
+	if (!service)
+		return;
+
+	/* The IPv6 settings are shown depending on IPv4 as well */
+	section_invalidate(service, SERVICE_SECTION_IPV4);
+	section_invalidate(service, SERVICE_SECTION_IPV4_CONFIG);
+	section_invalidate(service, SERVICE_SECTION_IPV6);
+	section_invalidate(service, SERVICE_SECTION_IPV6_CONFIG);
+}
+
 static const struct connman_ipconfig_ops service_ops = {
 	.up		= service_up,
 	.down		= service_down,
@@ -6821,6 +7330,7 @@ static const struct connman_ipconfig_ops service_ops = {
 	.ip_release	= service_ip_release,
 	.route_set	= service_route_changed,
 	.route_unset	= service_route_changed,
+	.changed	= service_ipconfig_changed,
 };
 
 static struct connman_ipconfig *create_ip4config(struct connman_service *service,
@@ -6887,6 +7397,7 @@ void connman_service_create_ip4config(struct connman_service *service,
 	service->ipconfig_ipv4 = create_ip4config(service, index, original_index,
 			CONNMAN_IPCONFIG_METHOD_DHCP);
 	__connman_service_read_ip4config(service);
+	sections_invalidate(service);
 }
 
 void __connman_service_read_ip6config(struct connman_service *service)
@@ -6917,6 +7428,7 @@ void connman_service_create_ip6config(struct connman_service *service,
 	service->ipconfig_ipv6 = create_ip6config(service, index, original_index);
 
 	__connman_service_read_ip6config(service);
+	sections_invalidate(service);
 }
 
 /**
@@ -7154,7 +7666,7 @@ static void update_from_network(struct connman_service *service,
 	if (!service->network)
 		service->network = connman_network_ref(network);
 
-	service_list_sort();
+	service_list_reorder(service);
 }
 
 /**
@@ -7312,10 +7824,7 @@ void __connman_service_update_from_network(struct connman_network *network)
 		g_free(service->name);
 		service->name = g_strdup(name);
 
-		if (allow_property_changed(service))
-			connman_dbus_property_changed_basic(service->path,
-					CONNMAN_SERVICE_INTERFACE, "Name",
-					DBUS_TYPE_STRING, &service->name);
+		property_changed(service, SERVICE_PROPERTY_NAME);
 	}
 
 	if (service->type == CONNMAN_SERVICE_TYPE_WIFI)
@@ -7349,7 +7858,7 @@ roaming:
 
 sorting:
 	if (need_sort) {
-		service_list_sort();
+		service_list_reorder(service);
 	}
 }
 
@@ -7446,13 +7955,11 @@ static void remove_unprovisioned_services(void)
 	if (!services)
 		return;
 
+	keyfile = connman_storage_get_service_index();
+
 	for (; services[i]; i++) {
 		file = section = NULL;
-		keyfile = configkeyfile = NULL;
-
-		keyfile = connman_storage_load_service(services[i]);
-		if (!keyfile)
-			continue;
+		configkeyfile = NULL;
 
 		file = g_key_file_get_string(keyfile, services[i],
 					"Config.file", NULL);
@@ -7482,9 +7989,6 @@ static void remove_unprovisioned_services(void)
 			__connman_storage_remove_service(services[i]);
 
 	next:
-		if (keyfile)
-			g_key_file_free(keyfile);
-
 		if (configkeyfile)
 			g_key_file_free(configkeyfile);
 
@@ -7548,6 +8052,13 @@ int __connman_service_init(void)
 
 	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, service_free);
+	service_path_hash = g_hash_table_new(g_str_hash, g_str_equal);
+	services_reorder = g_hash_table_new(g_direct_hash, g_direct_equal);
+	services_property = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	property_interval[SERVICE_PROPERTY_STRENGTH] =
+		connman_setting_get_uint("StrengthUpdateInterval") * 1000;
+	strength_hysteresis = connman_setting_get_uint("StrengthHysteresis");
 
 	services_notify = g_new0(struct _services_notify, 1);
 	services_notify->remove = g_hash_table_new_full(g_str_hash,
@@ -7581,6 +8092,26 @@ void __connman_service_cleanup(void)
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
 
+	g_hash_table_destroy(service_path_hash);
+	service_path_hash = NULL;
+
+	service_list_reorder_cancel();
+	g_hash_table_destroy(services_reorder);
+	services_reorder = NULL;
+
+	if (services_property_id) {
+		g_source_remove(services_property_id);
+		services_property_id = 0;
+	}
+
+	if (services_property_timer) {
+		g_source_remove(services_property_timer);
+		services_property_timer = 0;
+	}
+
+	g_hash_table_destroy(services_property);
+	services_property = NULL;
+
 	g_slist_free(counter_list);
 	counter_list = NULL;
 
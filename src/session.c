@@ -35,6 +35,8 @@
 static DBusConnection *connection;
 static GHashTable *session_hash;
 static GHashTable *service_hash;
+static GHashTable *bearer_hash;
+static GHashTable *service_type_hash;
 static struct connman_session *ecall_session;
 static uint32_t session_mark = 256;
 
@@ -70,6 +72,7 @@ struct connman_session {
 	unsigned char prefixlen;
 	bool policy_routing;
 	bool snat_enabled;
+	bool indexed;
 };
 
 struct connman_service_info {
@@ -87,11 +90,24 @@ struct fw_snat {
 
 GSList *fw_snat_list;
 
+/* Debug counters for matching sessions against services */
+static struct {
+	unsigned long events;
+	unsigned long candidates;
+	unsigned long matches;
+	unsigned long unindexed;
+} match_stats;
+
 static struct connman_session_policy *policy;
 static void session_activate(struct connman_session *session);
 static void session_deactivate(struct connman_session *session);
 static void update_session_state(struct connman_session *session);
 
+static void free_list(gpointer data)
+{
+	g_slist_free(data);
+}
+
 static void cleanup_service(gpointer data)
 {
 	struct connman_service_info *info = data;
@@ -507,6 +523,108 @@ static void destroy_policy_config(struct connman_session *session)
 	policy->destroy(session);
 }
 
+/*
+ * Sessions are indexed by every bearer they allow combined with the
+ * interface they are bound to, or "*" if any interface is fine. A
+ * service can then only be used by the sessions found under its own
+ * type with its interface or with "*".
+ */
+static char *bearer_key(enum connman_service_type type, const char *ifname)
+{
+	if (!ifname)
+		ifname = "*";
+
+	return g_strdup_printf("%d:%s", type, ifname);
+}
+
+static void session_index_add(struct connman_session *session)
+{
+	struct session_info *info = session->info;
+	GSList *list, *sessions;
+	char *key;
+
+	if (session->indexed)
+		return;
+
+	for (list = info->config.allowed_bearers; list; list = list->next) {
+		key = bearer_key(GPOINTER_TO_INT(list->data),
+					info->config.allowed_interface);
+
+		sessions = g_hash_table_lookup(bearer_hash, key);
+		sessions = g_slist_prepend(sessions, session);
+		g_hash_table_replace(bearer_hash, key, sessions);
+	}
+
+	session->indexed = true;
+}
+
+static void session_index_remove(struct connman_session *session)
+{
+	struct session_info *info = session->info;
+	GSList *list, *sessions;
+	char *key;
+
+	if (!session->indexed)
+		return;
+
+	for (list = info->config.allowed_bearers; list; list = list->next) {
+		key = bearer_key(GPOINTER_TO_INT(list->data),
+					info->config.allowed_interface);
+
+		sessions = g_hash_table_lookup(bearer_hash, key);
+		sessions = g_slist_remove(sessions, session);
+		if (sessions)
+			g_hash_table_replace(bearer_hash, key, sessions);
+		else {
+			g_hash_table_remove(bearer_hash, key);
+			g_free(key);
+		}
+	}
+
+	session->indexed = false;
+}
+
+/*
+ * Returns the sessions which may use the service. If the policy
+ * decides on its own which services are allowed, all sessions are
+ * returned.
+ */
+static GSList *session_index_lookup(struct connman_service *service)
+{
+	enum connman_service_type type;
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *list = NULL;
+	char *ifname, *bearer;
+
+	if (policy && policy->allowed) {
+		match_stats.unindexed++;
+
+		g_hash_table_iter_init(&iter, session_hash);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			list = g_slist_prepend(list, value);
+
+		return list;
+	}
+
+	type = connman_service_get_type(service);
+
+	bearer = bearer_key(type, NULL);
+	list = g_slist_copy(g_hash_table_lookup(bearer_hash, bearer));
+	g_free(bearer);
+
+	ifname = connman_service_get_interface(service);
+	if (ifname) {
+		bearer = bearer_key(type, ifname);
+		list = g_slist_concat(list, g_slist_copy(
+				g_hash_table_lookup(bearer_hash, bearer)));
+		g_free(bearer);
+		g_free(ifname);
+	}
+
+	return list;
+}
+
 static void free_session(struct connman_session *session)
 {
 	if (!session)
@@ -556,6 +674,8 @@ static void cleanup_session(gpointer user_data)
 	session_deactivate(session);
 	update_session_state(session);
 
+	session_index_remove(session);
+
 	g_slist_free(session->user_allowed_bearers);
 	g_free(session->user_allowed_interface);
 
@@ -1084,6 +1204,7 @@ int connman_session_config_update(struct connman_session *session)
 
 	session->active = false;
 	session_deactivate(session);
+	session_index_remove(session);
 
 	g_slist_free(info->config.allowed_bearers);
 	info->config.allowed_bearers = allowed_bearers;
@@ -1091,6 +1212,7 @@ int connman_session_config_update(struct connman_session *session)
 	g_free(info->config.allowed_interface);
 	info->config.allowed_interface = allowed_interface;
 
+	session_index_add(session);
 	session_activate(session);
 
 	info->config.type = apply_policy_on_type(
@@ -1200,6 +1322,7 @@ static DBusMessage *change_session(DBusConnection *conn,
 			session->active = false;
 			session_deactivate(session);
 			update_session_state(session);
+			session_index_remove(session);
 
 			g_slist_free(info->config.allowed_bearers);
 			session->user_allowed_bearers = allowed_bearers;
@@ -1209,6 +1332,7 @@ static DBusMessage *change_session(DBusConnection *conn,
 					session->user_allowed_bearers,
 					&info->config.allowed_bearers);
 
+			session_index_add(session);
 			session_activate(session);
 		} else {
 			goto err;
@@ -1228,6 +1352,7 @@ static DBusMessage *change_session(DBusConnection *conn,
 			session->active = false;
 			session_deactivate(session);
 			update_session_state(session);
+			session_index_remove(session);
 
 			g_free(session->user_allowed_interface);
 			/* empty string means allow any interface */
@@ -1240,6 +1365,7 @@ static DBusMessage *change_session(DBusConnection *conn,
 				session->policy_config->allowed_interface,
 				session->user_allowed_interface);
 
+			session_index_add(session);
 			session_activate(session);
 		} else {
 			goto err;
@@ -1428,6 +1554,7 @@ static int session_policy_config_cb(struct connman_session *session,
 
 	cleanup_creation_data(creation_data);
 
+	session_index_add(session);
 	session_activate(session);
 
 	return 0;
@@ -1789,10 +1916,31 @@ static bool is_session_connected(struct connman_session *session,
 	return false;
 }
 
+static bool session_activate_service(struct connman_session *session,
+					struct connman_service_info *info)
+{
+	enum connman_service_state state;
+
+	state = __connman_service_get_state(info->service);
+
+	if (!is_session_connected(session, state) ||
+			!session_match_service(session, info->service))
+		return false;
+
+	DBG("session %p add service %p", session, info->service);
+
+	info->sessions = g_slist_prepend(info->sessions, session);
+	session->service = info->service;
+	update_session_state(session);
+
+	return true;
+}
+
 static void session_activate(struct connman_session *session)
 {
 	GHashTableIter iter;
 	gpointer key, value;
+	GSList *bearers, *list;
 
 	if (!service_hash)
 		return;
@@ -1831,23 +1979,26 @@ static void session_activate(struct connman_session *session)
 		return;
 	}
 
-	g_hash_table_iter_init(&iter, service_hash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		struct connman_service_info *info = value;
-		enum connman_service_state state;
-
-		state = __connman_service_get_state(info->service);
-
-		if (is_session_connected(session, state) &&
-				session_match_service(session, info->service)) {
-			DBG("session %p add service %p", session, info->service);
-
-			info->sessions = g_slist_prepend(info->sessions,
-							session);
-			session->service = info->service;
-			update_session_state(session);
-
-			return;
+	/*
+	 * Only the services of the allowed bearers can match, unless
+	 * the policy decides about it.
+	 */
+	if (policy && policy->allowed) {
+		g_hash_table_iter_init(&iter, service_hash);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			if (session_activate_service(session, value))
+				return;
+		}
+	} else {
+		for (bearers = session->info->config.allowed_bearers;
+					bearers; bearers = bearers->next) {
+			list = g_hash_table_lookup(service_type_hash,
+							bearers->data);
+			for (; list; list = list->next) {
+				if (session_activate_service(session,
+								list->data))
+					return;
+			}
 		}
 	}
 
@@ -1878,33 +2029,62 @@ static void handle_service_state_online(struct connman_service *service,
 					enum connman_service_state state,
 					struct connman_service_info *info)
 {
-	GHashTableIter iter;
-	gpointer key, value;
+	GSList *sessions, *list;
+	unsigned int candidates = 0, matches = 0;
 
-	g_hash_table_iter_init(&iter, session_hash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		struct connman_session *session = value;
-		bool connected;
+	/* Apply the firewall changes of all sessions at once */
+	__connman_firewall_begin();
 
-		connected = is_session_connected(session, state);
+	/* The sessions using the service might not match it anymore */
+	sessions = g_slist_copy(info->sessions);
+	for (list = sessions; list; list = list->next) {
+		struct connman_session *session = list->data;
 
-		if (session->service == service) {
-			if (!connected) {
-				DBG("session %p remove service %p", session, service);
-				info->sessions = g_slist_remove(info->sessions,
-							session);
-				session->service = NULL;
-				update_session_state(session);
-			}
-		} else if (connected && session_match_service(session, service)) {
-			DBG("session %p add service %p", session, service);
+		if (session->service != service ||
+				is_session_connected(session, state))
+			continue;
 
-			info->sessions = g_slist_prepend(info->sessions,
-							session);
-			session->service = service;
-			update_session_state(session);
-		}
+		DBG("session %p remove service %p", session, service);
+		info->sessions = g_slist_remove(info->sessions, session);
+		session->service = NULL;
+		update_session_state(session);
+	}
+	g_slist_free(sessions);
+
+	sessions = session_index_lookup(service);
+	for (list = sessions; list; list = list->next) {
+		struct connman_session *session = list->data;
+
+		if (session->service == service)
+			continue;
+
+		candidates++;
+
+		if (!is_session_connected(session, state) ||
+				!session_match_service(session, service))
+			continue;
+
+		DBG("session %p add service %p", session, service);
+
+		info->sessions = g_slist_prepend(info->sessions, session);
+		session->service = service;
+		update_session_state(session);
+
+		matches++;
 	}
+	g_slist_free(sessions);
+
+	__connman_firewall_end();
+
+	match_stats.events++;
+	match_stats.candidates += candidates;
+	match_stats.matches += matches;
+
+	DBG("service %p checked %u of %u sessions, %u matched "
+		"(total events %lu checked %lu matched %lu unindexed %lu)",
+		service, candidates, g_hash_table_size(session_hash), matches,
+		match_stats.events, match_stats.candidates,
+		match_stats.matches, match_stats.unindexed);
 }
 
 static void handle_service_state_offline(struct connman_service *service,
@@ -1912,6 +2092,8 @@ static void handle_service_state_offline(struct connman_service *service,
 {
 	GSList *list;
 
+	__connman_firewall_begin();
+
 	for (list = info->sessions; list; list = list->next) {
 		struct connman_session *session = list->data;
 
@@ -1927,6 +2109,35 @@ static void handle_service_state_offline(struct connman_service *service,
 		update_session_state(session);
 		session_activate(session);
 	}
+
+	__connman_firewall_end();
+}
+
+static void service_type_add(struct connman_service_info *info)
+{
+	gpointer type;
+	GSList *list;
+
+	type = GINT_TO_POINTER(connman_service_get_type(info->service));
+
+	list = g_hash_table_lookup(service_type_hash, type);
+	list = g_slist_append(list, info);
+	g_hash_table_replace(service_type_hash, type, list);
+}
+
+static void service_type_remove(struct connman_service_info *info)
+{
+	gpointer type;
+	GSList *list;
+
+	type = GINT_TO_POINTER(connman_service_get_type(info->service));
+
+	list = g_hash_table_lookup(service_type_hash, type);
+	list = g_slist_remove(list, info);
+	if (list)
+		g_hash_table_replace(service_type_hash, type, list);
+	else
+		g_hash_table_remove(service_type_hash, type);
 }
 
 static void service_state_changed(struct connman_service *service,
@@ -1950,6 +2161,7 @@ static void service_state_changed(struct connman_service *service,
 
 		handle_service_state_offline(service, info);
 
+		service_type_remove(info);
 		g_hash_table_remove(service_hash, service);
 
 		return;
@@ -1957,10 +2169,11 @@ static void service_state_changed(struct connman_service *service,
 	case CONNMAN_SERVICE_STATE_ONLINE:
 		if (!info) {
 			info = g_new0(struct connman_service_info, 1);
+			info->service = service;
 			g_hash_table_replace(service_hash, service, info);
+			service_type_add(info);
 		}
 
-		info->service = service;
 		handle_service_state_online(service, state, info);
 	}
 }
@@ -1978,6 +2191,8 @@ static void ipconfig_changed(struct connman_service *service,
 
 	type = __connman_ipconfig_get_config_type(ipconfig);
 
+	__connman_firewall_begin();
+
 	g_hash_table_iter_init(&iter, session_hash);
 
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
@@ -1996,6 +2211,8 @@ static void ipconfig_changed(struct connman_service *service,
 				ipconfig_ipv6_changed(session);
 		}
 	}
+
+	__connman_firewall_end();
 }
 
 static struct connman_notifier session_notifier = {
@@ -2025,6 +2242,11 @@ int __connman_session_init(void)
 
 	service_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 						NULL, cleanup_service);
+
+	bearer_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, NULL);
+	service_type_hash = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, free_list);
 	return 0;
 }
 
@@ -2042,6 +2264,10 @@ void __connman_session_cleanup(void)
 	session_hash = NULL;
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
+	g_hash_table_destroy(service_type_hash);
+	service_type_hash = NULL;
+	g_hash_table_destroy(bearer_hash);
+	bearer_hash = NULL;
 
 	dbus_connection_unref(connection);
 }
@@ -83,8 +83,37 @@
  *   Same format as the ring buffer file
  *   For a period of at least 2 months dayly records are keept
  *   If older, then only a monthly record is keept
+ *
+ * Rollup file:
+ *   Traffic per minute, hour and day for home and roaming
+ *   One fixed size tier of buckets per resolution, see stats_tiers
+ *   The bucket of a point in time is found by its index
+ *   (time / resolution) modulo the number of buckets in the tier
+ *   A bucket whose start time does not match is stale and reused
+ *   Every update adds the difference to the previous counters to
+ *   the current bucket of each tier
  */
 
+#define ROLLUP_MAGIC 0xFA00B917
+#define ROLLUP_VERSION 1
+
+static const struct stats_tier {
+	unsigned int resolution;
+	unsigned int buckets;
+} stats_tiers[] = {
+	{ 60,		2 * 60 },	/* minutes of the last 2 hours */
+	{ 60 * 60,	3 * 24 },	/* hours of the last 3 days */
+	{ 24 * 60 * 60,	366 },		/* days of the last year */
+	{ },
+};
+
+struct stats_rollup_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int valid[2];
+	struct connman_stats_data last[2];
+};
+
 
 struct stats_file_header {
 	unsigned int magic;
@@ -116,6 +145,11 @@ struct stats_file {
 	/* history */
 	char *history_name;
 	int account_period_offset;
+
+	/* rollup */
+	int rollup_fd;
+	char *rollup_addr;
+	size_t rollup_len;
 };
 
 struct stats_iter {
@@ -236,6 +270,17 @@ static void stats_free(gpointer user_data)
 	g_free(file->name);
 	file->name = NULL;
 
+	if (file->rollup_addr) {
+		msync(file->rollup_addr, file->rollup_len, MS_SYNC);
+		munmap(file->rollup_addr, file->rollup_len);
+		file->rollup_addr = NULL;
+	}
+
+	if (file->rollup_fd >= 0) {
+		close(file->rollup_fd);
+		file->rollup_fd = -1;
+	}
+
 	g_free(file);
 }
 
@@ -669,6 +714,147 @@ static int stats_file_history_update(struct stats_file *data_file)
 	return err;
 }
 
+static size_t rollup_size(void)
+{
+	size_t size = sizeof(struct stats_rollup_header);
+	int i;
+
+	for (i = 0; stats_tiers[i].resolution; i++)
+		size += stats_tiers[i].buckets *
+				sizeof(struct connman_stats_bucket);
+
+	return size;
+}
+
+static struct connman_stats_bucket *rollup_tier(struct stats_file *file,
+								int tier)
+{
+	size_t offset = sizeof(struct stats_rollup_header);
+	int i;
+
+	for (i = 0; i < tier; i++)
+		offset += stats_tiers[i].buckets *
+				sizeof(struct connman_stats_bucket);
+
+	return (struct connman_stats_bucket *)(file->rollup_addr + offset);
+}
+
+static int rollup_open(struct stats_file *file, const char *name)
+{
+	struct stats_rollup_header *hdr;
+	size_t size = rollup_size();
+	struct stat st;
+	void *addr;
+
+	file->rollup_fd = TFR(open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+	if (file->rollup_fd < 0) {
+		connman_error("open error %s for %s", strerror(errno), name);
+		return -errno;
+	}
+
+	if (fstat(file->rollup_fd, &st) < 0 ||
+			(size_t)st.st_size != size) {
+		if (ftruncate(file->rollup_fd, size) < 0) {
+			connman_error("ftrunctate error %s for %s",
+					strerror(errno), name);
+			goto err;
+		}
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+						file->rollup_fd, 0);
+	if (addr == MAP_FAILED) {
+		connman_error("mmap error %s for %s", strerror(errno), name);
+		goto err;
+	}
+
+	file->rollup_addr = addr;
+	file->rollup_len = size;
+
+	hdr = (struct stats_rollup_header *)file->rollup_addr;
+	if (hdr->magic != ROLLUP_MAGIC || hdr->version != ROLLUP_VERSION) {
+		memset(file->rollup_addr, 0, size);
+		hdr->magic = ROLLUP_MAGIC;
+		hdr->version = ROLLUP_VERSION;
+	}
+
+	/*
+	 * The counters stored by an earlier run do not continue where
+	 * the new ones start, the first update only sets the baseline.
+	 */
+	memset(hdr->valid, 0, sizeof(hdr->valid));
+
+	return 0;
+
+err:
+	close(file->rollup_fd);
+	file->rollup_fd = -1;
+
+	return -errno;
+}
+
+static unsigned int counter_delta(unsigned int cur, unsigned int last)
+{
+	/* The counters start again from zero after a reset */
+	if (cur < last)
+		return cur;
+
+	return cur - last;
+}
+
+static void rollup_add(struct connman_stats_total *total,
+				struct connman_stats_data *cur,
+				struct connman_stats_data *last)
+{
+	total->rx_bytes += counter_delta(cur->rx_bytes, last->rx_bytes);
+	total->tx_bytes += counter_delta(cur->tx_bytes, last->tx_bytes);
+	total->rx_packets += counter_delta(cur->rx_packets, last->rx_packets);
+	total->tx_packets += counter_delta(cur->tx_packets, last->tx_packets);
+	total->rx_errors += counter_delta(cur->rx_errors, last->rx_errors);
+	total->tx_errors += counter_delta(cur->tx_errors, last->tx_errors);
+	total->rx_dropped += counter_delta(cur->rx_dropped, last->rx_dropped);
+	total->tx_dropped += counter_delta(cur->tx_dropped, last->tx_dropped);
+	total->time += counter_delta(cur->time, last->time);
+}
+
+static void rollup_update(struct stats_file *file, bool roaming,
+				struct connman_stats_data *data, time_t ts)
+{
+	struct stats_rollup_header *hdr;
+	int i;
+
+	if (!file->rollup_addr)
+		return;
+
+	hdr = (struct stats_rollup_header *)file->rollup_addr;
+
+	/*
+	 * The first update after registering only provides the base
+	 * the following updates are compared to.
+	 */
+	if (hdr->valid[roaming]) {
+		for (i = 0; stats_tiers[i].resolution; i++) {
+			const struct stats_tier *tier = &stats_tiers[i];
+			struct connman_stats_bucket *bucket;
+			time_t start = ts - ts % tier->resolution;
+
+			bucket = rollup_tier(file, i) +
+				(ts / tier->resolution) % tier->buckets;
+
+			if (bucket->start != start) {
+				memset(bucket, 0, sizeof(*bucket));
+				bucket->start = start;
+			}
+
+			rollup_add(roaming ? &bucket->roaming : &bucket->home,
+						data, &hdr->last[roaming]);
+		}
+	}
+
+	memcpy(&hdr->last[roaming], data, sizeof(*data));
+	hdr->valid[roaming] = true;
+}
+
 int __connman_stats_service_register(struct connman_service *service)
 {
 	struct stats_file *file;
@@ -700,6 +886,7 @@ int __connman_stats_service_register(struct connman_service *service)
 			return -ENOMEM;
 
 		file->fd = -1;
+		file->rollup_fd = -1;
 
 		g_hash_table_insert(stats_hash, service, file);
 	} else {
@@ -723,6 +910,12 @@ int __connman_stats_service_register(struct connman_service *service)
 	if (err < 0)
 		goto err;
 
+	/* The statistics keep working without rollups */
+	name = g_strdup_printf("%s/%s/rollup", STORAGEDIR,
+				__connman_service_get_ident(service));
+	rollup_open(file, name);
+	g_free(name);
+
 	return 0;
 
 err:
@@ -774,6 +967,8 @@ int  __connman_stats_update(struct connman_service *service,
 	next->roaming = roaming;
 	memcpy(&next->data, data, sizeof(struct connman_stats_data));
 
+	rollup_update(file, roaming, data, next->ts);
+
 	if (!roaming)
 		set_home(file, next);
 	else
@@ -808,6 +1003,75 @@ int __connman_stats_get(struct connman_service *service,
 	return 0;
 }
 
+/*
+ * Return the buckets of the given resolution in seconds that start
+ * within [start, end), oldest first. The caller has to free the
+ * buckets.
+ */
+int __connman_stats_get_range(struct connman_service *service,
+				unsigned int resolution,
+				time_t start, time_t end,
+				struct connman_stats_bucket **buckets,
+				unsigned int *count)
+{
+	const struct stats_tier *tier = NULL;
+	struct connman_stats_bucket *first, *result;
+	struct stats_file *file;
+	unsigned int n = 0;
+	time_t oldest, newest, ts;
+	int i;
+
+	file = g_hash_table_lookup(stats_hash, service);
+	if (!file)
+		return -EEXIST;
+
+	if (!file->rollup_addr)
+		return -ENOENT;
+
+	for (i = 0; stats_tiers[i].resolution; i++) {
+		if (stats_tiers[i].resolution == resolution) {
+			tier = &stats_tiers[i];
+			break;
+		}
+	}
+
+	if (!tier)
+		return -EINVAL;
+
+	first = rollup_tier(file, i);
+
+	/* Buckets older than this have been reused already */
+	ts = time(NULL);
+	oldest = ts - ts % resolution -
+			(time_t)(tier->buckets - 1) * resolution;
+	if (start < oldest)
+		start = oldest;
+
+	/* and there are none behind the current one */
+	newest = ts - ts % resolution + resolution;
+	if (end > newest)
+		end = newest;
+
+	start -= start % resolution;
+
+	result = g_new0(struct connman_stats_bucket, tier->buckets);
+
+	for (ts = start; ts < end && n < tier->buckets; ts += resolution) {
+		struct connman_stats_bucket *bucket;
+
+		bucket = first + (ts / resolution) % tier->buckets;
+		if (bucket->start != ts)
+			continue;
+
+		memcpy(&result[n++], bucket, sizeof(*bucket));
+	}
+
+	*buckets = result;
+	*count = n;
+
+	return 0;
+}
+
 int __connman_stats_init(void)
 {
 	DBG("");
@@ -34,10 +34,41 @@
 
 #define SETTINGS	"settings"
 #define DEFAULT		"default.profile"
+#define INDEX		"services.index"
 
 #define MODE		(S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | \
 			S_IXGRP | S_IROTH | S_IXOTH)
 
+/*
+ * The service index holds a copy of the frequently queried settings
+ * of all stored services, one group per service, so that they can be
+ * looked up without reading every settings file.
+ */
+static const char *index_keys[] = {
+	"Name",
+	"SSID",
+	"Favorite",
+	"AutoConnect",
+	"Hidden",
+	"Modified",
+	"Frequency",
+	"Config.file",
+	"Config.ident",
+	NULL
+};
+
+static GKeyFile *service_index = NULL;
+
+/*
+ * Service settings are not written right away but collected and
+ * written together after this delay in seconds, so that a burst of
+ * changes to one or more services results in one write per service.
+ */
+#define FLUSH_DELAY	2
+
+static GHashTable *pending_services = NULL;
+static guint flush_timeout = 0;
+
 static GKeyFile *storage_load(const char *pathname)
 {
 	GKeyFile *keyfile = NULL;
@@ -161,11 +192,36 @@ GKeyFile *__connman_storage_load_provider_config(const char *ident)
 	return keyfile;
 }
 
+static GKeyFile *pending_load(const char *service_id)
+{
+	GKeyFile *keyfile;
+	gchar *data;
+
+	if (!pending_services)
+		return NULL;
+
+	data = g_hash_table_lookup(pending_services, service_id);
+	if (!data)
+		return NULL;
+
+	keyfile = g_key_file_new();
+	if (!g_key_file_load_from_data(keyfile, data, -1, 0, NULL)) {
+		g_key_file_free(keyfile);
+		return NULL;
+	}
+
+	return keyfile;
+}
+
 GKeyFile *__connman_storage_open_service(const char *service_id)
 {
 	gchar *pathname;
 	GKeyFile *keyfile = NULL;
 
+	keyfile = pending_load(service_id);
+	if (keyfile)
+		return keyfile;
+
 	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id, SETTINGS);
 	if (!pathname)
 		return NULL;
@@ -183,59 +239,171 @@ GKeyFile *__connman_storage_open_service(const char *service_id)
 	return keyfile;
 }
 
-gchar **connman_storage_get_services(void)
+static void index_update(GKeyFile *keyfile, const char *service_id,
+							time_t mtime)
+{
+	int i;
+
+	g_key_file_remove_group(service_index, service_id, NULL);
+
+	for (i = 0; index_keys[i]; i++) {
+		gchar *value;
+
+		value = g_key_file_get_value(keyfile, service_id,
+						index_keys[i], NULL);
+		if (!value)
+			continue;
+
+		g_key_file_set_value(service_index, service_id,
+						index_keys[i], value);
+		g_free(value);
+	}
+
+	/* The modification time also creates the group */
+	g_key_file_set_int64(service_index, service_id, "Mtime", mtime);
+}
+
+static int index_save(void)
+{
+	gchar *pathname;
+	int ret;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, INDEX);
+	ret = storage_save(service_index, pathname);
+	g_free(pathname);
+
+	return ret;
+}
+
+static bool is_service_dir(const char *name, struct stat *st)
 {
-	struct dirent *d;
 	gchar *str;
-	DIR *dir;
-	GString *result;
-	gchar **services = NULL;
-	struct stat buf;
 	int ret;
 
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+			strncmp(name, "provider_", 9) == 0)
+		return false;
+
+	/*
+	 * If the settings file is not found, then
+	 * assume this directory is not a services dir.
+	 */
+	str = g_strdup_printf("%s/%s/%s", STORAGEDIR, name, SETTINGS);
+	ret = stat(str, st);
+	g_free(str);
+
+	return ret == 0;
+}
+
+/*
+ * The index is loaded and checked against the service directories on
+ * first use. Only services added or modified behind our back have
+ * their settings file parsed, afterwards the index is kept up to date
+ * whenever a service is saved or removed.
+ */
+static GKeyFile *index_get(void)
+{
+	GHashTable *seen;
+	gchar **groups, *pathname;
+	struct dirent *d;
+	struct stat st;
+	bool changed = false;
+	DIR *dir;
+	int i;
+
+	if (service_index)
+		return service_index;
+
+	/* Make sure the directories of pending services exist */
+	__connman_storage_sync();
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, INDEX);
+	service_index = storage_load(pathname);
+	g_free(pathname);
+
+	if (!service_index) {
+		service_index = g_key_file_new();
+		changed = true;
+	}
+
 	dir = opendir(STORAGEDIR);
 	if (!dir)
-		return NULL;
+		return service_index;
 
-	result = g_string_new(NULL);
+	seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
 	while ((d = readdir(dir))) {
-		if (strcmp(d->d_name, ".") == 0 ||
-				strcmp(d->d_name, "..") == 0 ||
-				strncmp(d->d_name, "provider_", 9) == 0)
+		GKeyFile *keyfile;
+		gint64 mtime;
+
+		if (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN)
 			continue;
 
-		switch (d->d_type) {
-		case DT_DIR:
-		case DT_UNKNOWN:
-			/*
-			 * If the settings file is not found, then
-			 * assume this directory is not a services dir.
-			 */
-			str = g_strdup_printf("%s/%s/settings", STORAGEDIR,
-								d->d_name);
-			ret = stat(str, &buf);
-			g_free(str);
-			if (ret < 0)
-				continue;
+		if (!is_service_dir(d->d_name, &st))
+			continue;
 
-			g_string_append_printf(result, "%s/", d->d_name);
-			break;
-		}
+		g_hash_table_replace(seen, g_strdup(d->d_name), seen);
+
+		mtime = g_key_file_get_int64(service_index, d->d_name,
+							"Mtime", NULL);
+		if (g_key_file_has_group(service_index, d->d_name) &&
+						mtime == st.st_mtime)
+			continue;
+
+		DBG("indexing %s", d->d_name);
+
+		keyfile = connman_storage_load_service(d->d_name);
+		if (!keyfile)
+			continue;
+
+		index_update(keyfile, d->d_name, st.st_mtime);
+		g_key_file_free(keyfile);
+		changed = true;
 	}
 
 	closedir(dir);
 
-	str = g_string_free(result, FALSE);
-	if (str && str[0] != '\0') {
-		/*
-		 * Remove the trailing separator so that services doesn't end up
-		 * with an empty element.
-		 */
-		str[strlen(str) - 1] = '\0';
-		services = g_strsplit(str, "/", -1);
+	groups = g_key_file_get_groups(service_index, NULL);
+	for (i = 0; groups && groups[i]; i++) {
+		if (g_hash_table_lookup(seen, groups[i]))
+			continue;
+
+		g_key_file_remove_group(service_index, groups[i], NULL);
+		changed = true;
+	}
+	g_strfreev(groups);
+
+	g_hash_table_destroy(seen);
+
+	if (changed)
+		index_save();
+
+	return service_index;
+}
+
+/**
+ * connman_storage_get_service_index:
+ *
+ * Get the index of the stored services. It contains one group per
+ * service with the Name, SSID, Favorite, AutoConnect, Hidden,
+ * Modified, Frequency, Config.file and Config.ident settings, if set.
+ * The key file is owned by the storage and must not be modified or
+ * freed.
+ */
+GKeyFile *connman_storage_get_service_index(void)
+{
+	return index_get();
+}
+
+gchar **connman_storage_get_services(void)
+{
+	gchar **services;
+
+	services = g_key_file_get_groups(index_get(), NULL);
+	if (services && !services[0]) {
+		g_strfreev(services);
+		return NULL;
 	}
-	g_free(str);
 
 	return services;
 }
@@ -245,6 +413,10 @@ GKeyFile *connman_storage_load_service(const char *service_id)
 	gchar *pathname;
 	GKeyFile *keyfile = NULL;
 
+	keyfile = pending_load(service_id);
+	if (keyfile)
+		return keyfile;
+
 	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id, SETTINGS);
 	if (!pathname)
 		return NULL;
@@ -255,10 +427,11 @@ GKeyFile *connman_storage_load_service(const char *service_id)
 	return keyfile;
 }
 
-int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
+static int service_write(const char *service_id, const gchar *data)
 {
-	int ret = 0;
 	gchar *pathname, *dirname;
+	GError *error = NULL;
+	struct stat st;
 
 	dirname = g_strdup_printf("%s/%s", STORAGEDIR, service_id);
 	if (!dirname)
@@ -278,11 +451,100 @@ int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 
 	g_free(dirname);
 
-	ret = storage_save(keyfile, pathname);
+	if (!g_file_set_contents(pathname, data, -1, &error)) {
+		DBG("Failed to store information: %s", error->message);
+		g_error_free(error);
+		g_free(pathname);
+		return -EIO;
+	}
+
+	if (service_index && stat(pathname, &st) == 0)
+		g_key_file_set_int64(service_index, service_id, "Mtime",
+							st.st_mtime);
 
 	g_free(pathname);
 
-	return ret;
+	return 0;
+}
+
+/*
+ * Write all pending service settings. This is the durability barrier
+ * used on shutdown and after changes explicitly requested by the user.
+ */
+void __connman_storage_sync(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (flush_timeout) {
+		g_source_remove(flush_timeout);
+		flush_timeout = 0;
+	}
+
+	if (!pending_services || g_hash_table_size(pending_services) == 0)
+		return;
+
+	DBG("writing %d services", g_hash_table_size(pending_services));
+
+	g_hash_table_iter_init(&iter, pending_services);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		service_write(key, value);
+
+	g_hash_table_remove_all(pending_services);
+
+	if (service_index)
+		index_save();
+}
+
+static gboolean flush_cb(gpointer user_data)
+{
+	flush_timeout = 0;
+
+	__connman_storage_sync();
+
+	return FALSE;
+}
+
+int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
+{
+	gchar *data;
+
+	data = g_key_file_to_data(keyfile, NULL, NULL);
+	if (!data)
+		return -ENOMEM;
+
+	if (!pending_services)
+		pending_services = g_hash_table_new_full(g_str_hash,
+					g_str_equal, g_free, g_free);
+
+	g_hash_table_replace(pending_services, g_strdup(service_id), data);
+
+	/* The modification time is filled in once the file is written */
+	if (service_index)
+		index_update(keyfile, service_id, 0);
+
+	if (!flush_timeout)
+		flush_timeout = g_timeout_add_seconds(FLUSH_DELAY, flush_cb,
+									NULL);
+
+	return 0;
+}
+
+void __connman_storage_cleanup(void)
+{
+	DBG("");
+
+	__connman_storage_sync();
+
+	if (pending_services) {
+		g_hash_table_destroy(pending_services);
+		pending_services = NULL;
+	}
+
+	if (service_index) {
+		g_key_file_free(service_index);
+		service_index = NULL;
+	}
 }
 
 static bool remove_file(const char *service_id, const char *file)
@@ -329,6 +591,9 @@ bool __connman_storage_remove_service(const char *service_id)
 {
 	bool removed;
 
+	if (pending_services)
+		g_hash_table_remove(pending_services, service_id);
+
 	/* Remove service configuration file */
 	removed = remove_file(service_id, SETTINGS);
 	if (!removed)
@@ -339,12 +604,20 @@ bool __connman_storage_remove_service(const char *service_id)
 	if (!removed)
 		return false;
 
+	removed = remove_file(service_id, "rollup");
+	if (!removed)
+		return false;
+
 	removed = remove_dir(service_id);
 	if (!removed)
 		return false;
 
 	DBG("Removed service dir %s/%s", STORAGEDIR, service_id);
 
+	if (service_index &&
+			g_key_file_remove_group(service_index, service_id, NULL))
+		index_save();
+
 	return true;
 }
 
@@ -631,6 +631,11 @@ static void append_properties(DBusMessageIter *iter,
 	connman_dbus_dict_close(iter, &dict);
 }
 
+static void append_object_properties(DBusMessageIter *iter, void *user_data)
+{
+	append_properties(iter, user_data);
+}
+
 static void technology_added_signal(struct connman_technology *technology)
 {
 	DBusMessage *signal;
@@ -1257,10 +1262,11 @@ static bool technology_dbus_register(struct connman_technology *technology)
 				 technology->hardblocked))
 		return true;
 
-	if (!g_dbus_register_interface(connection, technology->path,
+	if (!g_dbus_register_interface_dict(connection, technology->path,
 					CONNMAN_TECHNOLOGY_INTERFACE,
 					technology_methods, technology_signals,
-					NULL, technology, NULL)) {
+					append_object_properties, technology,
+					NULL)) {
 		connman_error("Failed to register %s", technology->path);
 		return false;
 	}
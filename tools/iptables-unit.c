@@ -318,6 +318,78 @@ static void test_iptables_target0(void)
 	assert_rule_not_exists("filter", "-A INPUT -m mark --mark 0x2");
 }
 
+static void test_iptables_transaction0(void)
+{
+	int err;
+
+	/* Test if a transaction replaces the tables only at the end */
+
+	__connman_iptables_begin();
+
+	err = __connman_iptables_new_chain("filter", "foo");
+	g_assert(err == 0);
+
+	err = __connman_iptables_append("filter", "foo",
+					"-m mark --mark 1 -j LOG");
+	g_assert(err == 0);
+
+	err = __connman_iptables_commit("filter");
+	g_assert(err == 0);
+
+	err = __connman_iptables_insert("filter", "INPUT", "-j foo");
+	g_assert(err == 0);
+
+	err = __connman_iptables_append("nat", "POSTROUTING",
+				"-s 10.10.1.0/24 -o eth0 -j MASQUERADE");
+	g_assert(err == 0);
+
+	err = __connman_iptables_commit("filter");
+	g_assert(err == 0);
+
+	err = __connman_iptables_commit("nat");
+	g_assert(err == 0);
+
+	assert_rule_not_exists("filter", ":foo - [0:0]");
+
+	err = __connman_iptables_end();
+	g_assert(err == 0);
+
+	assert_rule_exists("filter", ":foo - [0:0]");
+	assert_rule_exists("filter", "-A INPUT -j foo");
+	assert_rule_exists("filter", "-A foo -m mark --mark 0x1 -j LOG");
+	assert_rule_exists("nat",
+		"-A POSTROUTING -s 10.10.1.0/24 -o eth0 -j MASQUERADE");
+
+	__connman_iptables_begin();
+
+	err = __connman_iptables_delete("filter", "INPUT", "-j foo");
+	g_assert(err == 0);
+
+	err = __connman_iptables_flush_chain("filter", "foo");
+	g_assert(err == 0);
+
+	err = __connman_iptables_delete_chain("filter", "foo");
+	g_assert(err == 0);
+
+	err = __connman_iptables_delete("nat", "POSTROUTING",
+				"-s 10.10.1.0/24 -o eth0 -j MASQUERADE");
+	g_assert(err == 0);
+
+	err = __connman_iptables_commit("filter");
+	g_assert(err == 0);
+
+	err = __connman_iptables_commit("nat");
+	g_assert(err == 0);
+
+	err = __connman_iptables_end();
+	g_assert(err == 0);
+
+	assert_rule_not_exists("filter", ":foo - [0:0]");
+	assert_rule_not_exists("filter", "-A INPUT -j foo");
+	assert_rule_not_exists("nat",
+		"-A POSTROUTING -s 10.10.1.0/24 -o eth0 -j MASQUERADE");
+}
+
 struct connman_notifier *nat_notifier;
 
 struct connman_service {
@@ -462,6 +534,7 @@ int main(int argc, char *argv[])
 	g_test_add_func("/iptables/rule1",  test_iptables_rule1);
 	g_test_add_func("/iptables/rule2",  test_iptables_rule2);
 	g_test_add_func("/iptables/target0", test_iptables_target0);
+	g_test_add_func("/iptables/transaction0", test_iptables_transaction0);
 	g_test_add_func("/nat/basic0", test_nat_basic0);
 	g_test_add_func("/nat/basic1", test_nat_basic1);
 
@@ -431,6 +431,123 @@ static void test_case_6(void)
 	__connman_ippool_cleanup();
 }
 
+static void test_case_7(void)
+{
+	struct connman_ippool *pool, *pools[127];
+	GHashTable *gateways;
+	char *gateway;
+	unsigned int i;
+
+	__connman_ippool_init();
+
+	/*
+	 * Learned routes the allocator has to skip, only the blocks
+	 * 192.168.128.0 to 192.168.254.0 are left.
+	 */
+	__connman_ippool_newaddr(45, "192.168.0.1", 17);
+	__connman_ippool_newaddr(46, "172.16.0.1", 13);
+	__connman_ippool_newaddr(47, "172.24.0.1", 13);
+	__connman_ippool_newaddr(48, "10.0.0.1", 8);
+
+	gateways = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (i = 0; i < G_N_ELEMENTS(pools); i++) {
+		pools[i] = __connman_ippool_create(23, 1, 100, NULL, NULL);
+		g_assert(pools[i]);
+
+		gateway = g_strdup_printf("192.168.%u.1", 128 + i);
+		g_assert_cmpstr(__connman_ippool_get_gateway(pools[i]), ==,
+								gateway);
+		g_free(gateway);
+
+		/* every pool gets a block of its own */
+		gateway = (char *) __connman_ippool_get_gateway(pools[i]);
+		g_assert(!g_hash_table_lookup(gateways, gateway));
+		g_hash_table_insert(gateways, gateway, gateway);
+	}
+
+	g_hash_table_destroy(gateways);
+
+	pool = __connman_ippool_create(23, 1, 100, NULL, NULL);
+	g_assert(!pool);
+
+	/* The search wraps around to the block freed last */
+	__connman_ippool_unref(pools[2]);
+	pools[2] = __connman_ippool_create(23, 1, 100, NULL, NULL);
+	g_assert(pools[2]);
+	g_assert_cmpstr(__connman_ippool_get_gateway(pools[2]), ==,
+							"192.168.130.1");
+
+	/* and continues behind the last assigned block before wrapping */
+	__connman_ippool_unref(pools[1]);
+	__connman_ippool_unref(pools[72]);
+
+	pools[72] = __connman_ippool_create(23, 1, 100, NULL, NULL);
+	g_assert(pools[72]);
+	g_assert_cmpstr(__connman_ippool_get_gateway(pools[72]), ==,
+							"192.168.200.1");
+
+	pools[1] = __connman_ippool_create(23, 1, 100, NULL, NULL);
+	g_assert(pools[1]);
+	g_assert_cmpstr(__connman_ippool_get_gateway(pools[1]), ==,
+							"192.168.129.1");
+
+	for (i = 0; i < G_N_ELEMENTS(pools); i++)
+		__connman_ippool_unref(pools[i]);
+
+	__connman_ippool_cleanup();
+}
+
+static void test_case_8(void)
+{
+	struct connman_ippool *pool;
+	GSList *list, *it;
+	unsigned int n, i;
+	double elapsed;
+
+	if (!g_test_perf())
+		return;
+
+	/*
+	 * Scaling benchmark: the time needed per pool should not depend
+	 * on the number of blocks already in use.
+	 */
+	for (n = 256; n <= 65536; n *= 4) {
+		__connman_ippool_init();
+
+		/* Learned routes the allocator has to skip */
+		__connman_ippool_newaddr(45, "192.168.0.1", 17);
+		__connman_ippool_newaddr(46, "172.16.0.1", 13);
+
+		list = NULL;
+
+		g_test_timer_start();
+
+		for (i = 0; i < n; i++) {
+			pool = __connman_ippool_create(23, 1, 100, NULL, NULL);
+			g_assert(pool);
+
+			list = g_slist_prepend(list, pool);
+		}
+
+		elapsed = g_test_timer_elapsed();
+
+		g_test_minimized_result(elapsed * 1000000 / n,
+				"%u blocks: %.3f us per pool", n,
+				elapsed * 1000000 / n);
+
+		for (it = list; it; it = it->next) {
+			pool = it->data;
+
+			__connman_ippool_unref(pool);
+		}
+
+		g_slist_free(list);
+
+		__connman_ippool_cleanup();
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
@@ -441,6 +558,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/ippool/Test case 4", test_case_4);
 	g_test_add_func("/ippool/Test case 5", test_case_5);
 	g_test_add_func("/ippool/Test case 6", test_case_6);
+	g_test_add_func("/ippool/Test case 7", test_case_7);
+	g_test_add_func("/ippool/Test case 8", test_case_8);
 
 	return g_test_run();
 }
@@ -1598,6 +1598,11 @@ int vpn_provider_indicate_error(struct vpn_provider *provider,
 	return 0;
 }
 
+static void append_object_properties(DBusMessageIter *iter, void *user_data)
+{
+	append_properties(iter, user_data);
+}
+
 static int connection_unregister(struct vpn_provider *provider)
 {
 	DBG("provider %p path %s", provider, provider->path);
@@ -1624,10 +1629,10 @@ static int connection_register(struct vpn_provider *provider)
 	provider->path = g_strdup_printf("%s/connection/%s", VPN_PATH,
 						provider->identifier);
 
-	g_dbus_register_interface(connection, provider->path,
+	g_dbus_register_interface_dict(connection, provider->path,
 				VPN_CONNECTION_INTERFACE,
 				connection_methods, connection_signals,
-				NULL, provider, NULL);
+				append_object_properties, provider, NULL);
 
 	return 0;
 }